@@ -0,0 +1,557 @@
+// bench.c
+//
+// Microbenchmarks for the math, projection, collision and rasterization hot
+// paths. Each benchmark reports ns per operation; results can be saved as a
+// baseline and later runs compared against it, so a regression shows up on
+// the function that caused it.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vector.h"
+#include "particle.h"
+#include "physics.h"
+#include "grid.h"
+#include "raster.h"
+#include "view.h"
+#include "threadpool.h"
+#include "glyphs.h"
+#include "sprite.h"
+#include "timer.h"
+
+#define INPUT_COUNT 4096
+#define MAX_BENCHMARKS 64
+
+typedef struct {
+    const char* name;
+    void (*setup)(int param);
+    long long (*run)(long long iterations);  // Returns the number of operations done
+    int param;
+} Benchmark;
+
+typedef struct {
+    char name[64];
+    double nsPerOp;
+} BaselineEntry;
+
+// Inputs shared by the benchmarks, rebuilt by each setup function
+static Vec3D vectors[INPUT_COUNT];
+static Vec3D directions[INPUT_COUNT];
+static float angles[INPUT_COUNT][2];
+static Camera benchCamera;
+static ParticleStore scene;
+static ParticleStore pristine;
+static int* pairList;
+static int pairCount;
+static uint32_t* framebuffer;
+static int circleRadius;
+static volatile float sink;
+
+static const Camera cameraPoses[] = {
+    {{0.0f, 0.0f, -3.0f}, 0.0f, 0.0f},     // Default view of the whole cube
+    {{1.5f, 1.0f, -2.5f}, 0.3f, -0.5f},    // Oblique, pitched and yawed
+    {{0.0f, 0.0f, -1.2f}, 0.0f, 0.0f}      // Close up, cube fills the screen
+};
+
+static float benchRandom(float low, float high) {
+    return low + (high - low) * (rand() / (float)RAND_MAX);
+}
+
+static void setupVectors(int param) {
+    srand(42);
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        vectors[i] = (Vec3D){benchRandom(-0.5f, 0.5f), benchRandom(-0.5f, 0.5f), benchRandom(-0.5f, 0.5f)};
+        directions[i] = (Vec3D){benchRandom(-1.0f, 1.0f), benchRandom(-1.0f, 1.0f), benchRandom(0.1f, 1.0f)};
+        angles[i][0] = benchRandom(-3.14f, 3.14f);
+        angles[i][1] = benchRandom(-3.14f, 3.14f);
+    }
+    benchCamera = cameraPoses[param];
+}
+
+static long long runRotate(long long iterations) {
+    float sum = 0.0f;
+    for (long long it = 0; it < iterations; it++) {
+        for (int i = 0; i < INPUT_COUNT; i++) {
+            sum += rotate(vectors[i], angles[i][0], angles[i][1]).x;
+        }
+    }
+    sink = sum;
+    return iterations * INPUT_COUNT;
+}
+
+static long long runOrthogonalProjection(long long iterations) {
+    float sum = 0.0f;
+    for (long long it = 0; it < iterations; it++) {
+        for (int i = 0; i < INPUT_COUNT; i++) {
+            sum += orthogonalProjection(vectors[i], directions[i]).y;
+        }
+    }
+    sink = sum;
+    return iterations * INPUT_COUNT;
+}
+
+static long long runProject(long long iterations) {
+    int sum = 0;
+    for (long long it = 0; it < iterations; it++) {
+        for (int i = 0; i < INPUT_COUNT; i++) {
+            int x2D, y2D;
+            project(benchCamera, vectors[i], &x2D, &y2D);
+            sum += x2D + y2D;
+        }
+    }
+    sink = (float)sum;
+    return iterations * INPUT_COUNT;
+}
+
+// Pairs placed so every one overlaps (param 1) or none do (param 0), with
+// radii spread over the range createParticle uses
+static void setupCollisionPairs(int param) {
+    setupVectors(0);
+    freeParticleStore(&scene);
+    freeParticleStore(&pristine);
+    initParticleStore(&scene, 2 * INPUT_COUNT);
+    initParticleStore(&pristine, 2 * INPUT_COUNT);
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        int a = addParticle(&pristine);
+        int b = addParticle(&pristine);
+        createParticle(&pristine, a, 7, a, 2.0f, 0.1f);
+        createParticle(&pristine, b, 7, b, 2.0f, 0.1f);
+        float separation = (pristine.radius[a] + pristine.radius[b]) * (param ? 0.8f : 1.5f);
+        Vec3D offset = directions[i];
+        float length = magnitudeVec3D(offset);
+        pristine.px[b] = pristine.px[a] + offset.x / length * separation;
+        pristine.py[b] = pristine.py[a] + offset.y / length * separation;
+        pristine.pz[b] = pristine.pz[a] + offset.z / length * separation;
+    }
+    scene.count = pristine.count;
+}
+
+// Every pass restores the pairs before resolving them, so touching pairs stay
+// touching from one iteration to the next
+static long long runCollisionPairs(long long iterations) {
+    size_t bytes = pristine.count * sizeof(float);
+    for (long long it = 0; it < iterations; it++) {
+        memcpy(scene.px, pristine.px, bytes);
+        memcpy(scene.py, pristine.py, bytes);
+        memcpy(scene.pz, pristine.pz, bytes);
+        memcpy(scene.vx, pristine.vx, bytes);
+        memcpy(scene.vy, pristine.vy, bytes);
+        memcpy(scene.vz, pristine.vz, bytes);
+        memcpy(scene.radius, pristine.radius, bytes);
+        for (int i = 0; i < INPUT_COUNT; i++) {
+            handleParticleCollision(&scene, 2 * i, 2 * i + 1);
+        }
+    }
+    sink = scene.px[0];
+    return iterations * INPUT_COUNT;
+}
+
+static bool recordPair(ParticleStore* store, int i, int j, void* context) {
+    pairList[2 * pairCount] = i;
+    pairList[2 * pairCount + 1] = j;
+    pairCount++;
+    return false;
+}
+
+static bool countPair(ParticleStore* store, int i, int j, void* context) {
+    return false;
+}
+
+// Candidate pairs from the grid for a scene of 'param' particles, sized so
+// the density stays roughly the same at every count
+static void setupNarrowPhase(int param) {
+    freeParticleStore(&scene);
+    freeParticleStore(&pristine);
+    initParticleStore(&scene, param);
+    initParticleStore(&pristine, param);
+    float maxRadius = 0.5f / cbrtf((float)param);
+    for (int i = 0; i < param; i++) {
+        createParticle(&pristine, addParticle(&pristine), 11, i, 2.0f, maxRadius);
+    }
+    scene.count = pristine.count;
+
+    SpatialGrid grid;
+    initSpatialGrid(&grid);
+    buildSpatialGrid(&grid, &pristine);
+    int hits = 0;
+    int pairs = forEachCandidatePair(&grid, &pristine, countPair, NULL, &hits);
+    free(pairList);
+    pairList = malloc(2 * (size_t)pairs * sizeof(int));
+    pairCount = 0;
+    forEachCandidatePair(&grid, &pristine, recordPair, NULL, &hits);
+    freeSpatialGrid(&grid);
+}
+
+// The positions are restored before every pass; that copy is part of the
+// measured time but is small next to the pair loop
+static long long runNarrowPhase(long long iterations) {
+    size_t bytes = pristine.count * sizeof(float);
+    for (long long it = 0; it < iterations; it++) {
+        memcpy(scene.px, pristine.px, bytes);
+        memcpy(scene.py, pristine.py, bytes);
+        memcpy(scene.pz, pristine.pz, bytes);
+        memcpy(scene.vx, pristine.vx, bytes);
+        memcpy(scene.vy, pristine.vy, bytes);
+        memcpy(scene.vz, pristine.vz, bytes);
+        memcpy(scene.radius, pristine.radius, bytes);
+        for (int p = 0; p < pairCount; p++) {
+            handleParticleCollision(&scene, pairList[2 * p], pairList[2 * p + 1]);
+        }
+    }
+    sink = scene.px[0];
+    return iterations * pairCount;
+}
+
+static int spawnCount;
+
+// An empty store with room for 'param' particles, so only creating them is timed
+static void setupSpawn(int param) {
+    freeParticleStore(&scene);
+    initParticleStore(&scene, param);
+    spawnCount = param;
+}
+
+static long long runSpawn(long long iterations) {
+    for (long long it = 0; it < iterations; it++) {
+        clearParticles(&scene);
+        seedParticles(1);
+        spawnParticles(&scene, spawnCount, 2.0f, 0.1f);
+    }
+    sink = scene.px[scene.count - 1];
+    return iterations * spawnCount;
+}
+
+static ProjectedParticles projectedScene;
+
+// A scene of 'param' particles seen from the oblique pose
+static void setupTransform(int param) {
+    freeParticleStore(&scene);
+    initParticleStore(&scene, param);
+    for (int i = 0; i < param; i++) {
+        createParticle(&scene, addParticle(&scene), 13, i, 2.0f, 0.1f);
+    }
+    SCREEN_WIDTH = 1280;
+    SCREEN_HEIGHT = 720;
+    benchCamera = cameraPoses[1];
+}
+
+static long long runTransform(long long iterations) {
+    ViewTransform view;
+    for (long long it = 0; it < iterations; it++) {
+        buildViewTransform(&view, benchCamera);
+        transformParticles(&projectedScene, &view, &scene);
+    }
+    sink = (float)projectedScene.count;
+    return iterations * scene.count;
+}
+
+static void setupFramebuffer(int param) {
+    SCREEN_WIDTH = 1280;
+    SCREEN_HEIGHT = 720;
+    free(framebuffer);
+    framebuffer = calloc((size_t)SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+    circleRadius = param;
+    benchCamera = cameraPoses[1];
+}
+
+static long long runFilledCircle(long long iterations) {
+    for (long long it = 0; it < iterations; it++) {
+        drawFilledCircleWithShading(framebuffer, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2, circleRadius, 0xFF3080C0, benchCamera);
+    }
+    sink = (float)framebuffer[SCREEN_HEIGHT / 2 * SCREEN_WIDTH + SCREEN_WIDTH / 2];
+    return iterations;
+}
+
+static DepthBuffer benchDepth;
+
+// The transform scene drawn as one frame: bin, depth test and shade
+static void setupRenderScene(int param) {
+    setupTransform(param);
+    setupFramebuffer(0);
+    ViewTransform view;
+    buildViewTransform(&view, benchCamera);
+    transformParticles(&projectedScene, &view, &scene);
+}
+
+// The same frame at 1920x1080, where the tiles have the most work to share
+static void setupRenderSceneFullHD(int param) {
+    setupRenderScene(param);
+    SCREEN_WIDTH = 1920;
+    SCREEN_HEIGHT = 1080;
+    free(framebuffer);
+    framebuffer = calloc((size_t)SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+    ViewTransform view;
+    buildViewTransform(&view, benchCamera);
+    transformParticles(&projectedScene, &view, &scene);
+}
+
+// A cloud of particles far smaller than a pixel, drawn as point splats
+static void setupRenderCloud(int param) {
+    freeParticleStore(&scene);
+    initParticleStore(&scene, param);
+    for (int i = 0; i < param; i++) {
+        createParticle(&scene, addParticle(&scene), 13, i, 2.0f, 0.002f);
+    }
+    setupFramebuffer(0);
+    ViewTransform view;
+    buildViewTransform(&view, benchCamera);
+    transformParticles(&projectedScene, &view, &scene);
+}
+
+static long long runRenderScene(long long iterations) {
+    for (long long it = 0; it < iterations; it++) {
+        renderParticles(framebuffer, &benchDepth, benchCamera, &scene, &projectedScene);
+    }
+    sink = (float)framebuffer[SCREEN_HEIGHT / 2 * SCREEN_WIDTH + SCREEN_WIDTH / 2];
+    return iterations * projectedScene.count;
+}
+
+// A drawn frame to pick from, so the tile lists of the frame are in place
+static void setupPick(int param) {
+    setupRenderScene(param);
+    renderParticles(framebuffer, &benchDepth, benchCamera, &scene, &projectedScene);
+}
+
+// One pick per iteration, at pixels spread over the whole screen
+static long long runPick(long long iterations) {
+    int hits = 0;
+    for (long long it = 0; it < iterations; it++) {
+        int x = (int)(it * 7919 % SCREEN_WIDTH);
+        int y = (int)(it * 104729 % SCREEN_HEIGHT);
+        hits += pickParticle(x, y, &scene, &projectedScene) >= 0;
+    }
+    sink = (float)hits;
+    return iterations;
+}
+
+static GlyphAtlas benchAtlas;
+
+// A monospace atlas the size of the HUD font, so no font file is needed. Each
+// glyph is a solid bar with an antialiased rim in an otherwise empty cell.
+static void setupGlyphText(int param) {
+    setupFramebuffer(0);
+    if (benchAtlas.coverage != NULL) return;
+    int glyphWidth = 13, glyphHeight = 28;
+    initGlyphAtlas(&benchAtlas, GLYPH_COUNT * glyphWidth, glyphHeight);
+    for (int g = 0; g < GLYPH_COUNT; g++) {
+        benchAtlas.glyphs[g] = (GlyphMetrics){g * glyphWidth, glyphWidth, glyphWidth};
+    }
+    for (int y = 0; y < glyphHeight; y++) {
+        for (int x = 0; x < benchAtlas.width; x++) {
+            int column = x % glyphWidth;
+            bool inside = column >= 4 && column <= 8 && y >= 6 && y <= 22;
+            bool rim = column >= 3 && column <= 9 && y >= 5 && y <= 23;
+            benchAtlas.coverage[y * benchAtlas.width + x] = inside ? 255 : rim ? 128 : 0;
+        }
+    }
+}
+
+// One frame of HUD text: the counters and the particle info panel
+static long long runGlyphText(long long iterations) {
+    static const char* lines[] = {
+        "FPS: 60", "Frame: 4.21 ms", "Particles: 10000", "Pos: (0.12, -0.34, 0.05)",
+        "Velocity comp. (X, Y, Z)", "(0.51, -1.20, 0.33)", "Velocity: (1.34)"
+    };
+    for (long long it = 0; it < iterations; it++) {
+        for (int l = 0; l < 7; l++) {
+            drawGlyphText(framebuffer, &benchAtlas, lines[l], l < 3 ? 10 : SCREEN_WIDTH - 350, 10 + 30 * l, 0xFFFFFFFF);
+        }
+    }
+    sink = (float)framebuffer[10 * SCREEN_WIDTH + 10];
+    return iterations * 7;
+}
+
+static void setupCubeLines(int param) {
+    setupFramebuffer(0);
+    benchCamera = cameraPoses[param];
+}
+
+static long long runCubeLines(long long iterations) {
+    ViewTransform view;
+    buildViewTransform(&view, benchCamera);
+    static const Vec3D cubeVertices[8] = {
+        {-0.5f, -0.5f, -0.5f}, { 0.5f, -0.5f, -0.5f}, { 0.5f,  0.5f, -0.5f}, {-0.5f,  0.5f, -0.5f},
+        {-0.5f, -0.5f,  0.5f}, { 0.5f, -0.5f,  0.5f}, { 0.5f,  0.5f,  0.5f}, {-0.5f,  0.5f,  0.5f}
+    };
+    static const int edges[12][2] = {
+        {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}
+    };
+    for (long long it = 0; it < iterations; it++) {
+        for (int e = 0; e < 12; e++) {
+            drawLine3D(framebuffer, &view, cubeVertices[edges[e][0]], cubeVertices[edges[e][1]], 0xFFFFFFFF);
+        }
+    }
+    sink = (float)framebuffer[0];
+    return iterations * 12;
+}
+
+static const Benchmark benchmarks[] = {
+    {"rotate", setupVectors, runRotate, 0},
+    {"orthogonalProjection", setupVectors, runOrthogonalProjection, 0},
+    {"project/front", setupVectors, runProject, 0},
+    {"project/oblique", setupVectors, runProject, 1},
+    {"project/close", setupVectors, runProject, 2},
+    {"spawnParticles/1000000", setupSpawn, runSpawn, 1000000},
+    {"transformParticles/10000", setupTransform, runTransform, 10000},
+    {"transformParticles/100000", setupTransform, runTransform, 100000},
+    {"handleParticleCollision/miss", setupCollisionPairs, runCollisionPairs, 0},
+    {"handleParticleCollision/hit", setupCollisionPairs, runCollisionPairs, 1},
+    {"handleParticleCollision/scene-1000", setupNarrowPhase, runNarrowPhase, 1000},
+    {"handleParticleCollision/scene-10000", setupNarrowPhase, runNarrowPhase, 10000},
+    {"handleParticleCollision/scene-100000", setupNarrowPhase, runNarrowPhase, 100000},
+    {"drawFilledCircleWithShading/r2", setupFramebuffer, runFilledCircle, 2},
+    {"drawFilledCircleWithShading/r8", setupFramebuffer, runFilledCircle, 8},
+    {"drawFilledCircleWithShading/r32", setupFramebuffer, runFilledCircle, 32},
+    {"drawFilledCircleWithShading/r100", setupFramebuffer, runFilledCircle, 100},
+    {"renderParticles/1000", setupRenderScene, runRenderScene, 1000},
+    {"renderParticles/10000", setupRenderScene, runRenderScene, 10000},
+    {"renderParticles/1080p-50000", setupRenderSceneFullHD, runRenderScene, 50000},
+    {"renderParticles/cloud-1000000", setupRenderCloud, runRenderScene, 1000000},
+    {"pickParticle/100000", setupPick, runPick, 100000},
+    {"drawGlyphText/hud", setupGlyphText, runGlyphText, 0},
+    {"drawLine3D/front", setupCubeLines, runCubeLines, 0},
+    {"drawLine3D/oblique", setupCubeLines, runCubeLines, 1},
+    {"drawLine3D/close", setupCubeLines, runCubeLines, 2},
+};
+
+// Function to time one benchmark: grow the iteration count until a run takes
+// at least 'minTime', then keep the fastest of three runs
+static double measure(const Benchmark* benchmark, double minTime) {
+    benchmark->setup(benchmark->param);
+
+    long long iterations = 1;
+    for (;;) {
+        double start = secondsNow();
+        benchmark->run(iterations);
+        if (secondsNow() - start >= minTime / 4 || iterations >= (1LL << 40)) break;
+        iterations *= 2;
+    }
+
+    double best = 0.0;
+    for (int repeat = 0; repeat < 3; repeat++) {
+        double start = secondsNow();
+        long long ops = benchmark->run(iterations);
+        double nsPerOp = (secondsNow() - start) * 1e9 / (ops > 0 ? ops : 1);
+        if (repeat == 0 || nsPerOp < best) best = nsPerOp;
+    }
+    return best;
+}
+
+static int loadBaseline(const char* path, BaselineEntry* entries, int maxEntries) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open baseline %s\n", path);
+        return -1;
+    }
+    int count = 0;
+    while (count < maxEntries && fscanf(file, "%63s %lf", entries[count].name, &entries[count].nsPerOp) == 2) {
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static const BaselineEntry* findBaseline(const BaselineEntry* entries, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) return &entries[i];
+    }
+    return NULL;
+}
+
+static void printUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --filter TEXT     only run benchmarks whose name contains TEXT\n");
+    printf("  --min-time S      minimum seconds per measurement (default 0.2)\n");
+    printf("  --save FILE       write the results as a baseline file\n");
+    printf("  --baseline FILE   compare against a saved baseline\n");
+    printf("  --threshold PCT   slowdown that counts as a regression (default 10)\n");
+    printf("  --threads N       worker threads for the parallel stages (default 1)\n");
+}
+
+int main(int argc, char* args[]) {
+    const char* filter = NULL;
+    const char* savePath = NULL;
+    const char* baselinePath = NULL;
+    double minTime = 0.2;
+    double threshold = 10.0;
+    int numThreads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(args[i], "--filter") == 0 && hasValue) {
+            filter = args[++i];
+        } else if (strcmp(args[i], "--min-time") == 0 && hasValue) {
+            minTime = atof(args[++i]);
+        } else if (strcmp(args[i], "--save") == 0 && hasValue) {
+            savePath = args[++i];
+        } else if (strcmp(args[i], "--baseline") == 0 && hasValue) {
+            baselinePath = args[++i];
+        } else if (strcmp(args[i], "--threshold") == 0 && hasValue) {
+            threshold = atof(args[++i]);
+        } else if (strcmp(args[i], "--threads") == 0 && hasValue) {
+            numThreads = atoi(args[++i]);
+        } else {
+            printUsage(args[0]);
+            return 1;
+        }
+    }
+
+    BaselineEntry baseline[MAX_BENCHMARKS];
+    int baselineCount = 0;
+    if (baselinePath != NULL) {
+        baselineCount = loadBaseline(baselinePath, baseline, MAX_BENCHMARKS);
+        if (baselineCount < 0) return 1;
+    }
+    FILE* saveFile = NULL;
+    if (savePath != NULL) {
+        saveFile = fopen(savePath, "w");
+        if (saveFile == NULL) {
+            fprintf(stderr, "Could not write baseline %s\n", savePath);
+            return 1;
+        }
+    }
+
+    startThreadPool(numThreads);
+    int regressions = 0;
+    printf("%-40s %12s %14s %10s\n", "benchmark", "ns/op", "Mops/s", "vs base");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        if (filter != NULL && strstr(benchmarks[b].name, filter) == NULL) continue;
+
+        double nsPerOp = measure(&benchmarks[b], minTime);
+        printf("%-40s %12.2f %14.3f", benchmarks[b].name, nsPerOp, 1e3 / nsPerOp);
+
+        const BaselineEntry* entry = findBaseline(baseline, baselineCount, benchmarks[b].name);
+        if (entry != NULL) {
+            double change = (nsPerOp - entry->nsPerOp) / entry->nsPerOp * 100.0;
+            printf(" %+9.1f%%", change);
+            if (change > threshold) {
+                printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        printf("\n");
+        if (saveFile != NULL) {
+            fprintf(saveFile, "%s %.4f\n", benchmarks[b].name, nsPerOp);
+        }
+    }
+
+    if (saveFile != NULL) fclose(saveFile);
+    freeParticleStore(&scene);
+    freeParticleStore(&pristine);
+    free(pairList);
+    free(framebuffer);
+    freeProjectedParticles(&projectedScene);
+    freeDepthBuffer(&benchDepth);
+    freeRaster();
+    freeGlyphAtlas(&benchAtlas);
+    stopThreadPool();
+    freeSphereSprites();
+
+    if (regressions > 0) {
+        printf("%d benchmark(s) slower than the baseline by more than %.0f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
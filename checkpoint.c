@@ -0,0 +1,224 @@
+// checkpoint.c
+//
+// Binary save files: a fixed header followed by each particle field as a raw
+// array, every array starting on a 64 byte boundary. Loading maps the file
+// and copies the arrays straight into the store, so restoring costs about as
+// much as a memcpy of the particle data.
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "PSIMCKPT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGNMENT 64
+// Written as is; a machine of the other byte order reads it back swapped
+#define CHECKPOINT_BYTE_ORDER 0x01020304u
+
+// px, py, pz, vx, vy, vz, radius, color, id, slotOfId
+#define CHECKPOINT_FIELDS 10
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t count;
+    int32_t idCount;  // Length of slotOfId; free ids are the unused ones below it
+    float cameraPosition[3];
+    float cameraPitch;
+    float cameraYaw;
+    float gravity;
+    float lightDir[3];
+    float lightIntensity;
+    uint64_t fieldOffset[CHECKPOINT_FIELDS];  // From the start of the file
+    uint64_t fileSize;
+} CheckpointHeader;
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+// Function to list the store's arrays in file order with their lengths. All
+// elements are 4 bytes.
+static void listFields(const ParticleStore* store, void* fields[CHECKPOINT_FIELDS], int lengths[CHECKPOINT_FIELDS]) {
+    void* arrays[CHECKPOINT_FIELDS] = {
+        store->px, store->py, store->pz, store->vx, store->vy, store->vz,
+        store->radius, store->color, store->id, store->slotOfId
+    };
+    for (int f = 0; f < CHECKPOINT_FIELDS; f++) {
+        fields[f] = arrays[f];
+        lengths[f] = f == CHECKPOINT_FIELDS - 1 ? store->idCount : store->count;
+    }
+}
+
+// Function to write the particles and scene settings to 'path'. The file is
+// written next to it first and renamed over it at the end, so a failed save
+// never leaves a half written checkpoint behind. Returns 0 on success, -1 on
+// failure.
+int saveCheckpoint(const char* path, const ParticleStore* store, const SceneSettings* settings) {
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byteOrder = CHECKPOINT_BYTE_ORDER;
+    header.count = store->count;
+    header.idCount = store->idCount;
+    header.cameraPosition[0] = settings->camera.position.x;
+    header.cameraPosition[1] = settings->camera.position.y;
+    header.cameraPosition[2] = settings->camera.position.z;
+    header.cameraPitch = settings->camera.pitch;
+    header.cameraYaw = settings->camera.yaw;
+    header.gravity = settings->gravity;
+    header.lightDir[0] = settings->lightDir.x;
+    header.lightDir[1] = settings->lightDir.y;
+    header.lightDir[2] = settings->lightDir.z;
+    header.lightIntensity = settings->lightIntensity;
+
+    void* fields[CHECKPOINT_FIELDS];
+    int lengths[CHECKPOINT_FIELDS];
+    listFields(store, fields, lengths);
+    uint64_t offset = alignOffset(sizeof(header));
+    for (int f = 0; f < CHECKPOINT_FIELDS; f++) {
+        header.fieldOffset[f] = offset;
+        offset = alignOffset(offset + (uint64_t)lengths[f] * 4);
+    }
+    header.fileSize = offset;
+
+    char tempPath[4096];
+    if (snprintf(tempPath, sizeof(tempPath), "%s.tmp", path) >= (int)sizeof(tempPath)) {
+        fprintf(stderr, "Checkpoint path too long: %s\n", path);
+        return -1;
+    }
+    FILE* file = fopen(tempPath, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not create %s\n", tempPath);
+        return -1;
+    }
+
+    static const char padding[CHECKPOINT_ALIGNMENT];
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t written = sizeof(header);
+    for (int f = 0; f < CHECKPOINT_FIELDS && ok; f++) {
+        size_t pad = header.fieldOffset[f] - written;
+        ok = fwrite(padding, 1, pad, file) == pad &&
+             fwrite(fields[f], 4, lengths[f], file) == (size_t)lengths[f];
+        written = header.fieldOffset[f] + (uint64_t)lengths[f] * 4;
+    }
+    if (ok) {
+        size_t pad = header.fileSize - written;
+        ok = fwrite(padding, 1, pad, file) == pad;
+    }
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(tempPath, path) != 0) {
+        fprintf(stderr, "Could not write checkpoint %s\n", path);
+        remove(tempPath);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to check the header of a mapped file before anything is read
+// through it
+static bool validHeader(const CheckpointHeader* header, uint64_t fileSize) {
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->byteOrder != CHECKPOINT_BYTE_ORDER) return false;
+    if (header->version != CHECKPOINT_VERSION) return false;
+    if (header->count < 0 || header->idCount < header->count || header->fileSize != fileSize) return false;
+
+    // Fields come in order without overlapping. The offsets are compared
+    // against what is left of the file so nothing can wrap.
+    uint64_t fieldEnd = sizeof(*header);
+    for (int f = 0; f < CHECKPOINT_FIELDS; f++) {
+        uint64_t length = f == CHECKPOINT_FIELDS - 1 ? header->idCount : header->count;
+        uint64_t offset = header->fieldOffset[f];
+        if (offset % CHECKPOINT_ALIGNMENT != 0 || offset < fieldEnd || offset > fileSize ||
+            length * 4 > fileSize - offset) {
+            return false;
+        }
+        fieldEnd = offset + length * 4;
+    }
+    return true;
+}
+
+// Function to replace the particles and scene settings with those saved in
+// 'path'. The store must have been initialized; it grows as needed. Returns 0
+// on success, or -1 with the store and settings untouched if the file could
+// not be read or is not a checkpoint of this version.
+int loadCheckpoint(const char* path, ParticleStore* store, SceneSettings* settings) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CheckpointHeader)) {
+        fprintf(stderr, "%s is not a checkpoint\n", path);
+        close(fd);
+        return -1;
+    }
+    uint64_t fileSize = (uint64_t)info.st_size;
+    const uint8_t* data = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        return -1;
+    }
+    madvise((void*)data, fileSize, MADV_SEQUENTIAL);
+
+    CheckpointHeader header;
+    memcpy(&header, data, sizeof(header));
+    int result = -1;
+    if (!validHeader(&header, fileSize)) {
+        fprintf(stderr, "%s is not a version %d checkpoint\n", path, CHECKPOINT_VERSION);
+    } else if (reserveParticles(store, header.idCount) != 0) {
+        fprintf(stderr, "Out of memory loading %s\n", path);
+    } else {
+        // Every id in use must point back at its slot, or later lookups
+        // could run off the arrays
+        const int32_t* ids = (const int32_t*)(data + header.fieldOffset[8]);
+        const int32_t* slots = (const int32_t*)(data + header.fieldOffset[9]);
+        bool consistent = true;
+        for (int i = 0; i < header.count && consistent; i++) {
+            consistent = ids[i] >= 0 && ids[i] < header.idCount && slots[ids[i]] == i;
+        }
+        if (!consistent) {
+            fprintf(stderr, "%s has inconsistent particle ids\n", path);
+        } else {
+            store->count = header.count;
+            store->idCount = header.idCount;
+            void* fields[CHECKPOINT_FIELDS];
+            int lengths[CHECKPOINT_FIELDS];
+            listFields(store, fields, lengths);
+            for (int f = 0; f < CHECKPOINT_FIELDS; f++) {
+                memcpy(fields[f], data + header.fieldOffset[f], (size_t)lengths[f] * 4);
+            }
+            wakeParticles(store, 0, store->count);
+
+            // The free list is not saved; it is the ids no particle uses
+            store->freeIdCount = 0;
+            for (int id = store->idCount - 1; id >= 0; id--) {
+                if (store->slotOfId[id] < 0 || store->slotOfId[id] >= store->count ||
+                    store->id[store->slotOfId[id]] != id) {
+                    store->slotOfId[id] = -1;
+                    store->freeIds[store->freeIdCount++] = id;
+                }
+            }
+
+            settings->camera.position = (Vec3D){header.cameraPosition[0], header.cameraPosition[1], header.cameraPosition[2]};
+            settings->camera.pitch = header.cameraPitch;
+            settings->camera.yaw = header.cameraYaw;
+            settings->gravity = header.gravity;
+            settings->lightDir = (Vec3D){header.lightDir[0], header.lightDir[1], header.lightDir[2]};
+            settings->lightIntensity = header.lightIntensity;
+            result = 0;
+        }
+    }
+    munmap((void*)data, fileSize);
+    return result;
+}
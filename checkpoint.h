@@ -0,0 +1,21 @@
+// checkpoint.h
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "vector.h"
+#include "particle.h"
+#include "raster.h"
+
+// Everything besides the particles that a checkpoint restores
+typedef struct {
+    Camera camera;
+    float gravity;
+    Vec3D lightDir;
+    float lightIntensity;
+} SceneSettings;
+
+int saveCheckpoint(const char* path, const ParticleStore* store, const SceneSettings* settings);
+int loadCheckpoint(const char* path, ParticleStore* store, SceneSettings* settings);
+
+#endif // CHECKPOINT_H
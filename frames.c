@@ -0,0 +1,418 @@
+// frames.c
+//
+// Writes rendered frames as PPM or PNG image sequences, or as raw RGBA video
+// on stdout for piping into an encoder. Encoding and file I/O run on a small
+// pool of writer threads so the renderer only pays for a slot handover.
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frames.h"
+#include "timer.h"
+
+#define MAX_PATH_LENGTH 1024
+// Bytes a stored (uncompressed) deflate block can hold
+#define STORED_BLOCK_SIZE 65535
+#define ADLER_MODULUS 65521
+// Bytes that can be summed before the Adler-32 sums must be reduced
+#define ADLER_RUN 5552
+
+static uint32_t crcTable[256];
+
+static void buildCrcTable(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[n] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t* data, size_t length) {
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++) {
+        c = crcTable[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t adler32(const uint8_t* data, size_t length) {
+    uint32_t a = 1, b = 0;
+    while (length > 0) {
+        size_t run = length < ADLER_RUN ? length : ADLER_RUN;
+        length -= run;
+        while (run-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_MODULUS;
+        b %= ADLER_MODULUS;
+    }
+    return (b << 16) | a;
+}
+
+static uint8_t* put32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+    return out + 4;
+}
+
+// Function to copy one row of ARGB pixels out as RGB bytes
+static uint8_t* packRgb(uint8_t* out, const uint32_t* row, int width) {
+    for (int x = 0; x < width; x++) {
+        uint32_t pixel = row[x];
+        *out++ = (uint8_t)(pixel >> 16);
+        *out++ = (uint8_t)(pixel >> 8);
+        *out++ = (uint8_t)pixel;
+    }
+    return out;
+}
+
+// Function to return the largest encoding of one frame in 'format', so each
+// writer can allocate its buffer once
+static size_t encodedCapacity(FrameFormat format, int width, int height) {
+    size_t pixels = (size_t)width * height;
+    if (format == FRAME_RAW) return pixels * 4;
+    if (format == FRAME_PPM) return 32 + pixels * 3;
+    size_t filtered = (size_t)height * (1 + (size_t)width * 3);
+    size_t blocks = filtered / STORED_BLOCK_SIZE + 1;
+    return 8 + 25 + 12 + 2 + blocks * 5 + filtered + 4 + 12;
+}
+
+static size_t encodeRaw(uint8_t* out, const uint32_t* pixels, int width, int height) {
+    size_t count = (size_t)width * height;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t pixel = pixels[i];
+        out[4 * i] = (uint8_t)(pixel >> 16);
+        out[4 * i + 1] = (uint8_t)(pixel >> 8);
+        out[4 * i + 2] = (uint8_t)pixel;
+        out[4 * i + 3] = 0xFF;  // The background is cleared to zero alpha
+    }
+    return count * 4;
+}
+
+static size_t encodePpm(uint8_t* out, const uint32_t* pixels, int width, int height) {
+    uint8_t* start = out;
+    out += sprintf((char*)out, "P6\n%d %d\n255\n", width, height);
+    for (int y = 0; y < height; y++) {
+        out = packRgb(out, pixels + (size_t)y * width, width);
+    }
+    return (size_t)(out - start);
+}
+
+// Function to write a PNG chunk whose data has already been placed after
+// the 8 bytes reserved at 'chunk'. Returns the end of the chunk.
+static uint8_t* finishChunk(uint8_t* chunk, const char* type, size_t length) {
+    put32(chunk, (uint32_t)length);
+    memcpy(chunk + 4, type, 4);
+    return put32(chunk + 8 + length, crc32(chunk + 4, length + 4));
+}
+
+// Function to encode a frame as an 8-bit RGB PNG. The image data is filtered
+// with 'None' and kept in stored deflate blocks: a video encoder or an image
+// diff reads it back at memory speed, where compressing it would cost more
+// than rendering the frame.
+static size_t encodePng(uint8_t* out, const uint32_t* pixels, int width, int height) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    uint8_t* start = out;
+    memcpy(out, signature, sizeof(signature));
+    out += sizeof(signature);
+
+    uint8_t* header = out + 8;
+    put32(header, (uint32_t)width);
+    put32(header + 4, (uint32_t)height);
+    header[8] = 8;    // Bits per channel
+    header[9] = 2;    // Truecolor
+    header[10] = 0;   // Deflate
+    header[11] = 0;   // Adaptive filtering
+    header[12] = 0;   // Not interlaced
+    out = finishChunk(out, "IHDR", 13);
+
+    // Filter byte and RGB bytes of each row, then split into stored blocks.
+    // The rows are packed at the end of the chunk first so the blocks can be
+    // laid out in front of them in place.
+    size_t rowBytes = 1 + (size_t)width * 3;
+    size_t filtered = (size_t)height * rowBytes;
+    size_t blocks = (filtered + STORED_BLOCK_SIZE - 1) / STORED_BLOCK_SIZE;
+    if (blocks == 0) blocks = 1;
+    uint8_t* idat = out;
+    uint8_t* stream = idat + 8;
+    uint8_t* rows = stream + 2 + blocks * 5;
+    uint8_t* row = rows;
+    for (int y = 0; y < height; y++) {
+        *row++ = 0;
+        row = packRgb(row, pixels + (size_t)y * width, width);
+    }
+    uint32_t checksum = adler32(rows, filtered);
+
+    stream[0] = 0x78;  // Deflate with a 32K window
+    stream[1] = 0x01;  // No preset dictionary, fastest level
+    uint8_t* block = stream + 2;
+    size_t remaining = filtered;
+    const uint8_t* source = rows;
+    do {
+        size_t length = remaining < STORED_BLOCK_SIZE ? remaining : STORED_BLOCK_SIZE;
+        remaining -= length;
+        block[0] = remaining == 0 ? 1 : 0;  // Final block flag, stored type
+        block[1] = (uint8_t)length;
+        block[2] = (uint8_t)(length >> 8);
+        block[3] = (uint8_t)~length;
+        block[4] = (uint8_t)(~length >> 8);
+        memmove(block + 5, source, length);  // Shifts the data left over its own header
+        block += 5 + length;
+        source += length;
+    } while (remaining > 0);
+    block = put32(block, checksum);
+    out = finishChunk(idat, "IDAT", (size_t)(block - stream));
+
+    out = finishChunk(out, "IEND", 0);
+    return (size_t)(out - start);
+}
+
+// Function to check 'pattern' and pick the format it asks for: "-" streams
+// raw RGBA to stdout, otherwise it must hold exactly one integer conversion
+// such as %05d and end in .ppm or .png. Returns 0 on success, -1 if the
+// pattern can't be used.
+int parseFrameFormat(const char* pattern, FrameFormat* format) {
+    if (strcmp(pattern, "-") == 0) {
+        *format = FRAME_RAW;
+        return 0;
+    }
+    int conversions = 0;
+    for (const char* c = pattern; *c != '\0'; c++) {
+        if (*c != '%') continue;
+        c++;
+        if (*c == '%') continue;
+        while (*c == '0' || isdigit((unsigned char)*c)) c++;
+        if (*c != 'd') {
+            conversions = -1;
+            break;
+        }
+        conversions++;
+    }
+    size_t length = strlen(pattern);
+    bool png = length > 4 && strcmp(pattern + length - 4, ".png") == 0;
+    bool ppm = length > 4 && strcmp(pattern + length - 4, ".ppm") == 0;
+    if (conversions != 1 || (!png && !ppm)) {
+        fprintf(stderr, "Frame pattern %s needs one %%d and a .png or .ppm extension\n", pattern);
+        return -1;
+    }
+    *format = png ? FRAME_PNG : FRAME_PPM;
+    return 0;
+}
+
+// Function to write one encoded frame. Raw frames wait for their turn on
+// stdout; image files are written as soon as they are encoded.
+static int writeFrame(FrameWriter* writer, long long frame, const uint8_t* data, size_t size) {
+    if (writer->format == FRAME_RAW) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->nextWritten != frame && !writer->failed) {
+            pthread_cond_wait(&writer->done, &writer->lock);
+        }
+        bool failed = writer->failed;
+        pthread_mutex_unlock(&writer->lock);
+        if (failed) return -1;
+        // Only the writer holding frame 'nextWritten' gets here, so stdout
+        // needs no lock of its own
+        if (fwrite(data, 1, size, stdout) != size) {
+            fprintf(stderr, "Could not write frame %lld to stdout\n", frame);
+            return -1;
+        }
+        return 0;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), writer->pattern, (int)frame);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return -1;
+    }
+    bool written = fwrite(data, 1, size, file) == size;
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to return the queued slot with the lowest frame number, or -1.
+// Call with the lock held.
+static int oldestQueued(const FrameWriter* writer) {
+    int oldest = -1;
+    for (int s = 0; s < writer->slotCount; s++) {
+        if (writer->slots[s].state != SLOT_QUEUED) continue;
+        if (oldest < 0 || writer->slots[s].frame < writer->slots[oldest].frame) oldest = s;
+    }
+    return oldest;
+}
+
+static void* writerMain(void* arg) {
+    FrameWriter* writer = arg;
+    uint8_t* encoded = malloc(encodedCapacity(writer->format, writer->width, writer->height));
+
+    pthread_mutex_lock(&writer->lock);
+    if (encoded == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        writer->failed = true;
+        pthread_cond_broadcast(&writer->done);
+    }
+    for (;;) {
+        int s = oldestQueued(writer);
+        while (s < 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+            s = oldestQueued(writer);
+        }
+        if (s < 0) break;
+        QueuedFrame* slot = &writer->slots[s];
+        slot->state = SLOT_ENCODING;
+        bool skip = writer->failed;
+        pthread_mutex_unlock(&writer->lock);
+
+        // After a failure the remaining frames are only handed back, so the
+        // caller is never left waiting for a slot
+        int result = -1;
+        size_t size = 0;
+        double start = secondsNow();
+        double encodeSeconds = 0.0;
+        if (!skip) {
+            if (writer->format == FRAME_RAW) {
+                size = encodeRaw(encoded, slot->pixels, writer->width, writer->height);
+            } else if (writer->format == FRAME_PPM) {
+                size = encodePpm(encoded, slot->pixels, writer->width, writer->height);
+            } else {
+                size = encodePng(encoded, slot->pixels, writer->width, writer->height);
+            }
+            encodeSeconds = secondsNow() - start;
+            result = writeFrame(writer, slot->frame, encoded, size);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (result == 0) {
+            writer->framesWritten++;
+            writer->bytesWritten += size;
+            writer->encodeSeconds += encodeSeconds;
+        } else if (!skip) {
+            writer->failed = true;
+        }
+        if (writer->format == FRAME_RAW && slot->frame == writer->nextWritten) writer->nextWritten++;
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&writer->done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    free(encoded);
+    return NULL;
+}
+
+// Function to allocate the frame slots and start 'writerCount' writer
+// threads for frames of 'width' x 'height' pixels. 'pattern' names the
+// files, see parseFrameFormat. Returns 0 on success, -1 on failure.
+int startFrameWriter(FrameWriter* writer, FrameFormat format, const char* pattern, int width, int height, int writerCount) {
+    memset(writer, 0, sizeof(*writer));
+    if (writerCount < 1) writerCount = 1;
+    if (writerCount > MAX_FRAME_WRITERS) writerCount = MAX_FRAME_WRITERS;
+    writer->format = format;
+    writer->pattern = pattern;
+    writer->width = width;
+    writer->height = height;
+    writer->current = -1;
+    // Every writer busy, one frame queued behind them and one being rendered
+    writer->slotCount = writerCount + 2;
+    buildCrcTable();
+
+    for (int s = 0; s < writer->slotCount; s++) {
+        writer->slots[s].pixels = malloc((size_t)width * height * sizeof(uint32_t));
+        if (writer->slots[s].pixels == NULL) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            for (int k = 0; k <= s; k++) free(writer->slots[k].pixels);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->ready, NULL);
+    pthread_cond_init(&writer->done, NULL);
+    for (int w = 0; w < writerCount; w++) {
+        if (pthread_create(&writer->writers[w], NULL, writerMain, writer) != 0) {
+            fprintf(stderr, "Could not start frame writer thread %d\n", w);
+            break;
+        }
+        writer->writerCount++;
+    }
+    if (writer->writerCount == 0) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->ready);
+        pthread_cond_destroy(&writer->done);
+        for (int s = 0; s < writer->slotCount; s++) free(writer->slots[s].pixels);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to return a free 'width' x 'height' buffer to render the next
+// frame into, waiting for a writer only if every slot is taken. Returns
+// NULL once writing has failed.
+uint32_t* acquireFrame(FrameWriter* writer) {
+    double start = secondsNow();
+    pthread_mutex_lock(&writer->lock);
+    int chosen = -1;
+    while (!writer->failed) {
+        for (int s = 0; s < writer->slotCount && chosen < 0; s++) {
+            if (writer->slots[s].state == SLOT_FREE) chosen = s;
+        }
+        if (chosen >= 0) break;
+        pthread_cond_wait(&writer->done, &writer->lock);
+    }
+    if (chosen >= 0) {
+        writer->slots[chosen].state = SLOT_RENDERING;
+        writer->slots[chosen].frame = writer->nextFrame++;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    writer->waitSeconds += secondsNow() - start;
+
+    writer->current = chosen;
+    return chosen >= 0 ? writer->slots[chosen].pixels : NULL;
+}
+
+// Function to queue the frame last returned by acquireFrame for writing
+void submitFrame(FrameWriter* writer) {
+    if (writer->current < 0) return;
+    pthread_mutex_lock(&writer->lock);
+    writer->slots[writer->current].state = SLOT_QUEUED;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    writer->current = -1;
+}
+
+// Function to write out every queued frame, stop the writers and print what
+// the output cost. The summary goes to stderr since stdout may carry the
+// video. Returns 0 if every frame was written, -1 otherwise.
+int stopFrameWriter(FrameWriter* writer) {
+    if (writer->writerCount == 0) return -1;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    for (int w = 0; w < writer->writerCount; w++) {
+        pthread_join(writer->writers[w], NULL);
+    }
+    if (writer->format == FRAME_RAW && fflush(stdout) != 0) writer->failed = true;
+
+    fprintf(stderr, "Wrote %lld frames, %.1f MB, %.2f ms encoding each on %d writer threads, %.3f s waiting for a free slot\n",
+            writer->framesWritten, writer->bytesWritten / 1e6,
+            writer->framesWritten > 0 ? writer->encodeSeconds * 1e3 / writer->framesWritten : 0.0,
+            writer->writerCount, writer->waitSeconds);
+
+    for (int s = 0; s < writer->slotCount; s++) {
+        free(writer->slots[s].pixels);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->ready);
+    pthread_cond_destroy(&writer->done);
+    writer->writerCount = 0;
+    return writer->failed ? -1 : 0;
+}
@@ -0,0 +1,72 @@
+// frames.h
+
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_FRAME_WRITERS 16
+// Rendered frames that can wait for a writer before rendering waits instead
+#define FRAME_SLOTS (MAX_FRAME_WRITERS + 4)
+
+typedef enum {
+    FRAME_PPM,   // Binary PPM (P6) per frame
+    FRAME_PNG,   // PNG per frame, stored without compression
+    FRAME_RAW    // RGBA bytes of every frame back to back on stdout
+} FrameFormat;
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_RENDERING,  // Handed to the caller by acquireFrame
+    SLOT_QUEUED,
+    SLOT_ENCODING
+} FrameSlotState;
+
+// One frame of ARGB pixels as the rasterizer draws them
+typedef struct {
+    uint32_t* pixels;
+    long long frame;
+    FrameSlotState state;
+} QueuedFrame;
+
+// Encodes and writes frames on background threads. The caller renders
+// straight into a slot's pixels and hands it back; only when every slot is
+// still waiting to be written does acquireFrame block, and no frame is ever
+// dropped. Raw frames go out in order, files in whatever order they finish.
+typedef struct {
+    FrameFormat format;
+    const char* pattern;  // printf pattern for the file names, e.g. "out/frame%05d.png"
+    int width;
+    int height;
+    int slotCount;
+    int writerCount;
+    pthread_t writers[MAX_FRAME_WRITERS];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // A frame was queued, or stopping
+    pthread_cond_t done;   // A frame was written
+    QueuedFrame slots[FRAME_SLOTS];
+    long long nextFrame;    // Number given to the next acquired frame
+    long long nextWritten;  // Next raw frame due on stdout
+    bool stopping;
+    bool failed;
+
+    // Caller side
+    int current;  // Slot handed out by acquireFrame, -1 if none
+    double waitSeconds;  // Time acquireFrame spent waiting for a free slot
+
+    // Writer side, under the lock
+    long long framesWritten;
+    long long bytesWritten;
+    double encodeSeconds;
+} FrameWriter;
+
+int parseFrameFormat(const char* pattern, FrameFormat* format);
+int startFrameWriter(FrameWriter* writer, FrameFormat format, const char* pattern, int width, int height, int writerCount);
+uint32_t* acquireFrame(FrameWriter* writer);
+void submitFrame(FrameWriter* writer);
+int stopFrameWriter(FrameWriter* writer);
+
+#endif // FRAMES_H
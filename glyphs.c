@@ -0,0 +1,69 @@
+// glyphs.c
+
+#include <stdlib.h>
+#include "glyphs.h"
+#include "raster.h"
+
+// Function to allocate an empty atlas; the caller fills in the coverage and
+// metrics. Returns -1 if memory ran out.
+int initGlyphAtlas(GlyphAtlas* atlas, int width, int height) {
+    atlas->coverage = calloc((size_t)width * height, 1);
+    if (atlas->coverage == NULL) return -1;
+    atlas->width = width;
+    atlas->height = height;
+    for (int g = 0; g < GLYPH_COUNT; g++) {
+        atlas->glyphs[g] = (GlyphMetrics){0, 0, 0};
+    }
+    return 0;
+}
+
+void freeGlyphAtlas(GlyphAtlas* atlas) {
+    free(atlas->coverage);
+    atlas->coverage = NULL;
+    atlas->width = 0;
+    atlas->height = 0;
+}
+
+// Function to blend one channel of 'color' over 'background' by 'alpha'
+static uint32_t blendChannel(uint32_t color, uint32_t background, uint32_t alpha) {
+    return (color * alpha + background * (255 - alpha) + 127) / 255;
+}
+
+// Function to draw 'text' with its top left corner at (x, y), clipped to the
+// screen. Characters outside printable ASCII are skipped. Returns the x just
+// past the last glyph.
+int drawGlyphText(uint32_t* pixels, const GlyphAtlas* atlas, const char* text, int x, int y, uint32_t color) {
+    uint32_t red = (color >> 16) & 0xFF;
+    uint32_t green = (color >> 8) & 0xFF;
+    uint32_t blue = color & 0xFF;
+    int rowBegin = y < 0 ? -y : 0;
+    int rowEnd = y + atlas->height > SCREEN_HEIGHT ? SCREEN_HEIGHT - y : atlas->height;
+
+    for (const char* c = text; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (ch < FIRST_GLYPH || ch > LAST_GLYPH) continue;
+        const GlyphMetrics* glyph = &atlas->glyphs[ch - FIRST_GLYPH];
+
+        int columnBegin = x < 0 ? -x : 0;
+        int columnEnd = x + glyph->width > SCREEN_WIDTH ? SCREEN_WIDTH - x : glyph->width;
+        for (int row = rowBegin; row < rowEnd; row++) {
+            const uint8_t* coverage = atlas->coverage + (size_t)row * atlas->width + glyph->x;
+            uint32_t* line = pixels + (size_t)(y + row) * SCREEN_WIDTH + x;
+            for (int column = columnBegin; column < columnEnd; column++) {
+                uint32_t alpha = coverage[column];
+                if (alpha == 0) continue;
+                if (alpha == 255) {
+                    line[column] = 0xFF000000u | (red << 16) | (green << 8) | blue;
+                    continue;
+                }
+                uint32_t background = line[column];
+                line[column] = 0xFF000000u |
+                               (blendChannel(red, (background >> 16) & 0xFF, alpha) << 16) |
+                               (blendChannel(green, (background >> 8) & 0xFF, alpha) << 8) |
+                               blendChannel(blue, background & 0xFF, alpha);
+            }
+        }
+        x += glyph->advance;
+    }
+    return x;
+}
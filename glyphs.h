@@ -0,0 +1,33 @@
+// glyphs.h
+
+#ifndef GLYPHS_H
+#define GLYPHS_H
+
+#include <stdint.h>
+
+// Printable ASCII is all the HUD needs
+#define FIRST_GLYPH 32
+#define LAST_GLYPH 126
+#define GLYPH_COUNT (LAST_GLYPH - FIRST_GLYPH + 1)
+
+typedef struct {
+    int x;        // Left column of the glyph in the atlas
+    int width;
+    int advance;  // Pen movement to the next glyph
+} GlyphMetrics;
+
+// Every glyph rendered once, side by side, as 8-bit coverage. Text is then
+// drawn by blending rows of this strip into the frame, so it costs a few
+// hundred pixel writes per string instead of a font render and a texture.
+typedef struct {
+    uint8_t* coverage;  // width x height, one byte per pixel
+    int width;
+    int height;
+    GlyphMetrics glyphs[GLYPH_COUNT];
+} GlyphAtlas;
+
+int initGlyphAtlas(GlyphAtlas* atlas, int width, int height);
+void freeGlyphAtlas(GlyphAtlas* atlas);
+int drawGlyphText(uint32_t* pixels, const GlyphAtlas* atlas, const char* text, int x, int y, uint32_t color);
+
+#endif // GLYPHS_H
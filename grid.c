@@ -0,0 +1,205 @@
+// grid.c
+
+#include <stdlib.h>
+#include <math.h>
+#include "grid.h"
+
+// Neighbour offsets covering half of the 3x3x3 stencil, so every pair of
+// adjacent cells is visited exactly once.
+static const int halfStencil[13][3] = {
+    { 1,  0,  0},
+    {-1,  1,  0}, { 0,  1,  0}, { 1,  1,  0},
+    {-1, -1,  1}, { 0, -1,  1}, { 1, -1,  1},
+    {-1,  0,  1}, { 0,  0,  1}, { 1,  0,  1},
+    {-1,  1,  1}, { 0,  1,  1}, { 1,  1,  1}
+};
+
+void initSpatialGrid(SpatialGrid* grid) {
+    grid->cellsPerAxis = 0;
+    grid->cellSize = 0.0f;
+    grid->cellCount = 0;
+    grid->cellStart = NULL;
+    grid->cellParticles = NULL;
+    grid->particleCell = NULL;
+    grid->cellCapacity = 0;
+    grid->particleCapacity = 0;
+}
+
+void freeSpatialGrid(SpatialGrid* grid) {
+    free(grid->cellStart);
+    free(grid->cellParticles);
+    free(grid->particleCell);
+    initSpatialGrid(grid);
+}
+
+// Function to map a coordinate to its cell along one axis, clamping
+// particles that were pushed slightly outside the cube into the edge cells
+static int cellCoordinate(const SpatialGrid* grid, float value) {
+    int c = (int)((value + 0.5f) / grid->cellSize);
+    if (c < 0) return 0;
+    if (c >= grid->cellsPerAxis) return grid->cellsPerAxis - 1;
+    return c;
+}
+
+// Function to choose the cell resolution from the largest radius. Cells are
+// never smaller than one particle diameter, and the cell count is kept in
+// proportion to the particle count so sparse scenes do not pay for empty cells.
+static int chooseCellsPerAxis(float maxRadius, int numParticles) {
+    int limit = (int)cbrtf(2.0f * numParticles) + 1;
+    // Clamped before converting, since a tiny radius gives a quotient that
+    // doesn't fit in an int
+    float fitting = maxRadius > 0.0f ? 1.0f / (2.0f * maxRadius) : (float)limit;
+    int cells = fitting < (float)limit ? (int)fitting : limit;
+    if (cells < 1) cells = 1;
+    return cells;
+}
+
+// Function to return the cell size the grid will pick for 'numParticles'
+// particles no larger than 'maxRadius'
+float spatialGridCellSize(float maxRadius, int numParticles) {
+    return 1.0f / chooseCellsPerAxis(maxRadius, numParticles);
+}
+
+// Function to size the grid for the current particles and make room for them.
+// Returns 0 on success, -1 if memory could not be allocated.
+int prepareSpatialGrid(SpatialGrid* grid, const ParticleStore* store) {
+    float maxRadius = 0.0f;
+    for (int i = 0; i < store->count; i++) {
+        if (store->radius[i] > maxRadius) maxRadius = store->radius[i];
+    }
+    return prepareSpatialGridForRadius(grid, store->count, maxRadius);
+}
+
+// Same as prepareSpatialGrid, for a caller that already knows the largest radius
+int prepareSpatialGridForRadius(SpatialGrid* grid, int numParticles, float maxRadius) {
+    grid->cellsPerAxis = chooseCellsPerAxis(maxRadius, numParticles);
+    grid->cellSize = 1.0f / grid->cellsPerAxis;
+    grid->cellCount = grid->cellsPerAxis * grid->cellsPerAxis * grid->cellsPerAxis;
+
+    if (grid->cellCount + 1 > grid->cellCapacity) {
+        int* cellStart = realloc(grid->cellStart, (grid->cellCount + 1) * sizeof(int));
+        if (cellStart == NULL) return -1;
+        grid->cellStart = cellStart;
+        grid->cellCapacity = grid->cellCount + 1;
+    }
+    if (numParticles > grid->particleCapacity) {
+        int* cellParticles = realloc(grid->cellParticles, numParticles * sizeof(int));
+        if (cellParticles == NULL) return -1;
+        grid->cellParticles = cellParticles;
+        int* particleCell = realloc(grid->particleCell, numParticles * sizeof(int));
+        if (particleCell == NULL) return -1;
+        grid->particleCell = particleCell;
+        grid->particleCapacity = numParticles;
+    }
+    return 0;
+}
+
+// Function to return the cell a point falls in, clamped into the grid
+int spatialGridCellOf(const SpatialGrid* grid, float x, float y, float z) {
+    int n = grid->cellsPerAxis;
+    return (cellCoordinate(grid, z) * n + cellCoordinate(grid, y)) * n + cellCoordinate(grid, x);
+}
+
+// Function to compute the cell of particles [begin, end). Ranges may be
+// assigned from different threads.
+void assignGridCells(SpatialGrid* grid, const ParticleStore* store, int begin, int end) {
+    int n = grid->cellsPerAxis;
+    for (int i = begin; i < end; i++) {
+        int cx = cellCoordinate(grid, store->px[i]);
+        int cy = cellCoordinate(grid, store->py[i]);
+        int cz = cellCoordinate(grid, store->pz[i]);
+        grid->particleCell[i] = (cz * n + cy) * n + cx;
+    }
+}
+
+// Function to bucket the particles by their assigned cell with a counting sort
+void sortGridCells(SpatialGrid* grid, int numParticles) {
+    for (int c = 0; c <= grid->cellCount; c++) {
+        grid->cellStart[c] = 0;
+    }
+    for (int i = 0; i < numParticles; i++) {
+        grid->cellStart[grid->particleCell[i] + 1]++;
+    }
+    for (int c = 0; c < grid->cellCount; c++) {
+        grid->cellStart[c + 1] += grid->cellStart[c];
+    }
+    // Scatter using cellStart as a running cursor, then shift it back
+    for (int i = 0; i < numParticles; i++) {
+        grid->cellParticles[grid->cellStart[grid->particleCell[i]]++] = i;
+    }
+    for (int c = grid->cellCount; c > 0; c--) {
+        grid->cellStart[c] = grid->cellStart[c - 1];
+    }
+    grid->cellStart[0] = 0;
+}
+
+// Function to rebuild the grid from the current particle positions.
+// Returns 0 on success, -1 if memory could not be allocated.
+int buildSpatialGrid(SpatialGrid* grid, const ParticleStore* store) {
+    if (prepareSpatialGrid(grid, store) != 0) return -1;
+    assignGridCells(grid, store, 0, store->count);
+    sortGridCells(grid, store->count);
+    return 0;
+}
+
+// Function to call 'callback' for every candidate pair owned by the cells of
+// layer 'cz': pairs inside a cell and pairs with the forward half of its
+// neighbours. Those only reach into layers cz and cz + 1, so layers two or
+// more apart touch disjoint particles and can run on different threads.
+// Returns the number of candidate pairs and adds the touching ones to 'hits'.
+int forEachCandidatePairInLayer(const SpatialGrid* grid, ParticleStore* store, int cz, PairCallback callback, void* context,
+                                int* hits) {
+    int n = grid->cellsPerAxis;
+    int pairs = 0;
+    int touching = 0;
+
+    for (int cy = 0; cy < n; cy++) {
+        for (int cx = 0; cx < n; cx++) {
+            int cell = (cz * n + cy) * n + cx;
+            int begin = grid->cellStart[cell];
+            int end = grid->cellStart[cell + 1];
+            if (begin == end) continue;
+
+            // Pairs inside the cell
+            for (int a = begin; a < end; a++) {
+                for (int b = a + 1; b < end; b++) {
+                    touching += callback(store, grid->cellParticles[a], grid->cellParticles[b], context);
+                    pairs++;
+                }
+            }
+
+            // Pairs with the forward half of the neighbouring cells
+            for (int s = 0; s < 13; s++) {
+                int nx = cx + halfStencil[s][0];
+                int ny = cy + halfStencil[s][1];
+                int nz = cz + halfStencil[s][2];
+                if (nx < 0 || nx >= n || ny < 0 || ny >= n || nz < 0 || nz >= n) continue;
+                int neighbour = (nz * n + ny) * n + nx;
+                int nBegin = grid->cellStart[neighbour];
+                int nEnd = grid->cellStart[neighbour + 1];
+                for (int a = begin; a < end; a++) {
+                    for (int b = nBegin; b < nEnd; b++) {
+                        touching += callback(store, grid->cellParticles[a], grid->cellParticles[b], context);
+                        pairs++;
+                    }
+                }
+            }
+        }
+    }
+    *hits += touching;
+    return pairs;
+}
+
+// Function to call 'callback' once for every pair of particles sharing a cell
+// or sitting in neighbouring cells. Even layers run before odd ones, the same
+// order the threaded step uses. Returns the number of candidate pairs and
+// adds the touching ones to 'hits'.
+int forEachCandidatePair(const SpatialGrid* grid, ParticleStore* store, PairCallback callback, void* context, int* hits) {
+    int pairs = 0;
+    for (int parity = 0; parity < 2; parity++) {
+        for (int cz = parity; cz < grid->cellsPerAxis; cz += 2) {
+            pairs += forEachCandidatePairInLayer(grid, store, cz, callback, context, hits);
+        }
+    }
+    return pairs;
+}
@@ -0,0 +1,41 @@
+// grid.h
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <stdbool.h>
+#include "particle.h"
+
+// Uniform grid over the [-0.5, 0.5] simulation cube, rebuilt every step.
+// Particles are bucketed by the cell containing their center; with a cell
+// size of at least twice the largest radius, any two touching particles
+// are guaranteed to sit in the same or neighbouring cells.
+typedef struct {
+    int cellsPerAxis;
+    float cellSize;
+    int cellCount;
+    int* cellStart;      // cellCount + 1 offsets into cellParticles
+    int* cellParticles;  // particle indices, sorted by cell
+    int* particleCell;   // cell index of each particle
+    int cellCapacity;
+    int particleCapacity;
+} SpatialGrid;
+
+// Returns true if the pair was actually touching. 'context' is passed through
+// from the caller.
+typedef bool (*PairCallback)(ParticleStore* store, int i, int j, void* context);
+
+void initSpatialGrid(SpatialGrid* grid);
+void freeSpatialGrid(SpatialGrid* grid);
+int buildSpatialGrid(SpatialGrid* grid, const ParticleStore* store);
+int prepareSpatialGrid(SpatialGrid* grid, const ParticleStore* store);
+int prepareSpatialGridForRadius(SpatialGrid* grid, int numParticles, float maxRadius);
+float spatialGridCellSize(float maxRadius, int numParticles);
+int spatialGridCellOf(const SpatialGrid* grid, float x, float y, float z);
+void assignGridCells(SpatialGrid* grid, const ParticleStore* store, int begin, int end);
+void sortGridCells(SpatialGrid* grid, int numParticles);
+int forEachCandidatePairInLayer(const SpatialGrid* grid, ParticleStore* store, int cz, PairCallback callback, void* context,
+                                int* hits);
+int forEachCandidatePair(const SpatialGrid* grid, ParticleStore* store, PairCallback callback, void* context, int* hits);
+
+#endif // GRID_H
@@ -0,0 +1,382 @@
+// headless.c
+//
+// Runs the simulation without SDL, video or fonts and reports how fast the
+// physics step is, so performance can be tracked on machines with no display.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "particle.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "physics.h"
+#include "nbody.h"
+#include "morton.h"
+#include "profiler.h"
+#include "integrate.h"
+#include "threadpool.h"
+#include "timer.h"
+
+typedef struct {
+    int numParticles;
+    int steps;
+    unsigned int seed;
+    int numThreads;
+    float maxRadius;
+    float velocity;
+    float deltaTime;
+    const char* loadPath;  // Checkpoint to start from instead of a random scene
+    const char* savePath;  // Checkpoint to write after the run
+    const char* recordPath;  // Trajectory recording of every step
+    const char* profilePath;  // CSV of the time spent in each phase of a step
+    int nbodyCheck;  // Particles to check the octree forces on against direct summation
+} HeadlessOptions;
+
+// Camera and light saved with --save; a loaded checkpoint's are kept as is
+static SceneSettings scene = {{{0.0f, 0.0f, -3.0f}, 0.0f, 0.0f}, 0.0f, {0.0f, -1.0f, 1.0f}, 1.0f};
+
+// Function to fill the store with the same scene for a given seed, or with
+// the loaded checkpoint. Returns -1 if the checkpoint could not be loaded.
+static int spawnScene(ParticleStore* store, const HeadlessOptions* options) {
+    if (options->loadPath != NULL) {
+        if (loadCheckpoint(options->loadPath, store, &scene) != 0) return -1;
+        gravity = scene.gravity;
+        return 0;
+    }
+    gravity = scene.gravity;
+    seedParticles(options->seed);
+    clearParticles(store);
+    spawnParticles(store, options->numParticles, options->velocity, options->maxRadius);
+    return 0;
+}
+
+// Function to start counting the cache misses of this process. Returns the
+// counter, or -1 where the kernel or the CPU doesn't offer one (e.g. most
+// virtual machines).
+static int openCacheMissCounter(void) {
+#ifdef __linux__
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.inherit = 1;  // Count the thread pool's workers too
+    return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+// Function to return how many cache misses 'counter' has seen, or -1
+static long long readCacheMisses(int counter) {
+#ifdef __linux__
+    long long misses;
+    if (counter >= 0 && read(counter, &misses, sizeof(misses)) == sizeof(misses)) return misses;
+#endif
+    return -1;
+}
+
+static int runBenchmark(ParticleStore* store, const HeadlessOptions* options) {
+    if (spawnScene(store, options) != 0) return 1;
+    startThreadPool(options->numThreads);
+
+    Recorder recorder;
+    if (options->recordPath != NULL && startRecorder(&recorder, options->recordPath, options->deltaTime) != 0) {
+        return 1;
+    }
+
+    long long candidatePairs = 0;
+    long long collisions = 0;
+    long long fastParticles = 0;
+    int reorders = 0;
+    double reorderSeconds = 0.0;
+    int cacheMissCounter = openCacheMissCounter();
+    long long startMisses = readCacheMisses(cacheMissCounter);
+    double start = secondsNow();
+    for (int step = 0; step < options->steps; step++) {
+        if (reorderInterval > 0 && step % reorderInterval == 0) {
+            double reorderStart = secondsNow();
+            if (sortParticlesByMorton(store) == 0) reorders++;
+            reorderSeconds += secondsNow() - reorderStart;
+        }
+        updateParticles(store, options->deltaTime);
+        if (nbodyStrength > 0.0f) recordPhase(PHASE_FORCES, physicsStats.forceSeconds);
+        recordPhase(PHASE_INTEGRATE, physicsStats.integrateSeconds);
+        recordPhase(PHASE_BROAD_PHASE, physicsStats.broadPhaseSeconds);
+        recordPhase(PHASE_COLLISIONS, physicsStats.collisionSeconds);
+        if (options->recordPath != NULL) recordStep(&recorder, store, step + 1, step == 0);
+        candidatePairs += physicsStats.candidatePairs;
+        collisions += physicsStats.collisions;
+        fastParticles += physicsStats.fastParticles;
+    }
+    double elapsed = secondsNow() - start;
+    long long endMisses = readCacheMisses(cacheMissCounter);
+#ifdef __linux__
+    if (cacheMissCounter >= 0) close(cacheMissCounter);
+#endif
+    if (options->recordPath != NULL) stopRecorder(&recorder);
+
+    printf("particles:            %d\n", options->numParticles);
+    printf("steps:                %d\n", options->steps);
+    printf("seed:                 %u\n", options->seed);
+    printf("threads:              %d\n", threadPoolSize());
+    printf("broad phase:          %s\n", broadPhaseMode == BROADPHASE_GRID ? "grid" : "brute force");
+    printf("integrate kernel:     %s\n", integrateKernelName(getIntegrateKernel()));
+    printf("elapsed:              %.3f s\n", elapsed);
+    printf("steps/sec:            %.2f\n", options->steps / elapsed);
+    printf("ns/particle-step:     %.2f\n", elapsed * 1e9 / ((double)options->steps * options->numParticles));
+    printf("candidate pairs/step: %.1f\n", (double)candidatePairs / options->steps);
+    printf("collisions/step:      %.1f\n", (double)collisions / options->steps);
+    printf("fast particles/step:  %.2f\n", (double)fastParticles / options->steps);
+    if (startMisses >= 0 && endMisses >= 0) {
+        printf("cache misses/step:    %.0f\n", (double)(endMisses - startMisses) / options->steps);
+    } else {
+        printf("cache misses/step:    unavailable\n");
+    }
+    if (reorders > 0) {
+        printf("morton reorders:      %d, %.2f ms each\n", reorders, reorderSeconds * 1e3 / reorders);
+    }
+    printf("awake at end:         %d\n", physicsStats.awakeParticles);
+    printf("asleep at end:        %d\n", physicsStats.sleepingParticles);
+
+    // Over the last steps only, so a long run shows where the time settled
+    PhaseSummary summaries[PHASE_COUNT];
+    summarizePhases(summaries);
+    for (int phase = PHASE_FORCES; phase <= PHASE_COLLISIONS; phase++) {
+        if (summaries[phase].samples == 0) continue;
+        printf("%-14s min/avg/p99 ms: %.3f / %.3f / %.3f\n", phaseNames[phase], summaries[phase].min * 1e3,
+               summaries[phase].average * 1e3, summaries[phase].p99 * 1e3);
+    }
+    if (options->profilePath != NULL) {
+        if (writeProfileCsv(options->profilePath) != 0) return 1;
+        printf("profile written to %s\n", options->profilePath);
+    }
+    return 0;
+}
+
+// Function to time the physics step on the same scene with 1 to 'numThreads'
+// threads and print steps/sec, the speedup over one thread and the average
+// time of each phase
+static int runScalingReport(ParticleStore* store, const HeadlessOptions* options) {
+    printf("Scaling report: %d particles, %d steps, %s integrate kernel\n",
+           options->numParticles, options->steps, integrateKernelName(getIntegrateKernel()));
+    printf("threads  steps/sec  speedup  integrate ms  broad phase ms  collisions ms\n");
+
+    double baseline = 0.0;
+    for (int threads = 1; threads <= options->numThreads; threads++) {
+        if (spawnScene(store, options) != 0) return 1;
+        startThreadPool(threads);
+        // Each thread count is summarized on its own steps only
+        resetProfiler();
+
+        double start = secondsNow();
+        for (int step = 0; step < options->steps; step++) {
+            if (reorderInterval > 0 && step % reorderInterval == 0) sortParticlesByMorton(store);
+            updateParticles(store, options->deltaTime);
+            recordPhase(PHASE_INTEGRATE, physicsStats.integrateSeconds);
+            recordPhase(PHASE_BROAD_PHASE, physicsStats.broadPhaseSeconds);
+            recordPhase(PHASE_COLLISIONS, physicsStats.collisionSeconds);
+        }
+        double stepsPerSecond = options->steps / (secondsNow() - start);
+        if (threads == 1) baseline = stepsPerSecond;
+        PhaseSummary summaries[PHASE_COUNT];
+        summarizePhases(summaries);
+        printf("%7d  %9.1f  %6.2fx  %12.3f  %14.3f  %13.3f\n", threadPoolSize(), stepsPerSecond, stepsPerSecond / baseline,
+               summaries[PHASE_INTEGRATE].average * 1e3, summaries[PHASE_BROAD_PHASE].average * 1e3,
+               summaries[PHASE_COLLISIONS].average * 1e3);
+    }
+    return 0;
+}
+
+// Function to compare the octree accelerations of the scene against direct
+// summation over every pair, for 'samples' particles spread over the store,
+// and print the relative error and the time each method takes for the whole
+// scene. Direct summation is only timed on the samples and scaled up.
+static int runNBodyCheck(ParticleStore* store, const HeadlessOptions* options) {
+    if (spawnScene(store, options) != 0) return 1;
+    startThreadPool(options->numThreads);
+    float* ax = malloc((size_t)store->count * sizeof(float));
+    float* ay = malloc((size_t)store->count * sizeof(float));
+    float* az = malloc((size_t)store->count * sizeof(float));
+    if (ax == NULL || ay == NULL || az == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        free(ax);
+        free(ay);
+        free(az);
+        return 1;
+    }
+
+    double start = secondsNow();
+    int result = computeNBodyAccelerations(store, ax, ay, az);
+    double treeSeconds = secondsNow() - start;
+    if (result != 0) {
+        fprintf(stderr, "Memory allocation failed!\n");
+    } else {
+        int samples = options->nbodyCheck < store->count ? options->nbodyCheck : store->count;
+        double directSeconds = 0.0;
+        double totalError = 0.0;
+        double maxError = 0.0;
+        for (int s = 0; s < samples; s++) {
+            int i = (int)((long long)s * store->count / samples);
+            float exact[3];
+            start = secondsNow();
+            directAcceleration(store, i, exact);
+            directSeconds += secondsNow() - start;
+            double dx = ax[i] - exact[0], dy = ay[i] - exact[1], dz = az[i] - exact[2];
+            double magnitude = sqrt((double)exact[0] * exact[0] + (double)exact[1] * exact[1] + (double)exact[2] * exact[2]);
+            double error = magnitude > 0.0 ? sqrt(dx * dx + dy * dy + dz * dz) / magnitude : 0.0;
+            totalError += error;
+            if (error > maxError) maxError = error;
+        }
+        printf("particles:            %d\n", store->count);
+        printf("opening angle:        %.2f\n", openingAngle);
+        printf("threads:              %d\n", threadPoolSize());
+        printf("octree forces:        %.2f ms\n", treeSeconds * 1e3);
+        printf("direct summation:     %.2f ms (timed on %d particles)\n",
+               directSeconds / samples * store->count * 1e3, samples);
+        printf("mean relative error:  %.2e\n", totalError / samples);
+        printf("max relative error:   %.2e\n", maxError);
+    }
+    free(ax);
+    free(ay);
+    free(az);
+    return result == 0 ? 0 : 1;
+}
+
+static void printUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --particles N   number of particles (default 10000)\n");
+    printf("  --steps N       number of physics steps (default 200)\n");
+    printf("  --seed N        random seed for the initial scene (default 1)\n");
+    printf("  --threads N     physics threads (default: one per CPU)\n");
+    printf("  --radius R      maximum particle radius (default 0.1)\n");
+    printf("  --velocity V    spread of the starting velocities (default 2)\n");
+    printf("  --dt T          timestep in seconds (default 0.016)\n");
+    printf("  --gravity G     gravity per step (default 0, the window's 'g' uses 0.1)\n");
+    printf("  --reorder N     sort the particles in Morton order every N steps (default 100, 0 never)\n");
+    printf("  --nbody G       pull the particles toward each other with strength G\n");
+    printf("  --theta T       Barnes-Hut opening angle (default 0.5, 0 is exact)\n");
+    printf("  --nbody-check N compare the octree forces with direct summation on N particles\n");
+    printf("  --brute-force   use the all-pairs reference broad phase\n");
+    printf("  --no-sleep      integrate and collide settled particles every step\n");
+    printf("  --continuous    sweep pairs that passed through each other during a step\n");
+    printf("  --scalar        use the scalar integrate kernel\n");
+    printf("  --scaling       report steps/sec for 1 to --threads threads\n");
+    printf("  --load FILE     start from a checkpoint instead of a random scene\n");
+    printf("  --save FILE     write a checkpoint of the final state\n");
+    printf("  --record FILE   record every step to a trajectory file\n");
+    printf("  --profile-csv FILE write min/avg/p99 of each phase of the step to a CSV file\n");
+    printf("  --selftest      check the SIMD kernels against the scalar one\n");
+}
+
+int main(int argc, char* args[]) {
+    HeadlessOptions options = {10000, 200, 1, defaultThreadCount(), 0.1f, 2.0f, 0.016f, NULL, NULL, NULL, NULL, 0};
+    bool scalingReport = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(args[i], "--particles") == 0 && hasValue) {
+            options.numParticles = atoi(args[++i]);
+        } else if (strcmp(args[i], "--steps") == 0 && hasValue) {
+            options.steps = atoi(args[++i]);
+        } else if (strcmp(args[i], "--seed") == 0 && hasValue) {
+            options.seed = (unsigned int)strtoul(args[++i], NULL, 10);
+        } else if (strcmp(args[i], "--threads") == 0 && hasValue) {
+            options.numThreads = atoi(args[++i]);
+        } else if (strcmp(args[i], "--radius") == 0 && hasValue) {
+            options.maxRadius = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--velocity") == 0 && hasValue) {
+            options.velocity = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--dt") == 0 && hasValue) {
+            options.deltaTime = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--gravity") == 0 && hasValue) {
+            scene.gravity = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--reorder") == 0 && hasValue) {
+            reorderInterval = atoi(args[++i]);
+        } else if (strcmp(args[i], "--nbody") == 0 && hasValue) {
+            nbodyStrength = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--theta") == 0 && hasValue) {
+            openingAngle = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--nbody-check") == 0 && hasValue) {
+            options.nbodyCheck = atoi(args[++i]);
+        } else if (strcmp(args[i], "--brute-force") == 0) {
+            broadPhaseMode = BROADPHASE_BRUTE_FORCE;
+        } else if (strcmp(args[i], "--no-sleep") == 0) {
+            sleepEnabled = false;
+        } else if (strcmp(args[i], "--continuous") == 0) {
+            continuousCollisions = true;
+        } else if (strcmp(args[i], "--scalar") == 0) {
+            setIntegrateKernel(INTEGRATE_SCALAR);
+        } else if (strcmp(args[i], "--scaling") == 0) {
+            scalingReport = true;
+        } else if (strcmp(args[i], "--load") == 0 && hasValue) {
+            options.loadPath = args[++i];
+        } else if (strcmp(args[i], "--save") == 0 && hasValue) {
+            options.savePath = args[++i];
+        } else if (strcmp(args[i], "--record") == 0 && hasValue) {
+            options.recordPath = args[++i];
+        } else if (strcmp(args[i], "--profile-csv") == 0 && hasValue) {
+            options.profilePath = args[++i];
+        } else if (strcmp(args[i], "--selftest") == 0) {
+            return verifyIntegrateKernels() == 0 ? 0 : 1;
+        } else {
+            printUsage(args[0]);
+            return 1;
+        }
+    }
+    if (options.numParticles < 1 || options.steps < 1) {
+        printUsage(args[0]);
+        return 1;
+    }
+
+    ParticleStore store;
+    if (initParticleStore(&store, options.numParticles) != 0) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+
+    // Load once up front to report how long a restore takes and how many
+    // particles the checkpoint holds
+    if (options.loadPath != NULL) {
+        double start = secondsNow();
+        if (spawnScene(&store, &options) != 0) {
+            freeParticleStore(&store);
+            return 1;
+        }
+        printf("loaded %d particles from %s in %.2f ms\n", store.count, options.loadPath, (secondsNow() - start) * 1e3);
+        options.numParticles = store.count;
+    }
+
+    int result;
+    if (options.nbodyCheck > 0) {
+        // Forces are compared at full strength unless --nbody set one
+        if (nbodyStrength == 0.0f) nbodyStrength = 1.0f;
+        result = runNBodyCheck(&store, &options);
+    } else {
+        result = scalingReport ? runScalingReport(&store, &options) : runBenchmark(&store, &options);
+    }
+
+    if (result == 0 && options.savePath != NULL) {
+        double start = secondsNow();
+        if (saveCheckpoint(options.savePath, &store, &scene) != 0) {
+            result = 1;
+        } else {
+            printf("saved %d particles to %s in %.2f ms\n", store.count, options.savePath, (secondsNow() - start) * 1e3);
+        }
+    }
+
+    stopThreadPool();
+    freeMorton();
+    freePhysics();
+    freeParticleStore(&store);
+    return result;
+}
@@ -0,0 +1,294 @@
+// integrate.c
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "integrate.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INTEGRATE_X86 1
+#include <immintrin.h>
+#endif
+
+// The vector kernels must round exactly like the scalar one, so never let the
+// compiler fuse the multiply and add into an FMA.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize ("fp-contract=off")
+#elif defined(__clang__)
+#pragma clang fp contract(off)
+#endif
+
+typedef void (*IntegrateFunction)(ParticleStore* store, int begin, int end, float deltaTime, float gravity);
+
+// Function to bounce a coordinate off the walls at -0.5 and 0.5. A particle
+// that crossed a wall during the step is reflected back by the distance it
+// overshot, where it would be had it bounced at the moment of impact, and is
+// kept inside the cube if it overshot by more than the cube's width.
+static inline void bounceScalar(float* p, float* v) {
+    if (*p <= -0.5f) {
+        *p = -1.0f - *p;
+        *v *= -1.0f;
+    } else if (*p >= 0.5f) {
+        *p = 1.0f - *p;
+        *v *= -1.0f;
+    }
+    if (*p < -0.5f) {
+        *p = -0.5f;
+    } else if (*p > 0.5f) {
+        *p = 0.5f;
+    }
+}
+
+// Scalar reference: advance one particle, apply gravity below the ceiling and
+// reflect off the cube walls
+static void integrateScalar(ParticleStore* store, int begin, int end, float deltaTime, float gravity) {
+    float* px = store->px;
+    float* py = store->py;
+    float* pz = store->pz;
+    float* vx = store->vx;
+    float* vy = store->vy;
+    float* vz = store->vz;
+
+    for (int i = begin; i < end; i++) {
+        px[i] += vx[i] * deltaTime;
+        py[i] += vy[i] * deltaTime;
+        pz[i] += vz[i] * deltaTime;
+
+        if (py[i] <= 0.5f) {
+            vy[i] += gravity;
+        }
+
+        bounceScalar(&px[i], &vx[i]);
+        bounceScalar(&py[i], &vy[i]);
+        bounceScalar(&pz[i], &vz[i]);
+    }
+}
+
+#ifdef INTEGRATE_X86
+
+// SSE2 has no blendv, so select with and/andnot/or
+static inline __m128 select128(__m128 a, __m128 b, __m128 mask) {
+    return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+// Same as bounceScalar. The reflections are low + low - p and high + high - p,
+// the same single subtraction the scalar kernel does.
+static inline void bounce128(__m128* p, __m128* v, __m128 low, __m128 high, __m128 flip) {
+    __m128 hitLow = _mm_cmple_ps(*p, low);
+    __m128 hitHigh = _mm_andnot_ps(hitLow, _mm_cmpge_ps(*p, high));
+    *p = select128(*p, _mm_sub_ps(_mm_add_ps(low, low), *p), hitLow);
+    *p = select128(*p, _mm_sub_ps(_mm_add_ps(high, high), *p), hitHigh);
+    *p = _mm_min_ps(_mm_max_ps(*p, low), high);
+    *v = select128(*v, _mm_mul_ps(*v, flip), _mm_or_ps(hitLow, hitHigh));
+}
+
+static void integrateSSE2(ParticleStore* store, int begin, int end, float deltaTime, float gravity) {
+    const __m128 dt = _mm_set1_ps(deltaTime);
+    const __m128 g = _mm_set1_ps(gravity);
+    const __m128 low = _mm_set1_ps(-0.5f);
+    const __m128 high = _mm_set1_ps(0.5f);
+    const __m128 flip = _mm_set1_ps(-1.0f);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 vx = _mm_loadu_ps(store->vx + i);
+        __m128 vy = _mm_loadu_ps(store->vy + i);
+        __m128 vz = _mm_loadu_ps(store->vz + i);
+        __m128 px = _mm_add_ps(_mm_loadu_ps(store->px + i), _mm_mul_ps(vx, dt));
+        __m128 py = _mm_add_ps(_mm_loadu_ps(store->py + i), _mm_mul_ps(vy, dt));
+        __m128 pz = _mm_add_ps(_mm_loadu_ps(store->pz + i), _mm_mul_ps(vz, dt));
+
+        // Blend rather than add a masked zero, which would turn -0.0 into +0.0
+        vy = select128(vy, _mm_add_ps(vy, g), _mm_cmple_ps(py, high));
+
+        bounce128(&px, &vx, low, high, flip);
+        bounce128(&py, &vy, low, high, flip);
+        bounce128(&pz, &vz, low, high, flip);
+
+        _mm_storeu_ps(store->px + i, px);
+        _mm_storeu_ps(store->py + i, py);
+        _mm_storeu_ps(store->pz + i, pz);
+        _mm_storeu_ps(store->vx + i, vx);
+        _mm_storeu_ps(store->vy + i, vy);
+        _mm_storeu_ps(store->vz + i, vz);
+    }
+    integrateScalar(store, i, end, deltaTime, gravity);
+}
+
+__attribute__((target("avx2")))
+static inline void bounce256(__m256* p, __m256* v, __m256 low, __m256 high, __m256 flip) {
+    __m256 hitLow = _mm256_cmp_ps(*p, low, _CMP_LE_OQ);
+    __m256 hitHigh = _mm256_andnot_ps(hitLow, _mm256_cmp_ps(*p, high, _CMP_GE_OQ));
+    *p = _mm256_blendv_ps(*p, _mm256_sub_ps(_mm256_add_ps(low, low), *p), hitLow);
+    *p = _mm256_blendv_ps(*p, _mm256_sub_ps(_mm256_add_ps(high, high), *p), hitHigh);
+    *p = _mm256_min_ps(_mm256_max_ps(*p, low), high);
+    *v = _mm256_blendv_ps(*v, _mm256_mul_ps(*v, flip), _mm256_or_ps(hitLow, hitHigh));
+}
+
+__attribute__((target("avx2")))
+static void integrateAVX2(ParticleStore* store, int begin, int end, float deltaTime, float gravity) {
+    const __m256 dt = _mm256_set1_ps(deltaTime);
+    const __m256 g = _mm256_set1_ps(gravity);
+    const __m256 low = _mm256_set1_ps(-0.5f);
+    const __m256 high = _mm256_set1_ps(0.5f);
+    const __m256 flip = _mm256_set1_ps(-1.0f);
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 vx = _mm256_loadu_ps(store->vx + i);
+        __m256 vy = _mm256_loadu_ps(store->vy + i);
+        __m256 vz = _mm256_loadu_ps(store->vz + i);
+        __m256 px = _mm256_add_ps(_mm256_loadu_ps(store->px + i), _mm256_mul_ps(vx, dt));
+        __m256 py = _mm256_add_ps(_mm256_loadu_ps(store->py + i), _mm256_mul_ps(vy, dt));
+        __m256 pz = _mm256_add_ps(_mm256_loadu_ps(store->pz + i), _mm256_mul_ps(vz, dt));
+
+        vy = _mm256_blendv_ps(vy, _mm256_add_ps(vy, g), _mm256_cmp_ps(py, high, _CMP_LE_OQ));
+
+        bounce256(&px, &vx, low, high, flip);
+        bounce256(&py, &vy, low, high, flip);
+        bounce256(&pz, &vz, low, high, flip);
+
+        _mm256_storeu_ps(store->px + i, px);
+        _mm256_storeu_ps(store->py + i, py);
+        _mm256_storeu_ps(store->pz + i, pz);
+        _mm256_storeu_ps(store->vx + i, vx);
+        _mm256_storeu_ps(store->vy + i, vy);
+        _mm256_storeu_ps(store->vz + i, vz);
+    }
+    integrateScalar(store, i, end, deltaTime, gravity);
+}
+
+#endif // INTEGRATE_X86
+
+static IntegrateKernel currentKernel;
+static IntegrateFunction currentFunction = NULL;
+// Picks the best kernel exactly once, before any worker reads currentFunction
+static pthread_once_t defaultKernelOnce = PTHREAD_ONCE_INIT;
+
+static IntegrateFunction kernelFunction(IntegrateKernel kernel) {
+    switch (kernel) {
+#ifdef INTEGRATE_X86
+        case INTEGRATE_SSE2:
+            return integrateSSE2;
+        case INTEGRATE_AVX2:
+            return integrateAVX2;
+#endif
+        default:
+            return integrateScalar;
+    }
+}
+
+// Function to pick the widest kernel the CPU we are running on supports
+IntegrateKernel bestIntegrateKernel(void) {
+#ifdef INTEGRATE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return INTEGRATE_AVX2;
+    if (__builtin_cpu_supports("sse2")) return INTEGRATE_SSE2;
+#endif
+    return INTEGRATE_SCALAR;
+}
+
+static void selectDefaultKernel(void) {
+    currentKernel = bestIntegrateKernel();
+    currentFunction = kernelFunction(currentKernel);
+}
+
+// Requests for a kernel the CPU cannot run are lowered to the best one it can.
+// Call before starting parallel work; the workers read the choice unlocked.
+void setIntegrateKernel(IntegrateKernel kernel) {
+    pthread_once(&defaultKernelOnce, selectDefaultKernel);
+    IntegrateKernel best = bestIntegrateKernel();
+    if (kernel > best) kernel = best;
+    currentKernel = kernel;
+    currentFunction = kernelFunction(kernel);
+}
+
+IntegrateKernel getIntegrateKernel(void) {
+    pthread_once(&defaultKernelOnce, selectDefaultKernel);
+    return currentKernel;
+}
+
+const char* integrateKernelName(IntegrateKernel kernel) {
+    switch (kernel) {
+        case INTEGRATE_SSE2: return "sse2";
+        case INTEGRATE_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+// Function to advance particles [begin, end) by one step: integrate position,
+// apply gravity and bounce off the walls of the [-0.5, 0.5] cube at the time
+// of impact
+void integrateParticles(ParticleStore* store, int begin, int end, float deltaTime, float gravity) {
+    pthread_once(&defaultKernelOnce, selectDefaultKernel);
+    currentFunction(store, begin, end, deltaTime, gravity);
+}
+
+// Small deterministic generator so the check does not disturb rand()
+static float verifyRandom(unsigned int* state, float scale) {
+    *state = *state * 1664525u + 1013904223u;
+    return ((*state >> 8) / (float)(1 << 24) - 0.5f) * scale;
+}
+
+static void fillVerifyStore(ParticleStore* store, int count) {
+    unsigned int state = 12345u;
+    store->count = count;
+    for (int i = 0; i < count; i++) {
+        store->px[i] = verifyRandom(&state, 1.4f);
+        store->py[i] = verifyRandom(&state, 1.4f);
+        store->pz[i] = verifyRandom(&state, 1.4f);
+        store->vx[i] = verifyRandom(&state, 4.0f);
+        store->vy[i] = verifyRandom(&state, 4.0f);
+        store->vz[i] = verifyRandom(&state, 4.0f);
+    }
+    // Values sitting exactly on the walls and signed zeros
+    store->px[0] = -0.5f;
+    store->py[1] = 0.5f;
+    store->pz[2] = 0.5f;
+    store->vy[3] = -0.0f;
+    store->vx[4] = -0.0f;
+}
+
+// Function to run every kernel this CPU supports against the scalar one on the
+// same data and compare the results bit for bit. Returns the number of kernels
+// that disagree, or -1 if the buffers could not be allocated.
+int verifyIntegrateKernels(void) {
+    const int count = 1003;  // Not a multiple of the vector width, to cover the tail
+    const int steps = 64;
+    IntegrateKernel saved = getIntegrateKernel();
+    ParticleStore reference, candidate;
+    if (initParticleStore(&reference, count) != 0) return -1;
+    if (initParticleStore(&candidate, count) != 0) {
+        freeParticleStore(&reference);
+        return -1;
+    }
+
+    fillVerifyStore(&reference, count);
+    for (int step = 0; step < steps; step++) {
+        integrateScalar(&reference, 0, count, 0.016f, step % 2 ? 0.1f : 0.0f);
+    }
+
+    int failures = 0;
+    for (IntegrateKernel kernel = INTEGRATE_SSE2; kernel <= bestIntegrateKernel(); kernel++) {
+        fillVerifyStore(&candidate, count);
+        setIntegrateKernel(kernel);
+        for (int step = 0; step < steps; step++) {
+            integrateParticles(&candidate, 0, count, 0.016f, step % 2 ? 0.1f : 0.0f);
+        }
+        size_t bytes = count * sizeof(float);
+        bool same = memcmp(reference.px, candidate.px, bytes) == 0 &&
+                    memcmp(reference.py, candidate.py, bytes) == 0 &&
+                    memcmp(reference.pz, candidate.pz, bytes) == 0 &&
+                    memcmp(reference.vx, candidate.vx, bytes) == 0 &&
+                    memcmp(reference.vy, candidate.vy, bytes) == 0 &&
+                    memcmp(reference.vz, candidate.vz, bytes) == 0;
+        printf("Integrate kernel %s: %s\n", integrateKernelName(kernel), same ? "matches scalar" : "MISMATCH");
+        if (!same) failures++;
+    }
+
+    setIntegrateKernel(saved);
+    freeParticleStore(&reference);
+    freeParticleStore(&candidate);
+    return failures;
+}
@@ -0,0 +1,21 @@
+// integrate.h
+
+#ifndef INTEGRATE_H
+#define INTEGRATE_H
+
+#include "particle.h"
+
+typedef enum {
+    INTEGRATE_SCALAR,
+    INTEGRATE_SSE2,  // 4 particles per iteration
+    INTEGRATE_AVX2   // 8 particles per iteration
+} IntegrateKernel;
+
+IntegrateKernel bestIntegrateKernel(void);
+void setIntegrateKernel(IntegrateKernel kernel);
+IntegrateKernel getIntegrateKernel(void);
+const char* integrateKernelName(IntegrateKernel kernel);
+void integrateParticles(ParticleStore* store, int begin, int end, float deltaTime, float gravity);
+int verifyIntegrateKernels(void);
+
+#endif // INTEGRATE_H
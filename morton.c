@@ -0,0 +1,187 @@
+// morton.c
+//
+// Sorts the particle storage along a Z-order curve through the cube, so
+// particles that are close in space are close in memory. Particles drift
+// apart as they move, so the sort is repeated every reorderInterval steps.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "morton.h"
+#include "threadpool.h"
+
+// Bits of each coordinate in a Morton code, and of the code each radix pass sorts by
+#define MORTON_BITS 10
+#define RADIX_BITS 10
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES ((3 * MORTON_BITS + RADIX_BITS - 1) / RADIX_BITS)
+// Particles per radix sort chunk. Chunks are fixed, not handed out as the
+// pool sees fit, so each keeps its own histogram and the sort stays stable.
+#define RADIX_CHUNK 16384
+
+int reorderInterval = 100;
+
+static uint32_t* keys;
+static uint32_t* sortedKeys;
+static int* order;
+static int* sortedOrder;
+static uint32_t* scratch;
+static int sortCapacity;
+// One histogram per chunk, then the scatter offsets of each bucket in each chunk
+static int* histograms;
+static int histogramChunks;
+
+typedef struct {
+    const ParticleStore* store;
+    const uint32_t* keys;
+    const int* order;
+    uint32_t* sortedKeys;
+    int* sortedOrder;
+    int count;
+    int shift;
+} RadixContext;
+
+// Function to spread the low 10 bits of 'v' out to every third bit
+static uint32_t spreadBits(uint32_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Function to quantize a coordinate of the cube [-0.5, 0.5] to MORTON_BITS
+static uint32_t quantize(float p) {
+    int q = (int)((p + 0.5f) * (1 << MORTON_BITS));
+    if (q < 0) return 0;
+    if (q >= 1 << MORTON_BITS) return (1 << MORTON_BITS) - 1;
+    return (uint32_t)q;
+}
+
+static void mortonTask(void* context, int begin, int end, int worker) {
+    RadixContext* radix = context;
+    const ParticleStore* store = radix->store;
+    for (int i = begin; i < end; i++) {
+        keys[i] = spreadBits(quantize(store->px[i])) | spreadBits(quantize(store->py[i])) << 1 |
+                  spreadBits(quantize(store->pz[i])) << 2;
+        order[i] = i;
+    }
+}
+
+// Each task index is one chunk
+static void histogramTask(void* context, int begin, int end, int worker) {
+    RadixContext* radix = context;
+    for (int chunk = begin; chunk < end; chunk++) {
+        int* histogram = histograms + (size_t)chunk * RADIX_BUCKETS;
+        memset(histogram, 0, RADIX_BUCKETS * sizeof(int));
+        int last = (chunk + 1) * RADIX_CHUNK < radix->count ? (chunk + 1) * RADIX_CHUNK : radix->count;
+        for (int k = chunk * RADIX_CHUNK; k < last; k++) {
+            histogram[(radix->keys[k] >> radix->shift) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+}
+
+// Each task index is one chunk, writing from its own offset in every bucket
+static void scatterTask(void* context, int begin, int end, int worker) {
+    RadixContext* radix = context;
+    for (int chunk = begin; chunk < end; chunk++) {
+        int* offset = histograms + (size_t)chunk * RADIX_BUCKETS;
+        int last = (chunk + 1) * RADIX_CHUNK < radix->count ? (chunk + 1) * RADIX_CHUNK : radix->count;
+        for (int k = chunk * RADIX_CHUNK; k < last; k++) {
+            int slot = offset[(radix->keys[k] >> radix->shift) & (RADIX_BUCKETS - 1)]++;
+            radix->sortedKeys[slot] = radix->keys[k];
+            radix->sortedOrder[slot] = radix->order[k];
+        }
+    }
+}
+
+// Function to make room for sorting 'count' particles. Returns -1 if memory
+// ran out.
+static int reserveSort(int count) {
+    int chunks = (count + RADIX_CHUNK - 1) / RADIX_CHUNK;
+    if (chunks > histogramChunks) {
+        int* grown = realloc(histograms, (size_t)chunks * RADIX_BUCKETS * sizeof(int));
+        if (grown == NULL) return -1;
+        histograms = grown;
+        histogramChunks = chunks;
+    }
+    if (count <= sortCapacity) return 0;
+    uint32_t* newKeys = realloc(keys, (size_t)count * sizeof(uint32_t));
+    if (newKeys != NULL) keys = newKeys;
+    uint32_t* newSortedKeys = realloc(sortedKeys, (size_t)count * sizeof(uint32_t));
+    if (newSortedKeys != NULL) sortedKeys = newSortedKeys;
+    int* newOrder = realloc(order, (size_t)count * sizeof(int));
+    if (newOrder != NULL) order = newOrder;
+    int* newSortedOrder = realloc(sortedOrder, (size_t)count * sizeof(int));
+    if (newSortedOrder != NULL) sortedOrder = newSortedOrder;
+    uint32_t* newScratch = realloc(scratch, (size_t)count * sizeof(uint32_t));
+    if (newScratch != NULL) scratch = newScratch;
+    if (newKeys == NULL || newSortedKeys == NULL || newOrder == NULL || newSortedOrder == NULL || newScratch == NULL) {
+        return -1;
+    }
+    sortCapacity = count;
+    return 0;
+}
+
+// Function to sort the particle storage by the Morton code of each
+// particle's position, with an LSD radix sort whose passes run chunk by
+// chunk on the thread pool. Indices change, ids don't. Returns -1 if memory
+// ran out, in which case the store is unchanged.
+int sortParticlesByMorton(ParticleStore* store) {
+    int count = store->count;
+    if (count < 2) return 0;
+    if (reserveSort(count) != 0) return -1;
+
+    RadixContext radix = {store, NULL, NULL, NULL, NULL, count, 0};
+    parallelFor(count, RADIX_CHUNK, mortonTask, &radix);
+
+    int chunks = (count + RADIX_CHUNK - 1) / RADIX_CHUNK;
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        radix.keys = keys;
+        radix.order = order;
+        radix.sortedKeys = sortedKeys;
+        radix.sortedOrder = sortedOrder;
+        radix.shift = pass * RADIX_BITS;
+        parallelFor(chunks, 1, histogramTask, &radix);
+
+        // Bucket by bucket, chunk by chunk: where each chunk starts writing
+        int total = 0;
+        for (int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+            for (int chunk = 0; chunk < chunks; chunk++) {
+                int* entry = histograms + (size_t)chunk * RADIX_BUCKETS + bucket;
+                int size = *entry;
+                *entry = total;
+                total += size;
+            }
+        }
+        parallelFor(chunks, 1, scatterTask, &radix);
+
+        uint32_t* swapKeys = keys;
+        keys = sortedKeys;
+        sortedKeys = swapKeys;
+        int* swapOrder = order;
+        order = sortedOrder;
+        sortedOrder = swapOrder;
+    }
+
+    permuteParticles(store, order, scratch);
+    return 0;
+}
+
+void freeMorton(void) {
+    free(keys);
+    free(sortedKeys);
+    free(order);
+    free(sortedOrder);
+    free(scratch);
+    free(histograms);
+    keys = NULL;
+    sortedKeys = NULL;
+    order = NULL;
+    sortedOrder = NULL;
+    scratch = NULL;
+    histograms = NULL;
+    sortCapacity = 0;
+    histogramChunks = 0;
+}
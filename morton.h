@@ -0,0 +1,14 @@
+// morton.h
+
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "particle.h"
+
+// Steps between reorders of the particle storage; 0 never reorders
+extern int reorderInterval;
+
+int sortParticlesByMorton(ParticleStore* store);
+void freeMorton(void);
+
+#endif // MORTON_H
@@ -0,0 +1,479 @@
+// nbody.c
+//
+// Mutual gravity between the particles, approximated with a Barnes-Hut
+// octree so a step costs O(n log n) rather than O(n^2).
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nbody.h"
+#include "threadpool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Cells with this many bodies or fewer are not split further
+#define LEAF_SIZE 8
+// The largest cells with this many bodies or fewer are the groups the tree is
+// walked for: one walk serves every body of the group
+#define GROUP_SIZE 64
+// Cells stop being split this deep, in case many bodies share one position
+#define MAX_DEPTH 24
+// Distance below which the pull stops growing, so close passes don't fling
+// particles apart; particles this close are colliding anyway
+#define SOFTENING 0.01f
+// Groups per parallel force task
+#define GROUP_GRAIN 4
+
+float nbodyStrength = 0.0f;
+float openingAngle = 0.5f;
+
+// Nodes are stored depth first: the children of a node follow it directly,
+// and 'next' is the node after its whole subtree, so a leaf is a node whose
+// next is node + 1. The force walk needs no stack, it either descends to
+// node + 1 or skips to next.
+typedef struct {
+    float x, y, z;              // Center of mass
+    float mass;
+    float centerX, centerY, centerZ;
+    float halfSize;             // Half the edge of the cell
+    int next;
+    int first;                  // Bodies of the subtree: [first, first + count) in tree order
+    int count;
+} OctreeNode;
+
+static OctreeNode* nodes;
+static int nodeCount;
+static int nodeCapacity;
+// Particle index, position and mass of every body, in tree order
+static int* order;
+static int* scratch;
+static float* bodyX;
+static float* bodyY;
+static float* bodyZ;
+static float* bodyMass;
+static int bodyCapacity;
+// Node index of every group, in tree order
+static int* groups;
+static int groupCount;
+static bool outOfMemory;
+// Accelerations applyNBodyForces works with
+static float* accelerationX;
+static float* accelerationY;
+static float* accelerationZ;
+static int accelerationCapacity;
+
+// Function to make room for 'count' bodies. Returns -1 if memory ran out.
+static int reserveBodies(int count) {
+    if (count <= bodyCapacity) return 0;
+    int* newOrder = realloc(order, (size_t)count * sizeof(int));
+    if (newOrder != NULL) order = newOrder;
+    int* newScratch = realloc(scratch, (size_t)count * sizeof(int));
+    if (newScratch != NULL) scratch = newScratch;
+    int* newGroups = realloc(groups, (size_t)count * sizeof(int));
+    if (newGroups != NULL) groups = newGroups;
+    float* x = realloc(bodyX, (size_t)count * sizeof(float));
+    if (x != NULL) bodyX = x;
+    float* y = realloc(bodyY, (size_t)count * sizeof(float));
+    if (y != NULL) bodyY = y;
+    float* z = realloc(bodyZ, (size_t)count * sizeof(float));
+    if (z != NULL) bodyZ = z;
+    float* mass = realloc(bodyMass, (size_t)count * sizeof(float));
+    if (mass != NULL) bodyMass = mass;
+    if (newOrder == NULL || newScratch == NULL || newGroups == NULL || x == NULL || y == NULL || z == NULL || mass == NULL) return -1;
+    bodyCapacity = count;
+    return 0;
+}
+
+// Function to append a node. Returns its index, or -1 if memory ran out.
+static int addNode(void) {
+    if (nodeCount == nodeCapacity) {
+        int capacity = nodeCapacity > 0 ? nodeCapacity * 2 : 1024;
+        OctreeNode* grown = realloc(nodes, (size_t)capacity * sizeof(OctreeNode));
+        if (grown == NULL) return -1;
+        nodes = grown;
+        nodeCapacity = capacity;
+    }
+    return nodeCount++;
+}
+
+static float bodyMassOf(const ParticleStore* store, int i) {
+    float radius = store->radius[i];
+    return radius * radius * radius;
+}
+
+// Function to build the subtree of the cell at (centerX, centerY, centerZ)
+// over the bodies order[begin, end), which it sorts into octant order
+static void buildNode(const ParticleStore* store, int begin, int end, float centerX, float centerY, float centerZ,
+                      float halfSize, int depth, bool inGroup) {
+    int index = addNode();
+    if (index < 0) {
+        outOfMemory = true;
+        return;
+    }
+    OctreeNode node = {0.0f, 0.0f, 0.0f, 0.0f, centerX, centerY, centerZ, halfSize, 0, begin, end - begin};
+    bool leaf = end - begin <= LEAF_SIZE || depth == MAX_DEPTH;
+    // A leaf at MAX_DEPTH can hold more than GROUP_SIZE bodies when many sit
+    // on the same spot; it still has to be a group or they get no force
+    if (!inGroup && (end - begin <= GROUP_SIZE || leaf)) {
+        groups[groupCount++] = index;
+        inGroup = true;
+    }
+
+    if (leaf) {
+        for (int k = begin; k < end; k++) {
+            int i = order[k];
+            float mass = bodyMassOf(store, i);
+            node.x += store->px[i] * mass;
+            node.y += store->py[i] * mass;
+            node.z += store->pz[i] * mass;
+            node.mass += mass;
+        }
+    } else {
+        // Counting sort of the bodies into the eight octants
+        int octantStart[9] = {0};
+        for (int k = begin; k < end; k++) {
+            int i = order[k];
+            int octant = (store->px[i] >= centerX) | (store->py[i] >= centerY) << 1 | (store->pz[i] >= centerZ) << 2;
+            octantStart[octant + 1]++;
+        }
+        for (int octant = 0; octant < 8; octant++) octantStart[octant + 1] += octantStart[octant];
+        int fill[8];
+        memcpy(fill, octantStart, sizeof(fill));
+        for (int k = begin; k < end; k++) {
+            int i = order[k];
+            int octant = (store->px[i] >= centerX) | (store->py[i] >= centerY) << 1 | (store->pz[i] >= centerZ) << 2;
+            scratch[begin + fill[octant]++] = i;
+        }
+        memcpy(order + begin, scratch + begin, (size_t)(end - begin) * sizeof(int));
+
+        float quarter = 0.5f * halfSize;
+        for (int octant = 0; octant < 8; octant++) {
+            int childBegin = begin + octantStart[octant];
+            int childEnd = begin + octantStart[octant + 1];
+            if (childBegin == childEnd) continue;
+            int child = nodeCount;
+            buildNode(store, childBegin, childEnd, centerX + (octant & 1 ? quarter : -quarter),
+                      centerY + (octant & 2 ? quarter : -quarter), centerZ + (octant & 4 ? quarter : -quarter), quarter,
+                      depth + 1, inGroup);
+            if (outOfMemory) return;
+            const OctreeNode* built = &nodes[child];
+            node.x += built->x * built->mass;
+            node.y += built->y * built->mass;
+            node.z += built->z * built->mass;
+            node.mass += built->mass;
+        }
+    }
+
+    if (node.mass > 0.0f) {
+        node.x /= node.mass;
+        node.y /= node.mass;
+        node.z /= node.mass;
+    } else {
+        node.x = centerX;
+        node.y = centerY;
+        node.z = centerZ;
+    }
+    node.next = nodeCount;
+    nodes[index] = node;
+}
+
+// Function to build the octree over the current particle positions. Returns
+// -1 if memory ran out.
+static int buildOctree(const ParticleStore* store) {
+    nodeCount = 0;
+    groupCount = 0;
+    outOfMemory = false;
+    if (store->count == 0) return 0;
+    if (reserveBodies(store->count) != 0) return -1;
+
+    // The root is the smallest cube around every particle
+    float minX = store->px[0], maxX = minX;
+    float minY = store->py[0], maxY = minY;
+    float minZ = store->pz[0], maxZ = minZ;
+    for (int i = 0; i < store->count; i++) {
+        order[i] = i;
+        minX = fminf(minX, store->px[i]);
+        maxX = fmaxf(maxX, store->px[i]);
+        minY = fminf(minY, store->py[i]);
+        maxY = fmaxf(maxY, store->py[i]);
+        minZ = fminf(minZ, store->pz[i]);
+        maxZ = fmaxf(maxZ, store->pz[i]);
+    }
+    float halfSize = fmaxf(0.5f * fmaxf(maxX - minX, fmaxf(maxY - minY, maxZ - minZ)), 1e-6f);
+    buildNode(store, 0, store->count, 0.5f * (minX + maxX), 0.5f * (minY + maxY), 0.5f * (minZ + maxZ), halfSize, 0, false);
+    if (outOfMemory) {
+        nodeCount = 0;
+        return -1;
+    }
+
+    for (int k = 0; k < store->count; k++) {
+        int i = order[k];
+        bodyX[k] = store->px[i];
+        bodyY[k] = store->py[i];
+        bodyZ[k] = store->pz[i];
+        bodyMass[k] = bodyMassOf(store, i);
+    }
+    return 0;
+}
+
+// Cells the walk accepted and bodies of the leaves it opened for one group,
+// as point masses. The length is padded to a multiple of 4 with massless
+// entries, so the force loop needs no tail.
+typedef struct {
+    float* x;
+    float* y;
+    float* z;
+    float* mass;
+    int count;
+    int capacity;
+} InteractionList;
+
+static InteractionList interactions[MAX_THREADS];
+
+// Function to append a point mass. Returns -1 if memory ran out.
+static int addInteraction(InteractionList* list, float x, float y, float z, float mass) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+        float* newX = realloc(list->x, (size_t)capacity * sizeof(float));
+        if (newX != NULL) list->x = newX;
+        float* newY = realloc(list->y, (size_t)capacity * sizeof(float));
+        if (newY != NULL) list->y = newY;
+        float* newZ = realloc(list->z, (size_t)capacity * sizeof(float));
+        if (newZ != NULL) list->z = newZ;
+        float* newMass = realloc(list->mass, (size_t)capacity * sizeof(float));
+        if (newMass != NULL) list->mass = newMass;
+        if (newX == NULL || newY == NULL || newZ == NULL || newMass == NULL) return -1;
+        list->capacity = capacity;
+    }
+    list->x[list->count] = x;
+    list->y[list->count] = y;
+    list->z[list->count] = z;
+    list->mass[list->count] = mass;
+    list->count++;
+    return 0;
+}
+
+// Function to collect what pulls on the bodies of one group. The walk is
+// done once for the whole group against the box around its bodies: a cell
+// counts as one body if it is far enough from every point of the box, and
+// cells the box reaches into are always opened. Bodies of the group itself
+// end up in the list too; a body's pull on itself is zero. Returns -1 if
+// memory ran out.
+static int collectInteractions(InteractionList* list, const OctreeNode* group) {
+    float minX = bodyX[group->first], maxX = minX;
+    float minY = bodyY[group->first], maxY = minY;
+    float minZ = bodyZ[group->first], maxZ = minZ;
+    for (int k = group->first + 1; k < group->first + group->count; k++) {
+        minX = fminf(minX, bodyX[k]);
+        maxX = fmaxf(maxX, bodyX[k]);
+        minY = fminf(minY, bodyY[k]);
+        maxY = fmaxf(maxY, bodyY[k]);
+        minZ = fminf(minZ, bodyZ[k]);
+        maxZ = fmaxf(maxZ, bodyZ[k]);
+    }
+    float boxX = 0.5f * (minX + maxX), boxY = 0.5f * (minY + maxY), boxZ = 0.5f * (minZ + maxZ);
+    float halfX = 0.5f * (maxX - minX), halfY = 0.5f * (maxY - minY), halfZ = 0.5f * (maxZ - minZ);
+    float angleSquared = openingAngle * openingAngle;
+
+    list->count = 0;
+    int n = 0;
+    while (n < nodeCount) {
+        const OctreeNode* node = &nodes[n];
+        bool overlaps = fabsf(node->centerX - boxX) <= node->halfSize + halfX &&
+                        fabsf(node->centerY - boxY) <= node->halfSize + halfY &&
+                        fabsf(node->centerZ - boxZ) <= node->halfSize + halfZ;
+        if (!overlaps) {
+            float dx = fmaxf(0.0f, fabsf(node->x - boxX) - halfX);
+            float dy = fmaxf(0.0f, fabsf(node->y - boxY) - halfY);
+            float dz = fmaxf(0.0f, fabsf(node->z - boxZ) - halfZ);
+            float size = 2.0f * node->halfSize;
+            if (size * size < angleSquared * (dx * dx + dy * dy + dz * dz)) {
+                if (addInteraction(list, node->x, node->y, node->z, node->mass) != 0) return -1;
+                n = node->next;
+                continue;
+            }
+        }
+        if (node->next == n + 1) {
+            for (int k = node->first; k < node->first + node->count; k++) {
+                if (addInteraction(list, bodyX[k], bodyY[k], bodyZ[k], bodyMass[k]) != 0) return -1;
+            }
+            n = node->next;
+        } else {
+            n++;
+        }
+    }
+    while (list->count % 4 != 0) {
+        if (addInteraction(list, 0.0f, 0.0f, 0.0f, 0.0f) != 0) return -1;
+    }
+    return 0;
+}
+
+// Function to sum the pull of every entry of 'list' on the body at (x, y, z)
+static void sumInteractions(const InteractionList* list, float x, float y, float z, float acceleration[3]) {
+    float ax = 0.0f, ay = 0.0f, az = 0.0f;
+    int j = 0;
+#ifdef __SSE2__
+    const __m128 vx = _mm_set1_ps(x), vy = _mm_set1_ps(y), vz = _mm_set1_ps(z);
+    const __m128 softening = _mm_set1_ps(SOFTENING * SOFTENING);
+    const __m128 half = _mm_set1_ps(0.5f), three = _mm_set1_ps(3.0f);
+    __m128 sumX = _mm_setzero_ps(), sumY = _mm_setzero_ps(), sumZ = _mm_setzero_ps();
+    for (; j < list->count; j += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(list->x + j), vx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(list->y + j), vy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(list->z + j), vz);
+        __m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                                            _mm_add_ps(_mm_mul_ps(dz, dz), softening));
+        // Estimate 1/sqrt and refine it with one Newton step to near full precision
+        __m128 estimate = _mm_rsqrt_ps(distanceSquared);
+        __m128 inverse = _mm_mul_ps(_mm_mul_ps(half, estimate),
+                                    _mm_sub_ps(three, _mm_mul_ps(distanceSquared, _mm_mul_ps(estimate, estimate))));
+        __m128 pull = _mm_mul_ps(_mm_loadu_ps(list->mass + j), _mm_mul_ps(inverse, _mm_mul_ps(inverse, inverse)));
+        sumX = _mm_add_ps(sumX, _mm_mul_ps(dx, pull));
+        sumY = _mm_add_ps(sumY, _mm_mul_ps(dy, pull));
+        sumZ = _mm_add_ps(sumZ, _mm_mul_ps(dz, pull));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, sumX);
+    ax = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm_storeu_ps(lanes, sumY);
+    ay = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm_storeu_ps(lanes, sumZ);
+    az = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for (; j < list->count; j++) {
+        float dx = list->x[j] - x, dy = list->y[j] - y, dz = list->z[j] - z;
+        float inverse = 1.0f / sqrtf(dx * dx + dy * dy + dz * dz + SOFTENING * SOFTENING);
+        float pull = list->mass[j] * inverse * inverse * inverse;
+        ax += dx * pull;
+        ay += dy * pull;
+        az += dz * pull;
+    }
+    acceleration[0] = nbodyStrength * ax;
+    acceleration[1] = nbodyStrength * ay;
+    acceleration[2] = nbodyStrength * az;
+}
+
+// Function to return the acceleration on particle i summed over every other
+// particle. The reference computeNBodyAccelerations is measured against.
+void directAcceleration(const ParticleStore* store, int i, float acceleration[3]) {
+    double ax = 0.0, ay = 0.0, az = 0.0;
+    for (int j = 0; j < store->count; j++) {
+        if (j == i) continue;
+        double dx = store->px[j] - store->px[i];
+        double dy = store->py[j] - store->py[i];
+        double dz = store->pz[j] - store->pz[i];
+        double inverse = 1.0 / sqrt(dx * dx + dy * dy + dz * dz + SOFTENING * SOFTENING);
+        double pull = bodyMassOf(store, j) * inverse * inverse * inverse;
+        ax += dx * pull;
+        ay += dy * pull;
+        az += dz * pull;
+    }
+    acceleration[0] = (float)(nbodyStrength * ax);
+    acceleration[1] = (float)(nbodyStrength * ay);
+    acceleration[2] = (float)(nbodyStrength * az);
+}
+
+typedef struct {
+    float* ax;
+    float* ay;
+    float* az;
+    bool failed[MAX_THREADS];
+} ForceContext;
+
+// Each task index is one group. Groups share nothing but the tree they read,
+// and every particle is in exactly one group.
+static void forceTask(void* context, int begin, int end, int worker) {
+    ForceContext* forces = context;
+    InteractionList* list = &interactions[worker];
+    for (int g = begin; g < end; g++) {
+        const OctreeNode* group = &nodes[groups[g]];
+        if (collectInteractions(list, group) != 0) {
+            forces->failed[worker] = true;
+            return;
+        }
+        for (int k = group->first; k < group->first + group->count; k++) {
+            float acceleration[3];
+            sumInteractions(list, bodyX[k], bodyY[k], bodyZ[k], acceleration);
+            int i = order[k];
+            forces->ax[i] = acceleration[0];
+            forces->ay[i] = acceleration[1];
+            forces->az[i] = acceleration[2];
+        }
+    }
+}
+
+// Function to rebuild the octree and fill (ax, ay, az) with the pull of all
+// other particles on each particle. Returns -1 if memory ran out.
+int computeNBodyAccelerations(const ParticleStore* store, float* ax, float* ay, float* az) {
+    if (buildOctree(store) != 0) return -1;
+    ForceContext context = {ax, ay, az, {false}};
+    parallelFor(groupCount, GROUP_GRAIN, forceTask, &context);
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        if (context.failed[worker]) return -1;
+    }
+    return 0;
+}
+
+// Function to change every particle's velocity by the pull of all the others
+// over 'deltaTime'. Returns -1 if memory ran out, in which case no velocity
+// is changed.
+int applyNBodyForces(ParticleStore* store, float deltaTime) {
+    if (store->count > accelerationCapacity) {
+        float* x = realloc(accelerationX, (size_t)store->count * sizeof(float));
+        if (x != NULL) accelerationX = x;
+        float* y = realloc(accelerationY, (size_t)store->count * sizeof(float));
+        if (y != NULL) accelerationY = y;
+        float* z = realloc(accelerationZ, (size_t)store->count * sizeof(float));
+        if (z != NULL) accelerationZ = z;
+        if (x == NULL || y == NULL || z == NULL) return -1;
+        accelerationCapacity = store->count;
+    }
+    if (computeNBodyAccelerations(store, accelerationX, accelerationY, accelerationZ) != 0) return -1;
+    for (int i = 0; i < store->count; i++) {
+        store->vx[i] += accelerationX[i] * deltaTime;
+        store->vy[i] += accelerationY[i] * deltaTime;
+        store->vz[i] += accelerationZ[i] * deltaTime;
+    }
+    return 0;
+}
+
+void freeNBody(void) {
+    for (int worker = 0; worker < MAX_THREADS; worker++) {
+        InteractionList* list = &interactions[worker];
+        free(list->x);
+        free(list->y);
+        free(list->z);
+        free(list->mass);
+        memset(list, 0, sizeof(*list));
+    }
+    free(groups);
+    free(accelerationX);
+    free(accelerationY);
+    free(accelerationZ);
+    groups = NULL;
+    accelerationX = NULL;
+    accelerationY = NULL;
+    accelerationZ = NULL;
+    groupCount = 0;
+    accelerationCapacity = 0;
+    free(nodes);
+    free(order);
+    free(scratch);
+    free(bodyX);
+    free(bodyY);
+    free(bodyZ);
+    free(bodyMass);
+    nodes = NULL;
+    order = NULL;
+    scratch = NULL;
+    bodyX = NULL;
+    bodyY = NULL;
+    bodyZ = NULL;
+    bodyMass = NULL;
+    nodeCount = 0;
+    nodeCapacity = 0;
+    bodyCapacity = 0;
+}
@@ -0,0 +1,20 @@
+// nbody.h
+
+#ifndef NBODY_H
+#define NBODY_H
+
+#include "particle.h"
+
+// Strength of the pull between particles; 0 turns the N-body mode off. A
+// particle's mass is its radius cubed.
+extern float nbodyStrength;
+// Barnes-Hut opening angle: a cell is treated as one body when its size is
+// below this fraction of its distance. 0 sums every pair exactly.
+extern float openingAngle;
+
+int computeNBodyAccelerations(const ParticleStore* store, float* ax, float* ay, float* az);
+void directAcceleration(const ParticleStore* store, int i, float acceleration[3]);
+int applyNBodyForces(ParticleStore* store, float deltaTime);
+void freeNBody(void);
+
+#endif // NBODY_H
@@ -0,0 +1,241 @@
+// offline.c
+//
+// Renders a simulation run to an image sequence or a raw video stream
+// without opening a window, at any resolution. Each frame goes through the
+// same updateParticles, drawLine3D and renderParticles calls as the window,
+// so the output matches what the window would show for the same scene.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "particle.h"
+#include "checkpoint.h"
+#include "physics.h"
+#include "nbody.h"
+#include "morton.h"
+#include "raster.h"
+#include "view.h"
+#include "sprite.h"
+#include "frames.h"
+#include "threadpool.h"
+#include "timer.h"
+
+typedef struct {
+    int numParticles;
+    int frames;
+    int stepsPerFrame;
+    unsigned int seed;
+    int numThreads;
+    int writers;
+    int width;
+    int height;
+    float maxRadius;
+    float velocity;
+    float deltaTime;
+    const char* loadPath;  // Checkpoint to start from instead of a random scene
+    const char* output;    // File name pattern, or "-" for raw RGBA on stdout
+} OfflineOptions;
+
+static const Vec3D cubeVertices[8] = {
+    {-0.5f, -0.5f, -0.5f},
+    { 0.5f, -0.5f, -0.5f},
+    { 0.5f,  0.5f, -0.5f},
+    {-0.5f,  0.5f, -0.5f},
+    {-0.5f, -0.5f,  0.5f},
+    { 0.5f, -0.5f,  0.5f},
+    { 0.5f,  0.5f,  0.5f},
+    {-0.5f,  0.5f,  0.5f}
+};
+
+static const int edges[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 0},  // Back face
+    {4, 5}, {5, 6}, {6, 7}, {7, 4},  // Front face
+    {0, 4}, {1, 5}, {2, 6}, {3, 7}   // Connecting edges
+};
+
+// Camera, gravity and light of the run; a loaded checkpoint's are kept as is
+static SceneSettings scene = {{{0.0f, 0.0f, -3.0f}, 0.0f, 0.0f}, 0.0f, {0.0f, -1.0f, 1.0f}, 1.0f};
+
+// Function to fill the store with the scene for the options' seed, or with
+// the loaded checkpoint. Returns -1 if the checkpoint could not be loaded.
+static int spawnScene(ParticleStore* store, const OfflineOptions* options) {
+    if (options->loadPath != NULL) {
+        if (loadCheckpoint(options->loadPath, store, &scene) != 0) return -1;
+        lightDir = scene.lightDir;
+        lightIntensity = scene.lightIntensity;
+    } else {
+        seedParticles(options->seed);
+        clearParticles(store);
+        spawnParticles(store, options->numParticles, options->velocity, options->maxRadius);
+    }
+    gravity = scene.gravity;
+    return 0;
+}
+
+// Function to draw the cube and the particles as the window does
+static void drawFrame(uint32_t* pixels, DepthBuffer* depthBuffer, ProjectedParticles* projected, const ParticleStore* store) {
+    uint32_t white = (255u << 24) | (255 << 16) | (255 << 8) | 255;
+    ViewTransform view;
+    memset(pixels, 0, (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+    buildViewTransform(&view, scene.camera);
+    transformParticles(projected, &view, store);
+    for (int lineNumber = 0; lineNumber < 12; lineNumber++) {
+        drawLine3D(pixels, &view, cubeVertices[edges[lineNumber][0]], cubeVertices[edges[lineNumber][1]], white);
+    }
+    renderParticles(pixels, depthBuffer, scene.camera, store, projected);
+}
+
+static int runOffline(ParticleStore* store, const OfflineOptions* options) {
+    FrameFormat format;
+    if (parseFrameFormat(options->output, &format) != 0) return 1;
+    if (spawnScene(store, options) != 0) return 1;
+    startThreadPool(options->numThreads);
+
+    FrameWriter writer;
+    if (startFrameWriter(&writer, format, options->output, options->width, options->height, options->writers) != 0) {
+        return 1;
+    }
+    DepthBuffer depthBuffer;
+    ProjectedParticles projected;
+    initDepthBuffer(&depthBuffer);
+    initProjectedParticles(&projected);
+
+    double simulateSeconds = 0.0;
+    double renderSeconds = 0.0;
+    long long step = 0;
+    int frame = 0;
+    double start = secondsNow();
+    for (; frame < options->frames; frame++) {
+        // Frame 0 is the starting state, each later one 'stepsPerFrame' on
+        double phaseStart = secondsNow();
+        for (int s = 0; frame > 0 && s < options->stepsPerFrame; s++, step++) {
+            if (reorderInterval > 0 && step % reorderInterval == 0) sortParticlesByMorton(store);
+            updateParticles(store, options->deltaTime);
+        }
+        double simulated = secondsNow();
+        simulateSeconds += simulated - phaseStart;
+
+        uint32_t* pixels = acquireFrame(&writer);
+        if (pixels == NULL) break;
+        double acquired = secondsNow();
+        drawFrame(pixels, &depthBuffer, &projected, store);
+        submitFrame(&writer);
+        renderSeconds += secondsNow() - acquired;
+    }
+    int result = stopFrameWriter(&writer);
+    double elapsed = secondsNow() - start;
+
+    // stdout may be carrying the video, so the report goes to stderr
+    fprintf(stderr, "particles:            %d\n", store->count);
+    fprintf(stderr, "frames:               %d of %d\n", frame, options->frames);
+    fprintf(stderr, "resolution:           %dx%d\n", options->width, options->height);
+    fprintf(stderr, "steps/frame:          %d\n", options->stepsPerFrame);
+    fprintf(stderr, "threads:              %d\n", threadPoolSize());
+    fprintf(stderr, "elapsed:              %.3f s\n", elapsed);
+    fprintf(stderr, "frames/sec:           %.2f\n", frame > 0 ? frame / elapsed : 0.0);
+    fprintf(stderr, "simulate ms/frame:    %.2f\n", frame > 0 ? simulateSeconds * 1e3 / frame : 0.0);
+    fprintf(stderr, "render ms/frame:      %.2f\n", frame > 0 ? renderSeconds * 1e3 / frame : 0.0);
+
+    freeProjectedParticles(&projected);
+    freeDepthBuffer(&depthBuffer);
+    return result == 0 ? 0 : 1;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "Usage: %s --out PATTERN [options]\n", program);
+    fprintf(stderr, "  --out PATTERN       frame files such as frames/%%05d.png or .ppm, or - for raw RGBA on stdout\n");
+    fprintf(stderr, "  --frames N          number of frames (default 300)\n");
+    fprintf(stderr, "  --steps-per-frame N physics steps between frames (default 1)\n");
+    fprintf(stderr, "  --width N           frame width in pixels (default 1280)\n");
+    fprintf(stderr, "  --height N          frame height in pixels (default 720)\n");
+    fprintf(stderr, "  --writers N         threads encoding and writing frames (default 2)\n");
+    fprintf(stderr, "  --particles N       number of particles (default 10000)\n");
+    fprintf(stderr, "  --seed N            random seed for the initial scene (default 1)\n");
+    fprintf(stderr, "  --threads N         physics and render threads (default: one per CPU)\n");
+    fprintf(stderr, "  --radius R          maximum particle radius (default 0.1)\n");
+    fprintf(stderr, "  --velocity V        spread of the starting velocities (default 2)\n");
+    fprintf(stderr, "  --dt T              timestep in seconds (default 0.016)\n");
+    fprintf(stderr, "  --gravity G         gravity per step (default 0, the window's 'g' uses 0.1)\n");
+    fprintf(stderr, "  --reorder N         sort the particles in Morton order every N steps (default 100, 0 never)\n");
+    fprintf(stderr, "  --nbody G           pull the particles toward each other with strength G\n");
+    fprintf(stderr, "  --theta T           Barnes-Hut opening angle (default 0.5, 0 is exact)\n");
+    fprintf(stderr, "  --camera X Y Z      camera position (default 0 0 -3)\n");
+    fprintf(stderr, "  --look PITCH YAW    camera rotation in radians (default 0 0)\n");
+    fprintf(stderr, "  --load FILE         start from a checkpoint, with its camera and light\n");
+}
+
+int main(int argc, char* args[]) {
+    OfflineOptions options = {10000, 300, 1, 1, defaultThreadCount(), 2, 1280, 720, 0.1f, 2.0f, 0.016f, NULL, NULL};
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(args[i], "--out") == 0 && hasValue) {
+            options.output = args[++i];
+        } else if (strcmp(args[i], "--frames") == 0 && hasValue) {
+            options.frames = atoi(args[++i]);
+        } else if (strcmp(args[i], "--steps-per-frame") == 0 && hasValue) {
+            options.stepsPerFrame = atoi(args[++i]);
+        } else if (strcmp(args[i], "--width") == 0 && hasValue) {
+            options.width = atoi(args[++i]);
+        } else if (strcmp(args[i], "--height") == 0 && hasValue) {
+            options.height = atoi(args[++i]);
+        } else if (strcmp(args[i], "--writers") == 0 && hasValue) {
+            options.writers = atoi(args[++i]);
+        } else if (strcmp(args[i], "--particles") == 0 && hasValue) {
+            options.numParticles = atoi(args[++i]);
+        } else if (strcmp(args[i], "--seed") == 0 && hasValue) {
+            options.seed = (unsigned int)strtoul(args[++i], NULL, 10);
+        } else if (strcmp(args[i], "--threads") == 0 && hasValue) {
+            options.numThreads = atoi(args[++i]);
+        } else if (strcmp(args[i], "--radius") == 0 && hasValue) {
+            options.maxRadius = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--velocity") == 0 && hasValue) {
+            options.velocity = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--dt") == 0 && hasValue) {
+            options.deltaTime = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--gravity") == 0 && hasValue) {
+            scene.gravity = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--reorder") == 0 && hasValue) {
+            reorderInterval = atoi(args[++i]);
+        } else if (strcmp(args[i], "--nbody") == 0 && hasValue) {
+            nbodyStrength = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--theta") == 0 && hasValue) {
+            openingAngle = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--camera") == 0 && i + 3 < argc) {
+            scene.camera.position.x = strtof(args[++i], NULL);
+            scene.camera.position.y = strtof(args[++i], NULL);
+            scene.camera.position.z = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--look") == 0 && i + 2 < argc) {
+            scene.camera.pitch = strtof(args[++i], NULL);
+            scene.camera.yaw = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--load") == 0 && hasValue) {
+            options.loadPath = args[++i];
+        } else {
+            printUsage(args[0]);
+            return 1;
+        }
+    }
+    if (options.output == NULL || options.numParticles < 1 || options.frames < 1 || options.stepsPerFrame < 1 ||
+        options.width < 1 || options.height < 1) {
+        printUsage(args[0]);
+        return 1;
+    }
+    SCREEN_WIDTH = options.width;
+    SCREEN_HEIGHT = options.height;
+
+    ParticleStore store;
+    if (initParticleStore(&store, options.numParticles) != 0) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+    int result = runOffline(&store, &options);
+
+    stopThreadPool();
+    freeMorton();
+    freePhysics();
+    freeRaster();
+    freeSphereSprites();
+    freeParticleStore(&store);
+    return result;
+}
@@ -0,0 +1,296 @@
+// particle.c
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "particle.h"
+#include "rng.h"
+#include "threadpool.h"
+
+// Particles spawned since seedParticles, and the seed their states come from
+static uint64_t spawnSeed = 1;
+static uint64_t spawnNumber = 0;
+
+// Particles each thread pool task creates
+#define SPAWN_GRAIN 4096
+
+// Function to allocate one zeroed, aligned particle array
+static void* allocParticleArray(int capacity, size_t elementSize) {
+    void* array = aligned_alloc(PARTICLE_ALIGNMENT, capacity * elementSize);
+    if (array != NULL) {
+        memset(array, 0, capacity * elementSize);
+    }
+    return array;
+}
+
+// Function to allocate storage for 'capacity' particles. The capacity is
+// rounded up to a whole number of blocks so vector loops can run past
+// 'count' without reading out of bounds. Returns 0 on success, -1 on failure.
+int initParticleStore(ParticleStore* store, int capacity) {
+    capacity = (capacity + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK * PARTICLE_BLOCK;
+    if (capacity == 0) capacity = PARTICLE_BLOCK;
+
+    store->px = allocParticleArray(capacity, sizeof(float));
+    store->py = allocParticleArray(capacity, sizeof(float));
+    store->pz = allocParticleArray(capacity, sizeof(float));
+    store->vx = allocParticleArray(capacity, sizeof(float));
+    store->vy = allocParticleArray(capacity, sizeof(float));
+    store->vz = allocParticleArray(capacity, sizeof(float));
+    store->radius = allocParticleArray(capacity, sizeof(float));
+    store->color = allocParticleArray(capacity, sizeof(uint32_t));
+    store->restSteps = allocParticleArray(capacity, sizeof(int));
+    store->island = allocParticleArray(capacity, sizeof(int));
+    store->id = allocParticleArray(capacity, sizeof(int));
+    store->slotOfId = allocParticleArray(capacity, sizeof(int));
+    store->freeIds = allocParticleArray(capacity, sizeof(int));
+    store->freeIdCount = 0;
+    store->idCount = 0;
+    store->count = 0;
+    store->capacity = capacity;
+
+    if (!store->px || !store->py || !store->pz || !store->vx || !store->vy ||
+        !store->vz || !store->radius || !store->color || !store->restSteps || !store->island || !store->id || !store->slotOfId || !store->freeIds) {
+        freeParticleStore(store);
+        return -1;
+    }
+    return 0;
+}
+
+void freeParticleStore(ParticleStore* store) {
+    free(store->px);
+    free(store->py);
+    free(store->pz);
+    free(store->vx);
+    free(store->vy);
+    free(store->vz);
+    free(store->radius);
+    free(store->color);
+    free(store->restSteps);
+    free(store->island);
+    free(store->id);
+    free(store->slotOfId);
+    free(store->freeIds);
+    memset(store, 0, sizeof(*store));
+}
+
+#define PARTICLE_FIELDS 13
+
+// Function to make room for at least 'capacity' particles. The arrays are
+// moved to new, larger allocations, so pointers into them go stale but every
+// index and id stays valid. Returns 0 on success, -1 on failure, in which
+// case the store is unchanged.
+int reserveParticles(ParticleStore* store, int capacity) {
+    if (capacity <= store->capacity) return 0;
+
+    int grown = store->capacity * 2 > capacity ? store->capacity * 2 : capacity;
+    grown = (grown + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK * PARTICLE_CHUNK;
+
+    void** fields[PARTICLE_FIELDS] = {
+        (void**)&store->px, (void**)&store->py, (void**)&store->pz,
+        (void**)&store->vx, (void**)&store->vy, (void**)&store->vz,
+        (void**)&store->radius, (void**)&store->color, (void**)&store->restSteps,
+        (void**)&store->island, (void**)&store->id, (void**)&store->slotOfId, (void**)&store->freeIds
+    };
+    const size_t sizes[PARTICLE_FIELDS] = {
+        sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(float),
+        sizeof(float), sizeof(uint32_t), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int)
+    };
+    const int lengths[PARTICLE_FIELDS] = {
+        store->count, store->count, store->count, store->count, store->count, store->count,
+        store->count, store->count, store->count, store->count, store->count, store->idCount, store->freeIdCount
+    };
+
+    // Allocate everything before touching the store so a failure leaves it intact
+    void* arrays[PARTICLE_FIELDS];
+    for (int f = 0; f < PARTICLE_FIELDS; f++) {
+        arrays[f] = allocParticleArray(grown, sizes[f]);
+        if (arrays[f] == NULL) {
+            while (f-- > 0) free(arrays[f]);
+            return -1;
+        }
+    }
+    for (int f = 0; f < PARTICLE_FIELDS; f++) {
+        memcpy(arrays[f], *fields[f], lengths[f] * sizes[f]);
+        free(*fields[f]);
+        *fields[f] = arrays[f];
+    }
+    store->capacity = grown;
+    return 0;
+}
+
+// Function to take a slot at the end and give it an id, reusing the most
+// recently freed one if there is any. New particles start awake.
+static void claimSlot(ParticleStore* store) {
+    int slot = store->count++;
+    int id = store->freeIdCount > 0 ? store->freeIds[--store->freeIdCount] : store->idCount++;
+    store->id[slot] = id;
+    store->slotOfId[id] = slot;
+    store->restSteps[slot] = 0;
+    store->island[slot] = -1;
+}
+
+// Function to reserve the next particle slot, growing the store if it is
+// full. Returns its index, or -1 if memory ran out.
+int addParticle(ParticleStore* store) {
+    if (reserveParticles(store, store->count + 1) != 0) {
+        return -1;
+    }
+    claimSlot(store);
+    return store->count - 1;
+}
+
+// Function to reserve 'count' slots at once, growing the store at most once.
+// Returns the index of the first; the new particles are [first, first + count).
+// Returns -1 if memory ran out.
+int addParticles(ParticleStore* store, int count) {
+    if (count < 0 || reserveParticles(store, store->count + count) != 0) {
+        return -1;
+    }
+    int first = store->count;
+    for (int n = 0; n < count; n++) {
+        claimSlot(store);
+    }
+    return first;
+}
+
+// Function to remove the particle at 'index' in constant time. The last
+// particle is moved into its slot, so that particle's index changes; its id
+// does not.
+void removeParticle(ParticleStore* store, int index) {
+    int last = store->count - 1;
+    int removedId = store->id[index];
+
+    if (index != last) {
+        store->px[index] = store->px[last];
+        store->py[index] = store->py[last];
+        store->pz[index] = store->pz[last];
+        store->vx[index] = store->vx[last];
+        store->vy[index] = store->vy[last];
+        store->vz[index] = store->vz[last];
+        store->radius[index] = store->radius[last];
+        store->color[index] = store->color[last];
+        store->restSteps[index] = store->restSteps[last];
+        store->island[index] = store->island[last];
+        store->id[index] = store->id[last];
+        store->slotOfId[store->id[index]] = index;
+    }
+    store->slotOfId[removedId] = -1;
+    store->freeIds[store->freeIdCount++] = removedId;
+    store->count--;
+}
+
+typedef struct {
+    const uint32_t* source;
+    const int* order;
+    uint32_t* target;
+} GatherContext;
+
+static void gatherTask(void* context, int begin, int end, int worker) {
+    const GatherContext* gather = context;
+    for (int k = begin; k < end; k++) {
+        gather->target[k] = gather->source[gather->order[k]];
+    }
+}
+
+// Function to put the particles in a new order: the particle at index
+// order[k] moves to index k. Ids move with their particles, so only indices
+// change. 'scratch' must have room for 'count' 32-bit values.
+void permuteParticles(ParticleStore* store, const int* order, uint32_t* scratch) {
+    // Every per-particle field is 32 bits wide
+    uint32_t* fields[] = {
+        (uint32_t*)store->px, (uint32_t*)store->py, (uint32_t*)store->pz,
+        (uint32_t*)store->vx, (uint32_t*)store->vy, (uint32_t*)store->vz,
+        (uint32_t*)store->radius, store->color, (uint32_t*)store->restSteps,
+        (uint32_t*)store->island, (uint32_t*)store->id
+    };
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        GatherContext gather = {fields[f], order, scratch};
+        parallelFor(store->count, SPAWN_GRAIN, gatherTask, &gather);
+        memcpy(fields[f], scratch, store->count * sizeof(uint32_t));
+    }
+    for (int i = 0; i < store->count; i++) {
+        store->slotOfId[store->id[i]] = i;
+    }
+}
+
+// Function to remove every particle and forget every id, keeping the memory
+void clearParticles(ParticleStore* store) {
+    store->count = 0;
+    store->idCount = 0;
+    store->freeIdCount = 0;
+}
+
+// Function to look up the current index of a particle by id. Returns -1 if
+// no live particle has that id.
+int findParticle(const ParticleStore* store, int id) {
+    if (id < 0 || id >= store->idCount) return -1;
+    return store->slotOfId[id];
+}
+
+// Function to wake particles [begin, end) and forget how long they have been
+// slow
+void wakeParticles(ParticleStore* store, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        store->restSteps[i] = 0;
+        store->island[i] = -1;
+    }
+}
+
+Vec3D getParticlePosition(const ParticleStore* store, int index) {
+    Vec3D position = {store->px[index], store->py[index], store->pz[index]};
+    return position;
+}
+
+Vec3D getParticleVelocity(const ParticleStore* store, int index) {
+    Vec3D velocity = {store->vx[index], store->vy[index], store->vz[index]};
+    return velocity;
+}
+
+// Function to place a particle at a random point in the cube with a random
+// velocity of up to 'velocity' / 2 per axis, a radius below 'maxRadius' and a
+// random opaque color. The state only depends on 'seed' and 'number', so the
+// same particle comes out whichever thread creates it and in whatever order.
+void createParticle(ParticleStore* store, int index, uint64_t seed, uint64_t number, float velocity, float maxRadius) {
+    uint64_t counter = number * PARTICLE_DRAWS;
+    store->px[index] = randomUnit(seed, counter) - 0.5f;
+    store->py[index] = randomUnit(seed, counter + 1) - 0.5f;
+    store->pz[index] = randomUnit(seed, counter + 2) - 0.5f;
+    store->vx[index] = (randomUnit(seed, counter + 3) - 0.5f) * velocity;
+    store->vy[index] = (randomUnit(seed, counter + 4) - 0.5f) * velocity;
+    store->vz[index] = (randomUnit(seed, counter + 5) - 0.5f) * velocity;
+    store->radius[index] = randomUnit(seed, counter + 6) * maxRadius;
+    store->color[index] = (0xFFu << 24) | (uint32_t)(randomBits(seed, counter + 7) >> 40);
+}
+
+// Function to restart the spawn sequence: the n-th particle spawned after
+// this is always the same for a given seed
+void seedParticles(uint64_t seed) {
+    spawnSeed = seed;
+    spawnNumber = 0;
+}
+
+typedef struct {
+    ParticleStore* store;
+    int first;
+    uint64_t firstNumber;
+    float velocity;
+    float maxRadius;
+} SpawnContext;
+
+static void spawnTask(void* context, int begin, int end, int worker) {
+    SpawnContext* spawn = context;
+    for (int i = begin; i < end; i++) {
+        createParticle(spawn->store, spawn->first + i, spawnSeed, spawn->firstNumber + i, spawn->velocity, spawn->maxRadius);
+    }
+}
+
+// Function to add 'count' random particles in one go, created in parallel on
+// the thread pool. Returns the index of the first, or -1 if memory ran out.
+int spawnParticles(ParticleStore* store, int count, float velocity, float maxRadius) {
+    int first = addParticles(store, count);
+    if (first < 0) return -1;
+    SpawnContext spawn = {store, first, spawnNumber, velocity, maxRadius};
+    parallelFor(count, SPAWN_GRAIN, spawnTask, &spawn);
+    spawnNumber += count;
+    return first;
+}
@@ -0,0 +1,60 @@
+// particle.h
+
+#ifndef PARTICLE_H
+#define PARTICLE_H
+
+#include <stdint.h>
+#include "vector.h"
+
+// Random draws each particle's initial state takes
+#define PARTICLE_DRAWS 8
+
+// Alignment and padding of every particle array, enough for 256-bit loads
+#define PARTICLE_ALIGNMENT 64
+#define PARTICLE_BLOCK 16
+// The store grows to at least twice its size, in whole chunks of this many
+#define PARTICLE_CHUNK 4096
+
+// Structure-of-arrays particle storage. Each field lives in its own aligned
+// array so the hot loops only stream the fields they touch. Particles are
+// addressed by index; indices [0, count) are live and always packed, so
+// removing a particle moves the last one into its slot. Each particle also
+// has an id that never changes while it lives; ids of removed particles are
+// kept on a free list and handed out again.
+typedef struct {
+    float* px;
+    float* py;
+    float* pz;
+    float* vx;
+    float* vy;
+    float* vz;
+    float* radius;
+    uint32_t* color;
+    int* restSteps;   // Steps in a row the particle has been slow enough to sleep
+    int* island;      // Island a sleeping particle belongs to, -1 while awake
+    int* id;          // Stable id of the particle in each slot
+    int* slotOfId;    // Current slot of each id, -1 if the id is free
+    int* freeIds;     // Stack of ids available for reuse
+    int freeIdCount;
+    int idCount;      // Ids handed out so far; all are below this
+    int count;
+    int capacity;
+} ParticleStore;
+
+int initParticleStore(ParticleStore* store, int capacity);
+void freeParticleStore(ParticleStore* store);
+int reserveParticles(ParticleStore* store, int capacity);
+int addParticle(ParticleStore* store);
+int addParticles(ParticleStore* store, int count);
+void removeParticle(ParticleStore* store, int index);
+void permuteParticles(ParticleStore* store, const int* order, uint32_t* scratch);
+void clearParticles(ParticleStore* store);
+int findParticle(const ParticleStore* store, int id);
+void wakeParticles(ParticleStore* store, int begin, int end);
+Vec3D getParticlePosition(const ParticleStore* store, int index);
+Vec3D getParticleVelocity(const ParticleStore* store, int index);
+void createParticle(ParticleStore* store, int index, uint64_t seed, uint64_t number, float velocity, float maxRadius);
+void seedParticles(uint64_t seed);
+int spawnParticles(ParticleStore* store, int count, float velocity, float maxRadius);
+
+#endif // PARTICLE_H
@@ -0,0 +1,742 @@
+// physics.c
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "physics.h"
+#include "grid.h"
+#include "integrate.h"
+#include "nbody.h"
+#include "sleep.h"
+#include "threadpool.h"
+#include "timer.h"
+
+float gravity = 0.0f;
+BroadPhaseMode broadPhaseMode = BROADPHASE_GRID;
+// Let settled particles sleep; only the grid broad phase supports it
+bool sleepEnabled = true;
+// Sweep pairs that passed through each other during a step; only the grid
+// broad phase supports it
+bool continuousCollisions = false;
+PhysicsStats physicsStats;
+
+static SpatialGrid grid;
+static bool gridInitialized = false;
+// Gravity the sleeping particles fell asleep under
+static float sleepGravity = 0.0f;
+
+// Positions at the start of the step, for the swept test
+static float* startX;
+static float* startY;
+static float* startZ;
+// Time of each particle's last swept impact in the step, as a fraction of
+// it. Its path before then was rewound from that impact and never happened.
+static float* impactTime;
+// Set on the particles that moved further in the step than the grid sees
+static bool* movedFar;
+// Which fast particle last tested each particle, so one found near several
+// points of the same path is only tested once
+static unsigned int* testedStamp;
+static unsigned int stamp = 0;
+static int* fastParticles;
+static int startCapacity;
+
+// Points along the paths of the fast particles, bucketed by grid cell like
+// the grid's own particles: the cell of each point in path order, the owners
+// of the points sorted by cell, and pathCellStart[cellCount + 1] offsets
+static int* pathCells;
+static int* pathParticles;
+static int pathPointCapacity;
+static int* pathCellStart;
+static int pathCellCapacity;
+
+// Set while a step's collision passes run with start positions saved
+static bool sweeping = false;
+static float sweepDeltaTime;
+// Twice the furthest a particle left to the grid moved during the step
+static float sweepReach;
+// Square of twice sweepReach while sweeping, 0 otherwise
+static float sweepLimitSquared = 0.0f;
+// Set during sweepFastParticles, whose pairs have already had the overlap
+// test in the grid if they overlap at all
+static bool sweepsOnly = false;
+
+// Function to catch a pair that met during the step but is apart again at
+// its end, having passed through each other. Both particles are taken to move
+// in a straight line from their start position; at the time of impact their
+// velocities are exchanged along the normal, as in handleParticleCollision,
+// and they move on for the rest of the step. Returns true if they met.
+static bool sweepParticleCollision(ParticleStore* store, int i, int j, float radiusSum) {
+    if (radiusSum <= 0.0f) return false;
+
+    // Solve |s + d t| = radiusSum for the offset s between the start positions
+    // and the change d in that offset over the step
+    float sx = startX[j] - startX[i];
+    float sy = startY[j] - startY[i];
+    float sz = startZ[j] - startZ[i];
+    float dx = store->px[j] - store->px[i] - sx;
+    float dy = store->py[j] - store->py[i] - sy;
+    float dz = store->pz[j] - store->pz[i] - sz;
+    float a = dx * dx + dy * dy + dz * dz;
+    float halfB = sx * dx + sy * dy + sz * dz;
+    float c = sx * sx + sy * sy + sz * sz - radiusSum * radiusSum;
+    // Touching at the start is the overlap test's job, and that includes a
+    // pair it left exactly touching last step; moving apart never meets
+    if (c <= 1e-4f * radiusSum * radiusSum || halfB >= 0.0f) return false;
+    float discriminant = halfB * halfB - a * c;
+    if (discriminant < 0.0f) return false;
+    float t = (-halfB - sqrtf(discriminant)) / a;
+    if (t > 1.0f || t < impactTime[i] || t < impactTime[j]) return false;
+
+    float ix = startX[i] + (store->px[i] - startX[i]) * t;
+    float iy = startY[i] + (store->py[i] - startY[i]) * t;
+    float iz = startZ[i] + (store->pz[i] - startZ[i]) * t;
+    float jx = startX[j] + (store->px[j] - startX[j]) * t;
+    float jy = startY[j] + (store->py[j] - startY[j]) * t;
+    float jz = startZ[j] + (store->pz[j] - startZ[j]) * t;
+    float nx = (jx - ix) / radiusSum;
+    float ny = (jy - iy) / radiusSum;
+    float nz = (jz - iz) / radiusSum;
+
+    float normalI = store->vx[i] * nx + store->vy[i] * ny + store->vz[i] * nz;
+    float normalJ = store->vx[j] * nx + store->vy[j] * ny + store->vz[j] * nz;
+    float exchange = normalJ - normalI;
+    // Already moving apart: the pair was resolved earlier in the step
+    if (exchange >= 0.0f) return false;
+    store->vx[i] += exchange * nx;
+    store->vy[i] += exchange * ny;
+    store->vz[i] += exchange * nz;
+    store->vx[j] -= exchange * nx;
+    store->vy[j] -= exchange * ny;
+    store->vz[j] -= exchange * nz;
+
+    // Move on from the impact, and restart both paths so that later tests in
+    // this step see them pass through the impact at time t
+    float remaining = (1.0f - t) * sweepDeltaTime;
+    float elapsed = t * sweepDeltaTime;
+    store->px[i] = ix + store->vx[i] * remaining;
+    store->py[i] = iy + store->vy[i] * remaining;
+    store->pz[i] = iz + store->vz[i] * remaining;
+    store->px[j] = jx + store->vx[j] * remaining;
+    store->py[j] = jy + store->vy[j] * remaining;
+    store->pz[j] = jz + store->vz[j] * remaining;
+    startX[i] = ix - store->vx[i] * elapsed;
+    startY[i] = iy - store->vy[i] * elapsed;
+    startZ[i] = iz - store->vz[i] * elapsed;
+    startX[j] = jx - store->vx[j] * elapsed;
+    startY[j] = jy - store->vy[j] * elapsed;
+    startZ[j] = jz - store->vz[j] * elapsed;
+    impactTime[i] = t;
+    impactTime[j] = t;
+    return true;
+}
+
+// Function to resolve a pair that overlaps at the end of the step. While
+// updateParticles sweeps, a pair that doesn't is also swept, in case the two
+// passed through each other.
+bool handleParticleCollision(ParticleStore* store, int i, int j) {
+    // Calculate the vector between the centers of the two particles
+    Vec3D collisionDirection = {
+        store->px[j] - store->px[i],
+        store->py[j] - store->py[i],
+        store->pz[j] - store->pz[i]
+    };
+    // Calculate the distance squared between the two particles
+    float distanceSquared =
+        collisionDirection.x * collisionDirection.x +
+        collisionDirection.y * collisionDirection.y +
+        collisionDirection.z * collisionDirection.z;
+    // Calculate the sum of the radii squared
+    float radiusSum = store->radius[i] + store->radius[j];
+    float radiusSumSquared = radiusSum * radiusSum;
+    // Check if the distance is less than the sum of the radii
+    if (distanceSquared <= radiusSumSquared) {
+        if (sweepsOnly) return false;
+        // Normalize the collision direction
+        float distance = sqrtf(distanceSquared);
+        Vec3D normalizedCollisionDirection = {
+            collisionDirection.x / distance,
+            collisionDirection.y / distance,
+            collisionDirection.z / distance
+        };
+        // Calculate overlap and separate the particles
+        float overlap = radiusSum - distance;
+        store->px[i] -= normalizedCollisionDirection.x * overlap * 0.5f;
+        store->py[i] -= normalizedCollisionDirection.y * overlap * 0.5f;
+        store->pz[i] -= normalizedCollisionDirection.z * overlap * 0.5f;
+        store->px[j] += normalizedCollisionDirection.x * overlap * 0.5f;
+        store->py[j] += normalizedCollisionDirection.y * overlap * 0.5f;
+        store->pz[j] += normalizedCollisionDirection.z * overlap * 0.5f;
+        if (sweeping) {
+            // Being pushed apart is not motion the swept test should see
+            startX[i] -= normalizedCollisionDirection.x * overlap * 0.5f;
+            startY[i] -= normalizedCollisionDirection.y * overlap * 0.5f;
+            startZ[i] -= normalizedCollisionDirection.z * overlap * 0.5f;
+            startX[j] += normalizedCollisionDirection.x * overlap * 0.5f;
+            startY[j] += normalizedCollisionDirection.y * overlap * 0.5f;
+            startZ[j] += normalizedCollisionDirection.z * overlap * 0.5f;
+        }
+        // Project velocities onto the collision direction
+        Vec3D v1 = getParticleVelocity(store, i);
+        Vec3D v2 = getParticleVelocity(store, j);
+        Vec3D w1 = orthogonalProjection(v1, normalizedCollisionDirection);
+        Vec3D w2 = orthogonalProjection(v2, normalizedCollisionDirection);
+        Vec3D u1 = subVector(v1, w1);
+        Vec3D u2 = subVector(v2, w2);
+        // Swap the velocities along the collision direction
+        store->vx[i] = u1.x + w2.x;
+        store->vy[i] = u1.y + w2.y;
+        store->vz[i] = u1.z + w2.z;
+        store->vx[j] = u2.x + w1.x;
+        store->vy[j] = u2.y + w1.y;
+        store->vz[j] = u2.z + w1.z;
+        return true;
+    }
+    // Only pairs that moved further relative to each other than they are
+    // across can pass through each other. Neither particle moved further
+    // than half of sweepReach, which bounds that and how far apart a pair
+    // that met can end up; sweepFastParticles lifts the bound for the pairs
+    // it tests. Most pairs are rejected by the first test, which never
+    // passes when not sweeping.
+    if (distanceSquared >= sweepLimitSquared || radiusSum >= sweepReach) return false;
+    float reach = radiusSum + sweepReach;
+    return distanceSquared <= reach * reach && sweepParticleCollision(store, i, j, radiusSum);
+}
+
+// Function to bounce a coordinate off a pair of walls at -0.5 and 0.5,
+// reflecting it back by however far it overshot like the integrate kernels
+static void bounceAxis(float* position, float* velocity) {
+    if (*position <= -0.5f) {
+        *position = -1.0f - *position;
+        *velocity *= -1.0f;
+    } else if (*position >= 0.5f) {
+        *position = 1.0f - *position;
+        *velocity *= -1.0f;
+    }
+    if (*position < -0.5f) {
+        *position = -0.5f;
+    } else if (*position > 0.5f) {
+        *position = 0.5f;
+    }
+}
+
+// Function to apply gravity and bounce a particle off the cube walls
+static void applyGravityAndWalls(ParticleStore* store, int i, float gravity) {
+    if (store->py[i] <= 0.5f) {
+        store->vy[i] += gravity;
+    }
+    // Check for collision with cube walls and bounce
+    bounceAxis(&store->px[i], &store->vx[i]);
+    bounceAxis(&store->py[i], &store->vy[i]);
+    bounceAxis(&store->pz[i], &store->vz[i]);
+}
+
+// Reference path: every particle is tested against every later particle.
+// It always takes one discrete step.
+static void updateParticlesBruteForce(ParticleStore* store, float deltaTime, float gravity) {
+    physicsStats.candidatePairs = (long long)store->count * (store->count - 1) / 2;
+    physicsStats.collisions = 0;
+    physicsStats.awakeParticles = store->count;
+    physicsStats.sleepingParticles = 0;
+    for (int i = 0; i < store->count; i++) {
+        // Update position based on velocity
+        store->px[i] += store->vx[i] * deltaTime;
+        store->py[i] += store->vy[i] * deltaTime;
+        store->pz[i] += store->vz[i] * deltaTime;
+        // Handle particle collisions
+        for (int j = i + 1; j < store->count; j++) {
+            physicsStats.collisions += handleParticleCollision(store, i, j);
+        }
+        applyGravityAndWalls(store, i, gravity);
+    }
+}
+
+// Per-step state shared with the worker tasks
+typedef struct {
+    ParticleStore* store;
+    float deltaTime;
+    float gravity;
+    int parity;
+    bool sleeping;     // Some particles may be asleep
+    bool watchPairs;   // Contacts are needed to put islands to sleep
+    long long candidatePairs[MAX_THREADS];
+    long long collisions[MAX_THREADS];
+    float maxRadius[MAX_THREADS];
+} StepContext;
+
+// Multiple of every vector width, so only the last chunk has a scalar tail
+#define PARTICLE_GRAIN 4096
+
+static void measureTask(void* context, int begin, int end, int worker) {
+    StepContext* step = context;
+    const ParticleStore* store = step->store;
+    float maxRadius = step->maxRadius[worker];
+    for (int i = begin; i < end; i++) {
+        if (store->radius[i] > maxRadius) maxRadius = store->radius[i];
+    }
+    step->maxRadius[worker] = maxRadius;
+}
+
+// Function to start the swept paths of particles [begin, end), which have
+// just been integrated, a step back along their new velocity. A particle
+// that bounced off a wall, or was pushed back in through one, then sweeps
+// the path it is on now rather than a chord through the wall.
+static void startPaths(const ParticleStore* store, int begin, int end, float deltaTime) {
+    for (int i = begin; i < end; i++) {
+        startX[i] = store->px[i] - store->vx[i] * deltaTime;
+        startY[i] = store->py[i] - store->vy[i] * deltaTime;
+        startZ[i] = store->pz[i] - store->vz[i] * deltaTime;
+    }
+}
+
+static void integrateTask(void* context, int begin, int end, int worker) {
+    StepContext* step = context;
+    ParticleStore* store = step->store;
+    if (sweeping) memset(impactTime + begin, 0, (size_t)(end - begin) * sizeof(float));
+    if (!step->sleeping) {
+        integrateParticles(store, begin, end, step->deltaTime, step->gravity);
+        if (sweeping) startPaths(store, begin, end, step->deltaTime);
+        return;
+    }
+    if (sweeping) {
+        size_t bytes = (size_t)(end - begin) * sizeof(float);
+        memcpy(startX + begin, store->px + begin, bytes);
+        memcpy(startY + begin, store->py + begin, bytes);
+        memcpy(startZ + begin, store->pz + begin, bytes);
+    }
+    // Integrate each run of awake particles; sleeping ones stay where they are
+    int i = begin;
+    while (i < end) {
+        while (i < end && store->island[i] >= 0) i++;
+        int run = i;
+        while (i < end && store->island[i] < 0) i++;
+        if (i > run) {
+            integrateParticles(store, run, i, step->deltaTime, step->gravity);
+            if (sweeping) startPaths(store, run, i, step->deltaTime);
+        }
+    }
+}
+
+static bool collidePair(ParticleStore* store, int i, int j, void* context) {
+    return handleParticleCollision(store, i, j);
+}
+
+static void assignCellsTask(void* context, int begin, int end, int worker) {
+    StepContext* step = context;
+    assignGridCells(&grid, step->store, begin, end);
+}
+
+// Each task index is one layer of the current parity
+static void collideLayersTask(void* context, int begin, int end, int worker) {
+    StepContext* step = context;
+    int hits = 0;
+    int pairs = 0;
+    for (int layer = begin; layer < end; layer++) {
+        if (step->watchPairs) {
+            pairs += forEachCandidatePairInLayer(&grid, step->store, 2 * layer + step->parity, collideSleeping,
+                                                 workerContacts(worker), &hits);
+        } else {
+            pairs += forEachCandidatePairInLayer(&grid, step->store, 2 * layer + step->parity, collidePair, NULL, &hits);
+        }
+    }
+    step->candidatePairs[worker] += pairs;
+    step->collisions[worker] += hits;
+}
+
+// Function to make room for the start positions and fast particle marks of
+// 'count' particles. Returns -1 if memory ran out.
+static int reserveStartPositions(int count) {
+    if (count <= startCapacity) return 0;
+    float* x = realloc(startX, (size_t)count * sizeof(float));
+    if (x != NULL) startX = x;
+    float* y = realloc(startY, (size_t)count * sizeof(float));
+    if (y != NULL) startY = y;
+    float* z = realloc(startZ, (size_t)count * sizeof(float));
+    if (z != NULL) startZ = z;
+    float* impacts = realloc(impactTime, (size_t)count * sizeof(float));
+    if (impacts != NULL) impactTime = impacts;
+    bool* moved = realloc(movedFar, (size_t)count * sizeof(bool));
+    if (moved != NULL) movedFar = moved;
+    unsigned int* tested = realloc(testedStamp, (size_t)count * sizeof(unsigned int));
+    if (tested != NULL) testedStamp = tested;
+    int* fast = realloc(fastParticles, (size_t)count * sizeof(int));
+    if (fast != NULL) fastParticles = fast;
+    if (x == NULL || y == NULL || z == NULL || impacts == NULL || moved == NULL || tested == NULL || fast == NULL) return -1;
+    memset(movedFar + startCapacity, 0, (size_t)(count - startCapacity) * sizeof(bool));
+    memset(testedStamp + startCapacity, 0, (size_t)(count - startCapacity) * sizeof(unsigned int));
+    startCapacity = count;
+    return 0;
+}
+
+static int reservePathPoints(int count, int cellCount) {
+    if (count > pathPointCapacity) {
+        int capacity = pathPointCapacity > 0 ? pathPointCapacity : 1024;
+        while (capacity < count) capacity *= 2;
+        int* cells = realloc(pathCells, (size_t)capacity * sizeof(int));
+        if (cells != NULL) pathCells = cells;
+        int* owners = realloc(pathParticles, (size_t)capacity * sizeof(int));
+        if (owners != NULL) pathParticles = owners;
+        if (cells == NULL || owners == NULL) return -1;
+        pathPointCapacity = capacity;
+    }
+    if (cellCount + 1 > pathCellCapacity) {
+        int* starts = realloc(pathCellStart, (size_t)(cellCount + 1) * sizeof(int));
+        if (starts == NULL) return -1;
+        pathCellStart = starts;
+        pathCellCapacity = cellCount + 1;
+    }
+    return 0;
+}
+
+// Function to choose the furthest a particle may move in a step and still be
+// left to the grid. Two particles that met during the step are at most
+// radiusSum plus both their moves apart at its end, and pairs less than a
+// cell apart are always tested. Only pairs smaller across than both moves
+// can pass through each other, so a quarter cell per move covers them all;
+// when the cells have room to spare over the largest particles, the moves
+// may use it.
+static float chooseSweepReach(int numParticles, float maxRadius) {
+    float cellSize = spatialGridCellSize(maxRadius, numParticles);
+    return fmaxf(0.25f * cellSize, 0.5f * (cellSize - 2.0f * maxRadius));
+}
+
+static float pathLengthSquared(const ParticleStore* store, int i) {
+    float dx = store->px[i] - startX[i];
+    float dy = store->py[i] - startY[i];
+    float dz = store->pz[i] - startZ[i];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// Function to return the cell of the point 'piece' pieces along the path of
+// particle i, out of 'pieces'
+static int pathCell(const ParticleStore* store, int i, int piece, int pieces) {
+    float t = (float)piece / pieces;
+    return spatialGridCellOf(&grid, startX[i] + (store->px[i] - startX[i]) * t,
+                             startY[i] + (store->py[i] - startY[i]) * t, startZ[i] + (store->pz[i] - startZ[i]) * t);
+}
+
+// Function to return how many pieces no longer than 'reach' the path of
+// particle i is cut into
+static int pathPieces(const ParticleStore* store, int i, float reach) {
+    return (int)ceilf(sqrtf(pathLengthSquared(store, i)) / reach);
+}
+
+// Function to record the points along the paths of the 'fastCount' fast
+// particles and bucket them by cell, as sortGridCells does
+static void bucketPathPoints(const ParticleStore* store, int fastCount, float reach) {
+    for (int c = 0; c <= grid.cellCount; c++) {
+        pathCellStart[c] = 0;
+    }
+    int p = 0;
+    for (int f = 0; f < fastCount; f++) {
+        int i = fastParticles[f];
+        int pieces = pathPieces(store, i, reach);
+        for (int piece = 0; piece <= pieces; piece++, p++) {
+            pathCells[p] = pathCell(store, i, piece, pieces);
+            pathCellStart[pathCells[p] + 1]++;
+        }
+    }
+    for (int c = 0; c < grid.cellCount; c++) {
+        pathCellStart[c + 1] += pathCellStart[c];
+    }
+    // Scatter using pathCellStart as a running cursor, then shift it back
+    p = 0;
+    for (int f = 0; f < fastCount; f++) {
+        int i = fastParticles[f];
+        int pieces = pathPieces(store, i, reach);
+        for (int piece = 0; piece <= pieces; piece++, p++) {
+            pathParticles[pathCellStart[pathCells[p]]++] = i;
+        }
+    }
+    for (int c = grid.cellCount; c > 0; c--) {
+        pathCellStart[c] = pathCellStart[c - 1];
+    }
+    pathCellStart[0] = 0;
+}
+
+// Function to test a pair with particle i from the fast pass. Runs on this
+// thread alone, so it can use the first worker's contacts.
+static bool collideFastPair(StepContext* step, int i, int j) {
+    if (step->watchPairs) return collideSleeping(step->store, i, j, workerContacts(0));
+    return handleParticleCollision(step->store, i, j);
+}
+
+// Function to sweep the particles that moved further this step than the grid
+// can see. The path of each is cut into pieces no longer than 'reach', and
+// around the points between the pieces it is swept against the slow
+// particles in the grid and against the points of other fast paths. Only the
+// fast particles pay for moving fast; everything else took one plain step.
+// Returns -1 if memory ran out, leaving the fast particles unswept.
+static int sweepFastParticles(StepContext* step, float reach, float maxRadius, long long* pairs, long long* hits) {
+    ParticleStore* store = step->store;
+    int fastCount = 0;
+    int pointCount = 0;
+    for (int i = 0; i < store->count; i++) {
+        float lengthSquared = pathLengthSquared(store, i);
+        if (lengthSquared <= reach * reach) continue;
+        fastParticles[fastCount++] = i;
+        movedFar[i] = true;
+        pointCount += pathPieces(store, i, reach) + 1;
+    }
+    physicsStats.fastParticles = fastCount;
+    if (fastCount == 0) return 0;
+
+    int result = -1;
+    if (reservePathPoints(pointCount, grid.cellCount) == 0) {
+        bucketPathPoints(store, fastCount, reach);
+
+        // At the impact this particle is within half a piece of one of its
+        // points and both radii of the other particle, which has moved at
+        // most 'reach' since, or is within half a piece of one of its own
+        int n = grid.cellsPerAxis;
+        int ring = (int)ceilf((1.5f * reach + 2.0f * maxRadius) / grid.cellSize);
+        // Every pair found here gets the swept test, and only that
+        sweepReach = INFINITY;
+        sweepLimitSquared = INFINITY;
+        sweepsOnly = true;
+        for (int f = 0; f < fastCount; f++) {
+            int i = fastParticles[f];
+            if (++stamp == 0) {
+                memset(testedStamp, 0, (size_t)startCapacity * sizeof(unsigned int));
+                stamp = 1;
+            }
+            int pieces = pathPieces(store, i, reach);
+            int lastCell = -1;
+            for (int piece = 0; piece <= pieces; piece++) {
+                // Points in the same cell see the same neighbourhood
+                int cell = pathCell(store, i, piece, pieces);
+                if (cell == lastCell) continue;
+                lastCell = cell;
+                int cx = cell % n, cy = cell / n % n, cz = cell / (n * n);
+                for (int z = cz > ring ? cz - ring : 0; z <= cz + ring && z < n; z++) {
+                    for (int y = cy > ring ? cy - ring : 0; y <= cy + ring && y < n; y++) {
+                        for (int x = cx > ring ? cx - ring : 0; x <= cx + ring && x < n; x++) {
+                            int c = (z * n + y) * n + x;
+                            for (int e = grid.cellStart[c]; e < grid.cellStart[c + 1]; e++) {
+                                int j = grid.cellParticles[e];
+                                if (j == i || movedFar[j] || testedStamp[j] == stamp) continue;
+                                testedStamp[j] = stamp;
+                                (*pairs)++;
+                                *hits += collideFastPair(step, i, j);
+                            }
+                            // Each pair of fast particles is tested from the lower index
+                            for (int e = pathCellStart[c]; e < pathCellStart[c + 1]; e++) {
+                                int j = pathParticles[e];
+                                if (j <= i || testedStamp[j] == stamp) continue;
+                                testedStamp[j] = stamp;
+                                (*pairs)++;
+                                *hits += collideFastPair(step, i, j);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        sweepsOnly = false;
+        result = 0;
+    }
+    for (int f = 0; f < fastCount; f++) {
+        movedFar[fastParticles[f]] = false;
+    }
+    return result;
+}
+
+// Function to advance the grid path by one step: integrate, bucket and
+// collide. Returns -1 if the grid could not be allocated.
+static int stepGrid(StepContext* step, float maxRadius) {
+    ParticleStore* store = step->store;
+
+    // Integrate and bounce everything first so the grid sees this step's positions
+    double start = secondsNow();
+    parallelFor(store->count, PARTICLE_GRAIN, integrateTask, step);
+    double integrated = secondsNow();
+    physicsStats.integrateSeconds += integrated - start;
+
+    if (prepareSpatialGridForRadius(&grid, store->count, maxRadius) != 0) return -1;
+    parallelFor(store->count, PARTICLE_GRAIN, assignCellsTask, step);
+    sortGridCells(&grid, store->count);
+    double bucketed = secondsNow();
+    physicsStats.broadPhaseSeconds += bucketed - integrated;
+
+    // Layers of one parity never share particles, so each pass runs them in
+    // parallel. The result does not depend on the number of threads.
+    for (step->parity = 0; step->parity < 2; step->parity++) {
+        int layers = (grid.cellsPerAxis - step->parity + 1) / 2;
+        parallelFor(layers, 1, collideLayersTask, step);
+    }
+    physicsStats.collisionSeconds += secondsNow() - bucketed;
+    return 0;
+}
+
+void updateParticles(ParticleStore* store, float deltaTime) {
+    // Particles asleep under a different gravity, or with sleeping turned
+    // off, have nothing holding them still any more. Under each other's pull
+    // nothing stays still.
+    bool canSleep = sleepEnabled && broadPhaseMode == BROADPHASE_GRID && nbodyStrength == 0.0f;
+    if (physicsStats.sleepingParticles > 0 && (!canSleep || gravity != sleepGravity)) {
+        wakeAllParticles(store);
+        physicsStats.sleepingParticles = 0;
+    }
+    sleepGravity = gravity;
+    physicsStats.fastParticles = 0;
+    physicsStats.forceSeconds = 0.0;
+    physicsStats.integrateSeconds = 0.0;
+    physicsStats.broadPhaseSeconds = 0.0;
+    physicsStats.collisionSeconds = 0.0;
+
+    if (nbodyStrength > 0.0f) {
+        double start = secondsNow();
+        if (applyNBodyForces(store, deltaTime) != 0) {
+            fprintf(stderr, "N-body octree allocation failed, turning mutual gravity off\n");
+            nbodyStrength = 0.0f;
+        }
+        physicsStats.forceSeconds = secondsNow() - start;
+    }
+
+    if (broadPhaseMode == BROADPHASE_BRUTE_FORCE) {
+        // Integration and collisions are interleaved, so it all counts as collisions
+        double start = secondsNow();
+        updateParticlesBruteForce(store, deltaTime, gravity);
+        physicsStats.collisionSeconds = secondsNow() - start;
+        return;
+    }
+    if (!gridInitialized) {
+        initSpatialGrid(&grid);
+        gridInitialized = true;
+    }
+    StepContext step = {.store = store, .deltaTime = deltaTime, .gravity = gravity,
+                        .sleeping = physicsStats.sleepingParticles > 0,
+                        .watchPairs = sleepEnabled && sleepWatchesPairs()};
+    if (sleepEnabled) beginSleepStep(gravity);
+
+    double start = secondsNow();
+    parallelFor(store->count, PARTICLE_GRAIN, measureTask, &step);
+    float maxRadius = 0.0f;
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        maxRadius = fmaxf(maxRadius, step.maxRadius[worker]);
+    }
+
+    float reach = 0.0f;
+    if (continuousCollisions && reserveStartPositions(store->count) == 0) {
+        reach = chooseSweepReach(store->count, maxRadius);
+        sweeping = true;
+        sweepDeltaTime = deltaTime;
+        sweepReach = 2.0f * reach;
+        sweepLimitSquared = 4.0f * sweepReach * sweepReach;
+    }
+    physicsStats.integrateSeconds = secondsNow() - start;
+
+    if (stepGrid(&step, maxRadius) != 0) {
+        fprintf(stderr, "Spatial grid allocation failed, falling back to brute force\n");
+        sweeping = false;
+        sweepLimitSquared = 0.0f;
+        broadPhaseMode = BROADPHASE_BRUTE_FORCE;
+        wakeAllParticles(store);
+        physicsStats.awakeParticles = store->count;
+        physicsStats.sleepingParticles = 0;
+        physicsStats.candidatePairs = (long long)store->count * (store->count - 1) / 2;
+        physicsStats.collisions = 0;
+        for (int i = 0; i < store->count; i++) {
+            for (int j = i + 1; j < store->count; j++) {
+                physicsStats.collisions += handleParticleCollision(store, i, j);
+            }
+        }
+        return;
+    }
+
+    physicsStats.candidatePairs = 0;
+    physicsStats.collisions = 0;
+    if (sweeping) {
+        start = secondsNow();
+        if (sweepFastParticles(&step, reach, maxRadius, &physicsStats.candidatePairs, &physicsStats.collisions) != 0) {
+            fprintf(stderr, "Fast particle sweep allocation failed, they took a plain step\n");
+        }
+        physicsStats.collisionSeconds += secondsNow() - start;
+    }
+    sweeping = false;
+    sweepLimitSquared = 0.0f;
+
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        physicsStats.candidatePairs += step.candidatePairs[worker];
+        physicsStats.collisions += step.collisions[worker];
+    }
+    if (sleepEnabled) {
+        start = secondsNow();
+        updateSleep(store, &physicsStats.awakeParticles, &physicsStats.sleepingParticles);
+        physicsStats.integrateSeconds += secondsNow() - start;
+    } else {
+        physicsStats.awakeParticles = store->count;
+        physicsStats.sleepingParticles = 0;
+    }
+}
+
+static bool particlesOverlap(const ParticleStore* store, int i, int j) {
+    float dx = store->px[j] - store->px[i];
+    float dy = store->py[j] - store->py[i];
+    float dz = store->pz[j] - store->pz[i];
+    float radiusSum = store->radius[i] + store->radius[j];
+    return dx * dx + dy * dy + dz * dz <= radiusSum * radiusSum;
+}
+
+static bool countOverlap(ParticleStore* store, int i, int j, void* context) {
+    return particlesOverlap(store, i, j);
+}
+
+// Function to check the grid against the all-pairs scan on the current
+// positions. Returns the number of overlapping pairs the grid missed (0 when
+// the broad phase is correct), or -1 if the grid could not be built.
+int validateBroadPhase(const ParticleStore* store) {
+    int bruteForcePairs = 0;
+    for (int i = 0; i < store->count; i++) {
+        for (int j = i + 1; j < store->count; j++) {
+            if (particlesOverlap(store, i, j)) bruteForcePairs++;
+        }
+    }
+
+    SpatialGrid check;
+    initSpatialGrid(&check);
+    if (buildSpatialGrid(&check, store) != 0) {
+        freeSpatialGrid(&check);
+        return -1;
+    }
+    int overlappingPairs = 0;
+    // The pair callback only reads, so the const cast is safe here
+    forEachCandidatePair(&check, (ParticleStore*)store, countOverlap, NULL, &overlappingPairs);
+    freeSpatialGrid(&check);
+
+    return bruteForcePairs - overlappingPairs;
+}
+
+void freePhysics(void) {
+    if (gridInitialized) {
+        freeSpatialGrid(&grid);
+        gridInitialized = false;
+    }
+    freeSleep();
+    freeNBody();
+    free(startX);
+    free(startY);
+    free(startZ);
+    free(impactTime);
+    free(movedFar);
+    free(testedStamp);
+    free(fastParticles);
+    free(pathCells);
+    free(pathParticles);
+    free(pathCellStart);
+    startX = NULL;
+    startY = NULL;
+    startZ = NULL;
+    impactTime = NULL;
+    movedFar = NULL;
+    testedStamp = NULL;
+    fastParticles = NULL;
+    pathCells = NULL;
+    pathParticles = NULL;
+    pathCellStart = NULL;
+    startCapacity = 0;
+    pathPointCapacity = 0;
+    pathCellCapacity = 0;
+}
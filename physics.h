@@ -0,0 +1,38 @@
+// physics.h
+
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include <stdbool.h>
+#include "particle.h"
+
+typedef enum {
+    BROADPHASE_GRID,        // Uniform grid, only neighbouring cells are tested
+    BROADPHASE_BRUTE_FORCE  // Original all-pairs loop, kept as a reference
+} BroadPhaseMode;
+
+// Counters for the most recent call to updateParticles
+typedef struct {
+    long long candidatePairs;  // Pairs handed to handleParticleCollision
+    long long collisions;      // Pairs that were actually touching or met during the step
+    int fastParticles;         // Moved too far for the grid and were swept along their paths
+    int awakeParticles;
+    int sleepingParticles;     // Skipped by the step until something wakes them
+    double forceSeconds;       // Time spent in each phase of the step
+    double integrateSeconds;
+    double broadPhaseSeconds;
+    double collisionSeconds;
+} PhysicsStats;
+
+extern float gravity;
+extern BroadPhaseMode broadPhaseMode;
+extern bool sleepEnabled;
+extern bool continuousCollisions;
+extern PhysicsStats physicsStats;
+
+bool handleParticleCollision(ParticleStore* store, int i, int j);
+void updateParticles(ParticleStore* store, float deltaTime);
+int validateBroadPhase(const ParticleStore* store);
+void freePhysics(void);
+
+#endif // PHYSICS_H
@@ -0,0 +1,104 @@
+// profiler.c
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profiler.h"
+#include "timer.h"
+
+// Samples kept per phase; older ones are overwritten
+#define PROFILE_WINDOW 256
+
+const char* const phaseNames[PHASE_COUNT] = {
+    "events", "n-body forces", "integrate", "broad phase", "collisions", "cube lines",
+    "particles", "texture upload", "text", "present"
+};
+
+// A ring of the most recent durations of each phase. Phases are recorded
+// from the main and the simulation thread, so the lock guards all of them.
+static double samples[PHASE_COUNT][PROFILE_WINDOW];
+static int sampleCount[PHASE_COUNT];
+static int nextSample[PHASE_COUNT];
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to add one duration, in seconds, to the samples of 'phase'
+void recordPhase(ProfilePhase phase, double seconds) {
+    pthread_mutex_lock(&profileLock);
+    samples[phase][nextSample[phase]] = seconds;
+    nextSample[phase] = (nextSample[phase] + 1) % PROFILE_WINDOW;
+    if (sampleCount[phase] < PROFILE_WINDOW) sampleCount[phase]++;
+    pthread_mutex_unlock(&profileLock);
+}
+
+// Function to record the time from 'start' until now as one sample of
+// 'phase'. Returns now, so back to back phases can be timed as
+// start = endPhase(PHASE_A, start); ... start = endPhase(PHASE_B, start);
+double endPhase(ProfilePhase phase, double start) {
+    double now = secondsNow();
+    recordPhase(phase, now - start);
+    return now;
+}
+
+static int compareSeconds(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Function to compute min, average and 99th percentile of the samples kept
+// for every phase. Phases without samples are all zero.
+void summarizePhases(PhaseSummary summaries[PHASE_COUNT]) {
+    double sorted[PROFILE_WINDOW];
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        pthread_mutex_lock(&profileLock);
+        int count = sampleCount[phase];
+        memcpy(sorted, samples[phase], (size_t)count * sizeof(double));
+        pthread_mutex_unlock(&profileLock);
+
+        PhaseSummary* summary = &summaries[phase];
+        memset(summary, 0, sizeof(*summary));
+        if (count == 0) continue;
+        qsort(sorted, count, sizeof(double), compareSeconds);
+        double total = 0.0;
+        for (int s = 0; s < count; s++) total += sorted[s];
+        summary->samples = count;
+        summary->min = sorted[0];
+        summary->average = total / count;
+        // The smallest sample at least 99% of the window is not above
+        summary->p99 = sorted[(count * 99 + 99) / 100 - 1];
+    }
+}
+
+// Function to write the current summary of every phase that has samples to
+// 'path' as CSV, one row per phase in milliseconds. Returns -1 if the file
+// could not be written.
+int writeProfileCsv(const char* path) {
+    PhaseSummary summaries[PHASE_COUNT];
+    summarizePhases(summaries);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return -1;
+    }
+    fprintf(file, "phase,samples,min_ms,avg_ms,p99_ms\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        const PhaseSummary* summary = &summaries[phase];
+        if (summary->samples == 0) continue;
+        fprintf(file, "%s,%d,%.4f,%.4f,%.4f\n", phaseNames[phase], summary->samples, summary->min * 1000.0,
+                summary->average * 1000.0, summary->p99 * 1000.0);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to drop every sample, e.g. when the scene changes
+void resetProfiler(void) {
+    pthread_mutex_lock(&profileLock);
+    memset(sampleCount, 0, sizeof(sampleCount));
+    memset(nextSample, 0, sizeof(nextSample));
+    pthread_mutex_unlock(&profileLock);
+}
@@ -0,0 +1,39 @@
+// profiler.h
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Phases of a frame and of a simulation step that are timed separately. The
+// physics phases are recorded once per step on the simulation thread, the
+// rest once per frame on the main thread.
+typedef enum {
+    PHASE_EVENTS,       // Polling and handling SDL events
+    PHASE_FORCES,       // Building the octree and applying the particles' mutual gravity
+    PHASE_INTEGRATE,    // Moving particles, bouncing them off the walls, sleep bookkeeping
+    PHASE_BROAD_PHASE,  // Building the spatial grid
+    PHASE_COLLISIONS,   // Testing candidate pairs and resolving contacts
+    PHASE_LINES,        // Drawing the cube edges
+    PHASE_PARTICLES,    // Interpolating, projecting and rasterizing the particles
+    PHASE_UPLOAD,       // Locking, clearing and uploading the frame texture
+    PHASE_TEXT,         // HUD text and the selection box
+    PHASE_PRESENT,      // Copying the texture to the window and presenting it
+    PHASE_COUNT
+} ProfilePhase;
+
+// Statistics over the last samples of one phase, in seconds
+typedef struct {
+    int samples;
+    double min;
+    double average;
+    double p99;
+} PhaseSummary;
+
+extern const char* const phaseNames[PHASE_COUNT];
+
+void recordPhase(ProfilePhase phase, double seconds);
+double endPhase(ProfilePhase phase, double start);
+void summarizePhases(PhaseSummary summaries[PHASE_COUNT]);
+int writeProfileCsv(const char* path);
+void resetProfiler(void);
+
+#endif // PROFILER_H
@@ -0,0 +1,479 @@
+// raster.c
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "raster.h"
+#include "view.h"
+#include "sprite.h"
+#include "tiles.h"
+#include "threadpool.h"
+
+// Screen dimensions
+int SCREEN_WIDTH = 640;
+int SCREEN_HEIGHT = 480;
+const float viewportDistance = 1.0f;
+
+Vec3D lightDir = {0.0f,-1.0f, 1.0f}; // Example: light coming from above and behind
+float lightIntensity = 1.0f; // Maximum light intensity
+
+
+// Function to project 3D points to 2D points, considering the camera position and rotation
+void project(Camera camera, Vec3D point3D, int* x2D, int* y2D) {
+    // Translate point based on camera position
+    Vec3D translated = {
+        point3D.x - camera.position.x,
+        point3D.y - camera.position.y,
+        point3D.z - camera.position.z
+    };
+
+    // Rotate point based on camera rotation (pitch, yaw)
+    Vec3D rotated = rotate(translated, camera.pitch, camera.yaw);
+
+    // Apply perspective projection with correct FOV and distance scaling
+    float focalLength = 1.0f;  // Controls the field of view
+    float zFactor = (rotated.z + viewportDistance); // Adjust based on how far the object is
+
+    if (zFactor > 0) {
+        *x2D = (int)((focalLength * rotated.x / zFactor) * (SCREEN_WIDTH / 2)) + (SCREEN_WIDTH / 2);
+        *y2D = (int)((focalLength * rotated.y / zFactor) * (SCREEN_HEIGHT / 2)) + (SCREEN_HEIGHT / 2);
+    } else {
+        *x2D = SCREEN_WIDTH / 2;
+        *y2D = SCREEN_HEIGHT / 2;
+    }
+}
+
+// Function to draw a filled circle with simple shading
+static void shadeCircleDirect(uint32_t* pixels, float* depthBuffer, const ClipRect* clip, int centerX, int centerY, int radius,
+                              uint32_t color, float depth, float depthRadius, Camera camera) {
+    int yBegin = centerY - radius < clip->top ? clip->top - centerY : -radius;
+    int yEnd = centerY + radius >= clip->bottom ? clip->bottom - 1 - centerY : radius;
+    int xBegin = centerX - radius < clip->left ? clip->left - centerX : -radius;
+    int xEnd = centerX + radius >= clip->right ? clip->right - 1 - centerX : radius;
+
+    for (int y = yBegin; y <= yEnd; y++) {
+        for (int x = xBegin; x <= xEnd; x++) {
+            if (x * x + y * y <= radius * radius) {
+                int drawX = centerX + x;
+                int drawY = centerY + y;
+
+                // Calculate the normal at this point on the sphere's surface
+                Vec3D normal = {x / (float)radius, y / (float)radius, sqrtf(1.0f - (x * x + y * y) / (float)(radius * radius))};
+
+                // Skip pixels a nearer sphere already covers before doing any shading
+                if (depthBuffer != NULL) {
+                    float z = depth - depthRadius * normal.z;
+                    if (z >= depthBuffer[drawY * SCREEN_WIDTH + drawX]) continue;
+                    depthBuffer[drawY * SCREEN_WIDTH + drawX] = z;
+                }
+
+                // Rotate normal based on camera rotation
+                Vec3D transformedNormal = rotate(normal, camera.pitch, camera.yaw);
+
+                // Calculate the dot product of the normal and the light direction
+                float dot = transformedNormal.x * lightDir.x + transformedNormal.y * lightDir.y + transformedNormal.z * lightDir.z;
+                if (dot < 0) dot = 0; // Ensure no negative light intensity
+
+                // Adjust the color intensity based on the dot product and light intensity
+                uint8_t r = (uint8_t)fminf(255.0f, ((color >> 16) & 0xFF) * dot * lightIntensity);
+                uint8_t g = (uint8_t)fminf(255.0f, ((color >> 8) & 0xFF) * dot * lightIntensity);
+                uint8_t b = (uint8_t)fminf(255.0f, (color & 0xFF) * dot * lightIntensity);
+
+                // Set the pixel with the shaded color
+                pixels[drawY * SCREEN_WIDTH + drawX] = (0xFF << 24) | (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+}
+// Function to draw one sphere inside 'clip'. The sprite for its radius must
+// already be current for 'camera' when this runs on a worker thread.
+static void shadeSphere(uint32_t* pixels, float* depthBuffer, const ClipRect* clip, int centerX, int centerY, int radius,
+                        uint32_t color, float depth, float depthRadius, Camera camera) {
+    const SphereSprite* sprite = getSphereSprite(radius);
+    if (sprite != NULL) {
+        blitSphereSprite(pixels, depthBuffer, clip, sprite, radius, centerX, centerY, color, depth, depthRadius);
+    } else {
+        shadeCircleDirect(pixels, depthBuffer, clip, centerX, centerY, radius, color, depth, depthRadius, camera);
+    }
+}
+// Function to draw a shaded sphere whose center is 'depth' from the eye and
+// whose surface comes 'depthRadius' nearer at its middle. With a depth buffer
+// only the pixels not already covered by something nearer are shaded; pass
+// NULL to draw over whatever is there. Spheres up to MAX_SPRITE_RADIUS are
+// copied from the sprite cache; only bigger ones are shaded per pixel.
+void drawShadedSphere(uint32_t* pixels, float* depthBuffer, int centerX, int centerY, int radius, uint32_t color,
+                      float depth, float depthRadius, Camera camera) {
+    ClipRect screen = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    updateSphereSpriteCache(camera);
+    shadeSphere(pixels, depthBuffer, &screen, centerX, centerY, radius, color, depth, depthRadius, camera);
+}
+// Function to draw a shaded sphere over whatever is already on screen
+void drawFilledCircleWithShading(uint32_t* pixels, int centerX, int centerY, int radius, uint32_t color, Camera camera) {
+    drawShadedSphere(pixels, NULL, centerX, centerY, radius, color, 0.0f, 0.0f, camera);
+}
+
+void initDepthBuffer(DepthBuffer* depthBuffer) {
+    depthBuffer->depth = NULL;
+    depthBuffer->width = 0;
+    depthBuffer->height = 0;
+}
+
+// Function to match the buffer to the current screen size. The contents are
+// undefined afterwards; renderParticles clears what it draws into.
+// Returns -1 if memory ran out.
+int resizeDepthBuffer(DepthBuffer* depthBuffer) {
+    if (depthBuffer->width == SCREEN_WIDTH && depthBuffer->height == SCREEN_HEIGHT && depthBuffer->depth != NULL) {
+        return 0;
+    }
+    free(depthBuffer->depth);
+    initDepthBuffer(depthBuffer);
+    depthBuffer->depth = malloc((size_t)SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(float));
+    if (depthBuffer->depth == NULL) return -1;
+    depthBuffer->width = SCREEN_WIDTH;
+    depthBuffer->height = SCREEN_HEIGHT;
+    return 0;
+}
+
+void freeDepthBuffer(DepthBuffer* depthBuffer) {
+    free(depthBuffer->depth);
+    initDepthBuffer(depthBuffer);
+}
+
+static void clearDepthRect(float* depthBuffer, const ClipRect* clip) {
+    for (int y = clip->top; y < clip->bottom; y++) {
+        float* line = depthBuffer + y * SCREEN_WIDTH;
+        for (int x = clip->left; x < clip->right; x++) {
+            line[x] = FLT_MAX;
+        }
+    }
+}
+
+// Particles whose projected radius is below this many pixels are added to
+// their pixel as a point splat instead of drawn as a sphere
+#define SPLAT_RADIUS 1.0f
+// Spheres up to this whole-pixel radius are drawn as flat discs in the
+// average shade of a sphere; their shading would only cover a few pixels
+#define FLAT_DISC_RADIUS 2
+// Smallest share of its pixel a splat lights, so particles with no projected
+// size at all still add up to a visible cloud
+#define MIN_SPLAT_COVERAGE (1.0f / 16.0f)
+// A channel sum that already saturates its pixel, in 1/256 steps
+#define SPLAT_SATURATED (255u << 8)
+
+static TileBins tileBins;
+// The projected particles tileBins was last built from, or NULL if the last
+// frame was drawn without binning
+static const ProjectedParticles* binnedParticles = NULL;
+
+// Light the point splats add to each pixel of the tile a worker is drawing,
+// three channels per pixel in 1/256 steps. Allocated by each worker the
+// first time it splats, and kept all zero between tiles.
+static uint32_t* tileSplats[MAX_THREADS];
+
+typedef struct {
+    uint32_t* pixels;
+    float* depthBuffer;
+    int shade;  // averageSphereIntensity() for this frame
+    Camera camera;
+    const ParticleStore* store;
+    const ProjectedParticles* projected;
+    const TileBins* bins;
+} TileContext;
+
+// Function to scale 'color' by an 8.8 fixed point light factor
+static uint32_t shadeColor(uint32_t color, uint32_t intensity) {
+    uint32_t r = (((color >> 16) & 0xFF) * intensity) >> 8;
+    uint32_t g = (((color >> 8) & 0xFF) * intensity) >> 8;
+    uint32_t b = ((color & 0xFF) * intensity) >> 8;
+    if (r > 255) r = 255;
+    if (g > 255) g = 255;
+    if (b > 255) b = 255;
+    return (0xFFu << 24) | (r << 16) | (g << 8) | b;
+}
+
+// Function to add light, per channel in 1/256 steps, to a pixel
+static void addLight(uint32_t* pixel, uint32_t red, uint32_t green, uint32_t blue) {
+    uint32_t r = ((*pixel >> 16) & 0xFF) + (red >> 8);
+    uint32_t g = ((*pixel >> 8) & 0xFF) + (green >> 8);
+    uint32_t b = (*pixel & 0xFF) + (blue >> 8);
+    if (r > 255) r = 255;
+    if (g > 255) g = 255;
+    if (b > 255) b = 255;
+    *pixel = (0xFFu << 24) | (r << 16) | (g << 8) | b;
+}
+
+// Function to draw a sphere too small to show its shading as a disc in one
+// color. Its front is 'depth' from the eye across the whole disc.
+static void drawFlatDisc(uint32_t* pixels, float* depthBuffer, const ClipRect* clip, int centerX, int centerY, int radius,
+                         uint32_t color, float depth) {
+    int yBegin = centerY - radius < clip->top ? clip->top - centerY : -radius;
+    int yEnd = centerY + radius >= clip->bottom ? clip->bottom - 1 - centerY : radius;
+    for (int y = yBegin; y <= yEnd; y++) {
+        int halfWidth = 0;
+        while ((halfWidth + 1) * (halfWidth + 1) + y * y <= radius * radius) halfWidth++;
+        int xBegin = centerX - halfWidth < clip->left ? clip->left : centerX - halfWidth;
+        int xEnd = centerX + halfWidth >= clip->right ? clip->right - 1 : centerX + halfWidth;
+        int line = (centerY + y) * SCREEN_WIDTH;
+        for (int x = xBegin; x <= xEnd; x++) {
+            if (depthBuffer != NULL) {
+                if (depth >= depthBuffer[line + x]) continue;
+                depthBuffer[line + x] = depth;
+            }
+            pixels[line + x] = color;
+        }
+    }
+}
+
+// Function to add a particle smaller than a pixel to the pixel it falls in,
+// weighted by how much of the pixel it covers. Splats behind a surface
+// already drawn are hidden, but they don't hide anything themselves: many of
+// them in one pixel add up, so a dense cloud shows its density. 'splats' holds
+// the sums of the tile 'clip' is, or is NULL to add to the pixel right away.
+static void splatPoint(const TileContext* target, uint32_t* splats, const ClipRect* clip, int x, int y, float radius,
+                       uint32_t color, float depth) {
+    if (x < clip->left || x >= clip->right || y < clip->top || y >= clip->bottom) return;
+    int p = y * SCREEN_WIDTH + x;
+    if (target->depthBuffer != NULL && depth >= target->depthBuffer[p]) return;
+
+    float coverage = fmaxf(MIN_SPLAT_COVERAGE, fminf(1.0f, 3.14159265f * radius * radius));
+    uint32_t weight = (uint32_t)(coverage * target->shade);
+    uint32_t red = ((color >> 16) & 0xFF) * weight;
+    uint32_t green = ((color >> 8) & 0xFF) * weight;
+    uint32_t blue = (color & 0xFF) * weight;
+    if (splats == NULL) {
+        addLight(&target->pixels[p], red, green, blue);
+        return;
+    }
+    uint32_t* sum = splats + 3 * ((y - clip->top) * TILE_SIZE + (x - clip->left));
+    if (sum[0] < SPLAT_SATURATED) sum[0] += red;
+    if (sum[1] < SPLAT_SATURATED) sum[1] += green;
+    if (sum[2] < SPLAT_SATURATED) sum[2] += blue;
+}
+
+// Function to add the splat sums of the tile 'clip' to its pixels and clear them
+static void resolveSplats(uint32_t* pixels, uint32_t* splats, const ClipRect* clip) {
+    for (int y = clip->top; y < clip->bottom; y++) {
+        for (int x = clip->left; x < clip->right; x++) {
+            uint32_t* sum = splats + 3 * ((y - clip->top) * TILE_SIZE + (x - clip->left));
+            if ((sum[0] | sum[1] | sum[2]) == 0) continue;
+            addLight(&pixels[y * SCREEN_WIDTH + x], sum[0], sum[1], sum[2]);
+            sum[0] = 0;
+            sum[1] = 0;
+            sum[2] = 0;
+        }
+    }
+}
+
+// Function to draw projected particle k inside 'clip' at the level of detail
+// its size on screen calls for: a shaded sphere, a flat disc, or a point
+// splat. Returns true if it was added to 'splats', which then need resolving
+// over 'clip'.
+static bool drawParticle(const TileContext* target, uint32_t* splats, const ClipRect* clip, int k) {
+    const ProjectedParticles* projected = target->projected;
+    int i = projected->index[k];
+    int x = (int)projected->x[k];
+    int y = (int)projected->y[k];
+    float radius = projected->radius[k];
+    uint32_t color = target->store->color[i];
+    float depthRadius = target->store->radius[i];
+
+    if (radius < SPLAT_RADIUS) {
+        splatPoint(target, splats, clip, x, y, radius, color, projected->depth[k] - depthRadius);
+        return splats != NULL;
+    }
+    if ((int)radius <= FLAT_DISC_RADIUS) {
+        drawFlatDisc(target->pixels, target->depthBuffer, clip, x, y, (int)radius, shadeColor(color, target->shade),
+                     projected->depth[k] - depthRadius);
+        return false;
+    }
+    shadeSphere(target->pixels, target->depthBuffer, clip, x, y, (int)radius, color, projected->depth[k], depthRadius,
+                target->camera);
+    return false;
+}
+
+// Function to shade tiles [begin, end). Each tile only touches its own
+// pixels, depth values and splat sums, so tiles need no locking between
+// workers.
+static void renderTileTask(void* context, int begin, int end, int worker) {
+    const TileContext* tiles = context;
+    const TileBins* bins = tiles->bins;
+    if (tileSplats[worker] == NULL) {
+        // Left NULL if memory ran out; splats then go straight to the pixels
+        tileSplats[worker] = calloc((size_t)TILE_SIZE * TILE_SIZE * 3, sizeof(uint32_t));
+    }
+    uint32_t* splats = tileSplats[worker];
+
+    for (int t = begin; t < end; t++) {
+        int left = (t % bins->tilesX) * TILE_SIZE;
+        int top = (t / bins->tilesX) * TILE_SIZE;
+        ClipRect tile = {left, top, left + TILE_SIZE, top + TILE_SIZE};
+        if (tile.right > bins->width) tile.right = bins->width;
+        if (tile.bottom > bins->height) tile.bottom = bins->height;
+
+        clearDepthRect(tiles->depthBuffer, &tile);
+        bool splatted = false;
+        for (int e = bins->tileStart[t]; e < bins->tileStart[t + 1]; e++) {
+            splatted |= drawParticle(tiles, splats, &tile, bins->tileEntries[e]);
+        }
+        if (splatted) resolveSplats(tiles->pixels, splats, &tile);
+    }
+}
+
+// Function to render the particles that survived the view transform. Each
+// is drawn at the level of detail its projected size calls for: a shaded
+// sphere, a flat disc when it is only a few pixels across, or a point splat
+// when it is smaller than a pixel. They are binned into screen tiles that the
+// worker pool shades in parallel, nearest first, so the depth buffer rejects
+// hidden pixels before they are shaded. Without a usable depth buffer they
+// are drawn on this thread furthest first and simply overwrite each other.
+void renderParticles(uint32_t* pixels, DepthBuffer* depthBuffer, Camera camera, const ParticleStore* store, const ProjectedParticles* projected) {
+    updateSphereSpriteCache(camera);
+    ClipRect screen = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    TileContext context = {pixels, NULL, averageSphereIntensity(), camera, store, projected, &tileBins};
+
+    binnedParticles = NULL;
+    if (depthBuffer == NULL || resizeDepthBuffer(depthBuffer) != 0) {
+        for (int n = projected->count - 1; n >= 0; n--) {
+            drawParticle(&context, NULL, &screen, projected->order[n]);
+        }
+        return;
+    }
+    context.depthBuffer = depthBuffer->depth;
+
+    // Build every sprite this frame needs up front; the workers only read them
+    bool spritesReady = true;
+    for (int k = 0; k < projected->count; k++) {
+        int radius = (int)projected->radius[k];
+        if (radius <= FLAT_DISC_RADIUS || radius > MAX_SPRITE_RADIUS) continue;
+        if (getSphereSprite(radius) == NULL) spritesReady = false;
+    }
+
+    if (binProjectedParticles(&tileBins, projected, SCREEN_WIDTH, SCREEN_HEIGHT) < 0) {
+        // Out of memory for the tile lists: draw the whole screen on this thread
+        clearDepthRect(depthBuffer->depth, &screen);
+        for (int n = 0; n < projected->count; n++) {
+            drawParticle(&context, NULL, &screen, projected->order[n]);
+        }
+        return;
+    }
+
+    binnedParticles = projected;
+
+    if (spritesReady) {
+        parallelFor(tileBins.tileCount, 1, renderTileTask, &context);
+    } else {
+        renderTileTask(&context, 0, tileBins.tileCount, 0);
+    }
+}
+
+// Function to test the ray through pixel (x, y) against projected particle
+// k. The renderer draws a sphere as a disc whose surface comes depthRadius
+// nearer at its middle, so on a hit 'hitDepth' is the depth the depth buffer
+// holds for that pixel.
+static bool rayHitsParticle(const ParticleStore* store, const ProjectedParticles* projected, int k, int x, int y,
+                            float* hitDepth) {
+    if (projected->index[k] >= store->count) return false;  // Projected from a store that has since shrunk
+    int radius = (int)projected->radius[k];
+    int dx = x - (int)projected->x[k];
+    int dy = y - (int)projected->y[k];
+    int distanceSquared = dx * dx + dy * dy;
+    if (distanceSquared > radius * radius) return false;
+    float height = radius > 0 ? sqrtf(1.0f - (float)distanceSquared / (float)(radius * radius)) : 1.0f;
+    *hitDepth = projected->depth[k] - store->radius[projected->index[k]] * height;
+    return true;
+}
+
+// Function to find the particle visible at pixel (x, y) in the frame last
+// drawn from 'projected'. Only the particles binned into the tile under the
+// pixel are tested, and the nearest hit wins, so the result is the particle
+// whose pixel is on screen. Returns its index in the store, or -1 if the ray
+// hits nothing.
+int pickParticle(int x, int y, const ParticleStore* store, const ProjectedParticles* projected) {
+    int nearest = -1;
+    float nearestDepth = FLT_MAX;
+
+    if (binnedParticles != projected) {
+        // The frame wasn't binned: test every particle
+        for (int k = 0; k < projected->count; k++) {
+            float depth;
+            if (rayHitsParticle(store, projected, k, x, y, &depth) && depth < nearestDepth) {
+                nearest = projected->index[k];
+                nearestDepth = depth;
+            }
+        }
+        return nearest;
+    }
+
+    if (x < 0 || y < 0 || x >= tileBins.width || y >= tileBins.height) return -1;
+    int tile = (y / TILE_SIZE) * tileBins.tilesX + x / TILE_SIZE;
+    for (int e = tileBins.tileStart[tile]; e < tileBins.tileStart[tile + 1]; e++) {
+        int k = tileBins.tileEntries[e];
+        float depth;
+        if (rayHitsParticle(store, projected, k, x, y, &depth) && depth < nearestDepth) {
+            nearest = projected->index[k];
+            nearestDepth = depth;
+        }
+    }
+    return nearest;
+}
+
+// Function to free the buffers renderParticles keeps between frames
+void freeRaster(void) {
+    freeTileBins(&tileBins);
+    binnedParticles = NULL;
+    for (int w = 0; w < MAX_THREADS; w++) {
+        free(tileSplats[w]);
+        tileSplats[w] = NULL;
+    }
+}
+// Function to draw a line between two 3D points
+void drawLine3D(uint32_t* pixels, const ViewTransform* view, Vec3D p1, Vec3D p2, uint32_t color) {
+    int x1, y1, x2, y2;
+    // Skip lines that reach behind the camera rather than smear them across the screen
+    if (!projectPoint(view, p1, &x1, &y1) || !projectPoint(view, p2, &x2, &y2)) return;
+
+    // Bresenham's algorithm
+    int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
+    int dy = -abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+    int err = dx + dy, e2;
+
+    while (true) {
+        if (x1 >= 0 && x1 < SCREEN_WIDTH && y1 >= 0 && y1 < SCREEN_HEIGHT)
+            pixels[y1 * SCREEN_WIDTH + x1] = color;
+
+        if (x1 == x2 && y1 == y2) break;
+        e2 = 2 * err;
+        if (e2 >= dy) { err += dy; x1 += sx; }
+        if (e2 <= dx) { err += dx; y1 += sy; }
+    }
+}
+
+// Function to move the camera in the direction it is facing
+void moveCamera(Camera* camera, float forward, float strafe, float vertical) {
+    camera->position.y += vertical;
+    camera->position.x += forward * sinf(camera->yaw) + strafe * cosf(camera->yaw);
+    camera->position.z += forward * cosf(camera->yaw) - strafe * sinf(camera->yaw);
+}
+
+void drawBoxOutline(uint32_t* pixels, int x, int y, int width, int height, uint32_t color, int thickness) {
+    // Draw top and bottom edges
+    for (int t = 0; t < thickness; t++) {
+        for (int i = x - t; i <= x + width + t; i++) {
+            if (y - t >= 0 && y - t < SCREEN_HEIGHT && i >= 0 && i < SCREEN_WIDTH)
+                pixels[(y - t) * SCREEN_WIDTH + i] = color;
+            if (y + height + t >= 0 && y + height + t < SCREEN_HEIGHT && i >= 0 && i < SCREEN_WIDTH)
+                pixels[(y + height + t) * SCREEN_WIDTH + i] = color;
+        }
+    }
+
+    // Draw left and right edges
+    for (int t = 0; t < thickness; t++) {
+        for (int i = y - t; i <= y + height + t; i++) {
+            if (x - t >= 0 && x - t < SCREEN_WIDTH && i >= 0 && i < SCREEN_HEIGHT)
+                pixels[i * SCREEN_WIDTH + (x - t)] = color;
+            if (x + width + t >= 0 && x + width + t < SCREEN_WIDTH && i >= 0 && i < SCREEN_HEIGHT)
+                pixels[i * SCREEN_WIDTH + (x + width + t)] = color;
+        }
+    }
+}
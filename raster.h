@@ -0,0 +1,55 @@
+// raster.h
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdint.h>
+#include "vector.h"
+#include "particle.h"
+
+typedef struct {
+    Vec3D position;
+    float pitch;  // Rotation around x-axis
+    float yaw;    // Rotation around y-axis
+} Camera;
+
+// Per-pixel depth of the nearest surface drawn so far this frame, matching
+// the current SCREEN_WIDTH x SCREEN_HEIGHT
+typedef struct {
+    float* depth;
+    int width;
+    int height;
+} DepthBuffer;
+
+// Pixels [left, right) x [top, bottom) that drawing is limited to
+typedef struct {
+    int left;
+    int top;
+    int right;
+    int bottom;
+} ClipRect;
+
+typedef struct ViewTransform ViewTransform;
+typedef struct ProjectedParticles ProjectedParticles;
+
+extern int SCREEN_WIDTH;
+extern int SCREEN_HEIGHT;
+extern const float viewportDistance;
+extern Vec3D lightDir;
+extern float lightIntensity;
+
+void project(Camera camera, Vec3D point3D, int* x2D, int* y2D);
+void initDepthBuffer(DepthBuffer* depthBuffer);
+int resizeDepthBuffer(DepthBuffer* depthBuffer);
+void freeDepthBuffer(DepthBuffer* depthBuffer);
+void drawFilledCircleWithShading(uint32_t* pixels, int centerX, int centerY, int radius, uint32_t color, Camera camera);
+void drawShadedSphere(uint32_t* pixels, float* depthBuffer, int centerX, int centerY, int radius, uint32_t color,
+                      float depth, float depthRadius, Camera camera);
+void renderParticles(uint32_t* pixels, DepthBuffer* depthBuffer, Camera camera, const ParticleStore* store, const ProjectedParticles* projected);
+int pickParticle(int x, int y, const ParticleStore* store, const ProjectedParticles* projected);
+void drawLine3D(uint32_t* pixels, const ViewTransform* view, Vec3D p1, Vec3D p2, uint32_t color);
+void drawBoxOutline(uint32_t* pixels, int x, int y, int width, int height, uint32_t color, int thickness);
+void moveCamera(Camera* camera, float forward, float strafe, float vertical);
+void freeRaster(void);
+
+#endif // RASTER_H
@@ -5,389 +5,276 @@
 #include <SDL2/SDL_ttf.h>
 #include <stdlib.h>
 #include <stdint.h> 
+#include <string.h>
 #include "vector.h"
+#include "particle.h"
+#include "physics.h"
+#include "nbody.h"
+#include "morton.h"
+#include "integrate.h"
+#include "threadpool.h"
+#include "raster.h"
+#include "view.h"
+#include "sprite.h"
+#include "glyphs.h"
+#include "simthread.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "timer.h"
+#include "profiler.h"
 
-// Screen dimensions
-int SCREEN_WIDTH = 640;
-int SCREEN_HEIGHT = 480;
-const float viewportDistance = 1.0f;
 bool paused = false;
-float  gravity = 0.0f;
 
-Vec3D lightDir = {0.0f,-1.0f, 1.0f}; // Example: light coming from above and behind
-float lightIntensity = 1.0f; // Maximum light intensity
-
-
-typedef struct {
-    Vec3D position;
-    float pitch;  // Rotation around x-axis
-    float yaw;    // Rotation around y-axis
-} Camera;
-
-typedef struct {
-    Vec3D position;
-    Vec3D velocity;
-    Uint32 color;
-    float radius;
-    struct Particle* next;
-} Particle;
-
-
-Uint32 generateRandomColor() {
-    Uint8 red = rand() % 256;    // Random value between 0 and 255
-    Uint8 green = rand() % 256;  // Random value between 0 and 255
-    Uint8 blue = rand() % 256;   // Random value between 0 and 255
-
-    // Combine the components into a single Uint32 color value (assuming an ARGB format with Alpha = 0xFF)
-    Uint32 color = (0xFF << 24) | (red << 16) | (green << 8) | blue;
-
-    return color;
-}
-
-void handleParticleCollision(Particle* p1, Particle* p2) {
-    // Calculate the vector between the centers of the two particles
-    Vec3D collisionDirection = {
-        p2->position.x - p1->position.x,
-        p2->position.y - p1->position.y,
-        p2->position.z - p1->position.z
-    };
-    // Calculate the distance squared between the two particles
-    float distanceSquared =
-        collisionDirection.x * collisionDirection.x +
-        collisionDirection.y * collisionDirection.y +
-        collisionDirection.z * collisionDirection.z;
-    // Calculate the sum of the radii squared
-    float radiusSum = p1->radius + p2->radius;
-    float radiusSumSquared = radiusSum * radiusSum;
-    // Check if the distance is less than the sum of the radii
-    if (distanceSquared <= radiusSumSquared) {
-        // Normalize the collision direction
-        float distance = sqrtf(distanceSquared);
-        Vec3D normalizedCollisionDirection = {
-            collisionDirection.x / distance,
-            collisionDirection.y / distance,
-            collisionDirection.z / distance
-        };
-        // Calculate overlap and separate the particles
-        float overlap = radiusSum - distance;
-        p1->position.x -= normalizedCollisionDirection.x * overlap * 0.5f;
-        p1->position.y -= normalizedCollisionDirection.y * overlap * 0.5f;
-        p1->position.z -= normalizedCollisionDirection.z * overlap * 0.5f;
-        p2->position.x += normalizedCollisionDirection.x * overlap * 0.5f;
-        p2->position.y += normalizedCollisionDirection.y * overlap * 0.5f;
-        p2->position.z += normalizedCollisionDirection.z * overlap * 0.5f;
-        // Project velocities onto the collision direction
-        Vec3D w1 = orthogonalProjection(p1->velocity, normalizedCollisionDirection);
-        Vec3D w2 = orthogonalProjection(p2->velocity, normalizedCollisionDirection);
-        Vec3D u1 = subVector(p1->velocity, w1);
-        Vec3D u2 = subVector(p2->velocity, w2);
-        // Swap the velocities along the collision direction
-        p1->velocity = addVector(u1, w2);
-        p2->velocity = addVector(u2, w1);
-    }
-}
-
-void updateParticles(Particle* particles, int numParticles, float deltaTime) {
-    for (int i = 0; i < numParticles; i++) {
-        // Update position based on velocity
-        particles[i].position.x += particles[i].velocity.x * deltaTime;
-        particles[i].position.y += particles[i].velocity.y * deltaTime;
-        particles[i].position.z += particles[i].velocity.z * deltaTime;
-        // Handle particle collisions
-        for (int j = i + 1; j < numParticles; j++) {
-            handleParticleCollision(&particles[i], &particles[j]);
-        }
-
-
-	if(particles[i].position.y <= 0.5f){
-            particles[i].velocity.y += gravity;
-	}
-        // Check for collision with cube walls and bounce
-        if (particles[i].position.x <= -0.5f) {
-            particles[i].position.x = -0.5f;
-            particles[i].velocity.x *= -1.0f;
-        } else if (particles[i].position.x >= 0.5f) {
-            particles[i].position.x = 0.5f;
-            particles[i].velocity.x *= -1.0f;
-        }
-        if (particles[i].position.y <= -0.5f) {
-            particles[i].position.y = -0.5f;
-            particles[i].velocity.y *= -1.0f;
-        } else if (particles[i].position.y >= 0.5f) {
-            particles[i].position.y = 0.5f;
-            particles[i].velocity.y *= -1.0f;
-        }
-        if (particles[i].position.z <= -0.5f) {
-            particles[i].position.z = -0.5f;
-            particles[i].velocity.z *= -1.0f;
-        } else if (particles[i].position.z >= 0.5f) {
-            particles[i].position.z = 0.5f;
-            particles[i].velocity.z *= -1.0f;
+// Particles added by one press of 'm'
+#define BULK_SPAWN 1000
+
+// Function to render every printable character of 'font' once into 'atlas'.
+// Returns -1 if a glyph could not be rendered or memory ran out.
+int buildGlyphAtlas(GlyphAtlas* atlas, TTF_Font* font) {
+    SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface* glyphSurfaces[GLYPH_COUNT];
+    int width = 0;
+
+    for (int g = 0; g < GLYPH_COUNT; g++) {
+        glyphSurfaces[g] = TTF_RenderGlyph_Blended(font, (Uint16)(FIRST_GLYPH + g), white);
+        if (glyphSurfaces[g] == NULL) {
+            printf("Unable to render glyph! SDL_ttf Error: %s\n", TTF_GetError());
+            for (int done = 0; done < g; done++) SDL_FreeSurface(glyphSurfaces[done]);
+            return -1;
         }
+        width += glyphSurfaces[g]->w;
     }
-}
-// Function to project 3D points to 2D points, considering the camera position and rotation
-void project(Camera camera, Vec3D point3D, int* x2D, int* y2D) {
-    // Translate point based on camera position
-    Vec3D translated = {
-        point3D.x - camera.position.x,
-        point3D.y - camera.position.y,
-        point3D.z - camera.position.z
-    };
-
-    // Rotate point based on camera rotation (pitch, yaw)
-    Vec3D rotated = rotate(translated, camera.pitch, camera.yaw);
-
-    // Apply perspective projection with correct FOV and distance scaling
-    float focalLength = 1.0f;  // Controls the field of view
-    float zFactor = (rotated.z + viewportDistance); // Adjust based on how far the object is
-
-    if (zFactor > 0) {
-        *x2D = (int)((focalLength * rotated.x / zFactor) * (SCREEN_WIDTH / 2)) + (SCREEN_WIDTH / 2);
-        *y2D = (int)((focalLength * rotated.y / zFactor) * (SCREEN_HEIGHT / 2)) + (SCREEN_HEIGHT / 2);
-    } else {
-        *x2D = SCREEN_WIDTH / 2;
-        *y2D = SCREEN_HEIGHT / 2;
-    }
-}
-
-// Function to draw a filled circle with simple shading
-void drawFilledCircleWithShading(Uint32* pixels, int centerX, int centerY, int radius, Uint32 color, Camera camera) {
-    for (int y = -radius; y <= radius; y++) {
-        for (int x = -radius; x <= radius; x++) {
-            if (x * x + y * y <= radius * radius) {
-                int drawX = centerX + x;
-                int drawY = centerY + y;
-                if (drawX >= 0 && drawX < SCREEN_WIDTH && drawY >= 0 && drawY < SCREEN_HEIGHT) {
-
-                    // Calculate the normal at this point on the sphere's surface
-                    Vec3D normal = {x / (float)radius, y / (float)radius, sqrtf(1.0f - (x * x + y * y) / (float)(radius * radius))};
-
-                    // Rotate normal based on camera rotation
-                    Vec3D transformedNormal = rotate(normal, camera.pitch, camera.yaw);
-
-                    // Calculate the dot product of the normal and the light direction
-                    float dot = transformedNormal.x * lightDir.x + transformedNormal.y * lightDir.y + transformedNormal.z * lightDir.z;
-                    if (dot < 0) dot = 0; // Ensure no negative light intensity
-
-		    // Adjust the color intensity based on the dot product and light intensity
-		    Uint8 r = (Uint8)fminf(255.0f, ((color >> 16) & 0xFF) * dot * lightIntensity);
-		    Uint8 g = (Uint8)fminf(255.0f, ((color >> 8) & 0xFF) * dot * lightIntensity);
-		    Uint8 b = (Uint8)fminf(255.0f, (color & 0xFF) * dot * lightIntensity);
 
-                    Uint32 shadedColor = (0xFF << 24) | (r << 16) | (g << 8) | b;
-                    // Combine the new color components
-                  
-
-                    // Set the pixel with the shaded color
-                    pixels[drawY * SCREEN_WIDTH + drawX] = shadedColor;
+    int result = initGlyphAtlas(atlas, width, TTF_FontHeight(font));
+    int x = 0;
+    for (int g = 0; g < GLYPH_COUNT; g++) {
+        SDL_Surface* glyphSurface = glyphSurfaces[g];
+        if (result == 0) {
+            // Blended glyphs are white ARGB8888; the alpha channel is the coverage
+            int rows = glyphSurface->h < atlas->height ? glyphSurface->h : atlas->height;
+            for (int row = 0; row < rows; row++) {
+                const Uint32* source = (const Uint32*)((const Uint8*)glyphSurface->pixels + (size_t)row * glyphSurface->pitch);
+                for (int column = 0; column < glyphSurface->w; column++) {
+                    atlas->coverage[(size_t)row * atlas->width + x + column] = (Uint8)(source[column] >> 24);
                 }
             }
+            int advance = glyphSurface->w;
+            TTF_GlyphMetrics(font, (Uint16)(FIRST_GLYPH + g), NULL, NULL, NULL, NULL, &advance);
+            atlas->glyphs[g] = (GlyphMetrics){x, glyphSurface->w, advance};
         }
+        x += glyphSurface->w;
+        SDL_FreeSurface(glyphSurface);
     }
+    return result;
 }
-// Function to render particles as spheres
-void renderParticles(Uint32* pixels, Camera camera, Particle* particles, int numParticles) {
-    for (int i = 0; i < numParticles; i++) {
-        int x2D, y2D;
-        project(camera, particles[i].position, &x2D, &y2D);
-
-        if (x2D >= 0 && x2D < SCREEN_WIDTH && y2D >= 0 && y2D < SCREEN_HEIGHT) {
-            // Calculate distance from the camera
-            float distance = sqrtf(
-                (particles[i].position.x - camera.position.x) * (particles[i].position.x - camera.position.x) +
-                (particles[i].position.y - camera.position.y) * (particles[i].position.y - camera.position.y) +
-                (particles[i].position.z - camera.position.z) * (particles[i].position.z - camera.position.z)
-            );
-            // Adjust the sphere size based on distance
-            // Here, we assume a base size and scale it with distance.
-            float scaleFactor = viewportDistance*SCREEN_HEIGHT/2 /  (distance  + 0.1f * viewportDistance); // +0.1f to avoid division by zero
-
-            int radius = (int)(particles[i].radius * scaleFactor); // Scale radius by distance
-//	    if (radius < 5) radius = 5;  // Minimum radius
-  //          if (radius > 100) radius = 100; // Maximum radius
-
-        drawFilledCircleWithShading(pixels, x2D, y2D, radius, particles[i].color, camera);
-        }
-    }
-}
-// Function to draw a line between two 3D points
-void drawLine3D(Uint32* pixels, Camera camera, Vec3D p1, Vec3D p2, Uint32 color) {
-    int x1, y1, x2, y2;
-    project(camera, p1, &x1, &y1);
-    project(camera, p2, &x2, &y2);
-
-    // Bresenham's algorithm
-    int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
-    int dy = -abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
-    int err = dx + dy, e2;
-
-    while (true) {
-        if (x1 >= 0 && x1 < SCREEN_WIDTH && y1 >= 0 && y1 < SCREEN_HEIGHT)
-            pixels[y1 * SCREEN_WIDTH + x1] = color;
-
-        if (x1 == x2 && y1 == y2) break;
-        e2 = 2 * err;
-        if (e2 >= dy) { err += dy; x1 += sx; }
-        if (e2 <= dx) { err += dx; y1 += sy; }
-    }
-}
-
-float generateRandomFloat() {
-    return (float)rand() / (float)RAND_MAX;
-}
-
-// Function to move the camera in the direction it is facing
-void moveCamera(Camera* camera, float forward, float strafe, float vertical) {
-    camera->position.y += vertical;
-    camera->position.x += forward * sinf(camera->yaw) + strafe * cosf(camera->yaw);
-    camera->position.z += forward * cosf(camera->yaw) - strafe * sinf(camera->yaw);
-}
-
-// General-purpose function to draw text on the screen
-void drawText(SDL_Renderer* renderer, TTF_Font* font, const char* text, int x, int y, SDL_Color color) {
-    SDL_Surface* textSurface = TTF_RenderText_Solid(font, text, color);
-    if (textSurface == NULL) {
-        printf("Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError());
-        return;
-    }
-
-    SDL_Texture* textTexture = SDL_CreateTextureFromSurface(renderer, textSurface);
-    if (textTexture == NULL) {
-        printf("Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError());
-        SDL_FreeSurface(textSurface);
-        return;
-    }
-
-    SDL_Rect renderQuad = { x, y, textSurface->w, textSurface->h };
-    SDL_RenderCopy(renderer, textTexture, NULL, &renderQuad);
 
-    SDL_DestroyTexture(textTexture);
-    SDL_FreeSurface(textSurface);
+// General-purpose function to draw text into the frame
+void drawText(Uint32* pixels, const GlyphAtlas* atlas, const char* text, int x, int y, SDL_Color color) {
+    drawGlyphText(pixels, atlas, text, x, y, ((Uint32)color.r << 16) | ((Uint32)color.g << 8) | color.b);
 }
 
 // Example usage in renderCounts function
-void renderCounts(SDL_Renderer* renderer, TTF_Font* font, int fps, int particles) {
+void renderCounts(Uint32* pixels, const GlyphAtlas* atlas, int fps, float frameMs, float simHz, int particles,
+                  int sleeping) {
     SDL_Color color = {255, 255, 255, 255}; // White color
     char fpsText[20];
+    char frameText[30];
+    char simText[30];
     char particleText[20];
+    char sleepText[50];
     snprintf(fpsText, sizeof(fpsText), "FPS: %d", fps);
+    snprintf(frameText, sizeof(frameText), "Frame: %.2f ms", frameMs);
+    snprintf(simText, sizeof(simText), "Sim: %.0f Hz", simHz);
     snprintf(particleText, sizeof(particleText),"Particles: %d", particles);
+    snprintf(sleepText, sizeof(sleepText), "Awake: %d  Asleep: %d", particles - sleeping, sleeping);
 
-    drawText(renderer, font, fpsText, 10, 10, color);
-    drawText(renderer, font, particleText, 10, 40, color);
+    drawText(pixels, atlas, fpsText, 10, 10, color);
+    drawText(pixels, atlas, frameText, 10, 40, color);
+    drawText(pixels, atlas, simText, 10, 70, color);
+    drawText(pixels, atlas, particleText, 10, 100, color);
+    drawText(pixels, atlas, sleepText, 10, 130, color);
 }
 
-void drawBoxOutline(Uint32* pixels, int x, int y, int width, int height, Uint32 color, int thickness) {
-    // Draw top and bottom edges
-    for (int t = 0; t < thickness; t++) {
-        for (int i = x - t; i <= x + width + t; i++) {
-            if (y - t >= 0 && y - t < SCREEN_HEIGHT && i >= 0 && i < SCREEN_WIDTH)
-                pixels[(y - t) * SCREEN_WIDTH + i] = color;
-            if (y + height + t >= 0 && y + height + t < SCREEN_HEIGHT && i >= 0 && i < SCREEN_WIDTH)
-                pixels[(y + height + t) * SCREEN_WIDTH + i] = color;
-        }
+// Function to draw the per-phase timings below the counters, one line per
+// phase that has been timed
+void renderProfile(Uint32* pixels, const GlyphAtlas* atlas, const PhaseSummary summaries[PHASE_COUNT]) {
+    SDL_Color color = {255, 255, 255, 255}; // White color
+    char line[64];
+    int y = 170;
+    drawText(pixels, atlas, "Phase ms      min    avg    p99", 10, y, color);
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        const PhaseSummary* summary = &summaries[phase];
+        if (summary->samples == 0) continue;
+        y += 30;
+        snprintf(line, sizeof(line), "%-14s%6.2f %6.2f %6.2f", phaseNames[phase], summary->min * 1000.0,
+                 summary->average * 1000.0, summary->p99 * 1000.0);
+        drawText(pixels, atlas, line, 10, y, color);
     }
+}
 
-    // Draw left and right edges
-    for (int t = 0; t < thickness; t++) {
-        for (int i = y - t; i <= y + height + t; i++) {
-            if (x - t >= 0 && x - t < SCREEN_WIDTH && i >= 0 && i < SCREEN_HEIGHT)
-                pixels[i * SCREEN_WIDTH + (x - t)] = color;
-            if (x + width + t >= 0 && x + width + t < SCREEN_WIDTH && i >= 0 && i < SCREEN_HEIGHT)
-                pixels[i * SCREEN_WIDTH + (x + width + t)] = color;
-        }
+// Function to create the texture each frame is streamed into, sized to the
+// current screen. Only called at startup and when the window is resized.
+SDL_Texture* createFrameTexture(SDL_Renderer* renderer) {
+    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                             SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (texture == NULL) {
+        printf("Texture could not be created! SDL_Error: %s\n", SDL_GetError());
     }
+    return texture;
 }
 
 
-void displayParticleInfo(SDL_Renderer* renderer, TTF_Font* font, Particle particle, int x, int y) {
+void displayParticleInfo(Uint32* pixels, const GlyphAtlas* atlas, const ParticleStore* store, int index, int x, int y) {
     SDL_Color color = {255, 255, 255, 255}; // White color
+    Vec3D velocity = getParticleVelocity(store, index);
 
     // Prepare strings for each piece of particle information
     char posText[60];
     snprintf(posText, sizeof(posText), "Pos: (%.2f, %.2f, %.2f)", 
-             particle.position.x, particle.position.y, particle.position.z);
+             store->px[index], store->py[index], store->pz[index]);
 
     char velocityComponentText[60]; 
     snprintf(velocityComponentText, sizeof(velocityComponentText), "Velocity comp. (X, Y, Z)"); 
 
     char componentVelocityText[60];
     snprintf(componentVelocityText, sizeof(componentVelocityText), "(%.2f, %.2f, %.2f)", 
-             particle.velocity.x, particle.velocity.y, particle.velocity.z);
+             velocity.x, velocity.y, velocity.z);
 
     char velocityText[60];
-	    snprintf(velocityText, sizeof(velocityText), "Velocity: (%.2f)", magnitudeVec3D(particle.velocity));
+	    snprintf(velocityText, sizeof(velocityText), "Velocity: (%.2f)", magnitudeVec3D(velocity));
 
     char radiusText[40];
-    snprintf(radiusText, sizeof(radiusText), "Radius: %.2f", particle.radius);
+    snprintf(radiusText, sizeof(radiusText), "Radius: %.2f", store->radius[index]);
 
     // Draw each line of information
-    drawText(renderer, font, posText, x + 10 , y + 10, color);           
-    drawText(renderer, font, velocityComponentText, x + 10, y + 40, color);      
-    drawText(renderer, font, componentVelocityText, x + 10, y + 70, color);
-    drawText(renderer, font,velocityText, x + 10, y + 100, color);      
-    drawText(renderer, font, radiusText, x + 10, y + 130, color);   
+    drawText(pixels, atlas, posText, x + 10 , y + 10, color);
+    drawText(pixels, atlas, velocityComponentText, x + 10, y + 40, color);
+    drawText(pixels, atlas, componentVelocityText, x + 10, y + 70, color);
+    drawText(pixels, atlas, velocityText, x + 10, y + 100, color);
+    drawText(pixels, atlas, radiusText, x + 10, y + 130, color);
 }
 
 
-void createParticle(Particle* particle, float velocity, Uint32 color){
-	particle->position = (Vec3D){rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f};
-        particle->velocity = (Vec3D){(rand() / (float)RAND_MAX - 0.5f) * velocity, (rand() / (float)RAND_MAX - 0.5f) * velocity, (rand() / (float)RAND_MAX - 0.5f) * velocity};
-        particle->radius = generateRandomFloat()/10;
-        particle->color = color;
-	particle->next = NULL;
+// Returns the index of the particle drawn under the cursor, or -1 if none
+// was hit. Casts the ray through the cursor against the spheres of the last
+// frame, looking only at the ones binned into the tile it falls in.
+int handleMouseClick(int mouseX, int mouseY, const ParticleStore* store, const ProjectedParticles* projected) {
+    return pickParticle(mouseX, mouseY, store, projected);
 }
 
-void addParticle(Particle** head, Particle* newParticle) {
-    if (*head == NULL) {
-        *head = newParticle;
-        newParticle->next = newParticle;
-    } else {
-        Particle* current = *head;
-
-        while (current->next != *head) {
-            current = current->next;
-        }
-
-        current->next = newParticle;
-
-        newParticle->next = *head;
 
+// Function to save the scene to 'path', or replace it with the one saved
+// there. The simulation thread owns the particles while it runs, so it is
+// stopped for the duration and started again afterwards. Returns -1 if the
+// checkpoint failed or the thread could not be restarted.
+int runCheckpoint(SimThread* sim, ParticleStore* particles, float deltaTime, Camera* camera, const char* path, bool load,
+                  Recorder* recorder, Replay* replay) {
+    stopSimThread(sim);
+
+    SceneSettings settings = {*camera, gravity, lightDir, lightIntensity};
+    double start = secondsNow();
+    int result = load ? loadCheckpoint(path, particles, &settings) : saveCheckpoint(path, particles, &settings);
+    if (result == 0) {
+        printf("%s %d particles %s %s in %.1f ms\n", load ? "Loaded" : "Saved", particles->count,
+               load ? "from" : "to", path, (secondsNow() - start) * 1000.0);
+    }
+    if (result == 0 && load) {
+        // Timings of the old scene say nothing about the new one
+        resetProfiler();
+        *camera = settings.camera;
+        gravity = settings.gravity;
+        lightDir = settings.lightDir;
+        lightIntensity = settings.lightIntensity;
     }
-}
-
-
-Particle* handleMouseClick(int mouseX, int mouseY, Particle* particles, int numParticles, Camera camera) {
-    Particle* currentParticle = NULL; // Initialize to NULL
-
-    for (int i = 0; i < numParticles; i++) {
-        int x2D, y2D;
-        project(camera, particles[i].position, &x2D, &y2D);
 
-        // Adjust radius based on the distance from the camera
-        float distance = sqrtf(
-            (particles[i].position.x - camera.position.x) * (particles[i].position.x - camera.position.x) +
-            (particles[i].position.y - camera.position.y) * (particles[i].position.y - camera.position.y) +
-            (particles[i].position.z - camera.position.z) * (particles[i].position.z - camera.position.z)
-        );
-        int radius = (int)(20 / distance); // Scale the sphere size
+    if (startSimThread(sim, particles, deltaTime, recorder, replay) != 0) return -1;
+    atomic_store(&sim->paused, paused);
+    return result;
+}
 
-        // Check if the click is within the sphere
-        int dx = mouseX - x2D;
-        int dy = mouseY - y2D;
-        if (dx * dx + dy * dy <= radius * radius) {
-            currentParticle = &particles[i]; // Use address-of operator to return a pointer
-            return currentParticle; // Exit the loop once a particle is selected
+int main(int argc, char* args[]) {
+    int numThreads = defaultThreadCount();
+    int targetFps = 60;
+    bool vsync = false;
+    float deltaTime = 0.016f;
+    bool interpolate = true;
+    int particlesSpawned = 2;
+    const char* checkpointPath = "particles.ckpt";
+    bool loadAtStart = false;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    const char* profilePath = "profile.csv";
+    bool showProfile = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(args[i], "--selftest") == 0) {
+            // Check the vectorized integrate kernels against the scalar one and exit
+            return verifyIntegrateKernels() == 0 ? 0 : 1;
+        } else if (strcmp(args[i], "--threads") == 0 && i + 1 < argc) {
+            numThreads = atoi(args[++i]);
+        } else if (strcmp(args[i], "--fps") == 0 && i + 1 < argc) {
+            targetFps = atoi(args[++i]);
+        } else if (strcmp(args[i], "--vsync") == 0) {
+            vsync = true;
+        } else if (strcmp(args[i], "--dt") == 0 && i + 1 < argc) {
+            deltaTime = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--particles") == 0 && i + 1 < argc) {
+            particlesSpawned = atoi(args[++i]);
+        } else if (strcmp(args[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpointPath = args[++i];
+        } else if (strcmp(args[i], "--load") == 0 && i + 1 < argc) {
+            checkpointPath = args[++i];
+            loadAtStart = true;
+        } else if (strcmp(args[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = args[++i];
+        } else if (strcmp(args[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = args[++i];
+        } else if (strcmp(args[i], "--no-sleep") == 0) {
+            sleepEnabled = false;
+        } else if (strcmp(args[i], "--continuous") == 0) {
+            continuousCollisions = true;
+        } else if (strcmp(args[i], "--reorder") == 0 && i + 1 < argc) {
+            reorderInterval = atoi(args[++i]);
+        } else if (strcmp(args[i], "--nbody") == 0 && i + 1 < argc) {
+            nbodyStrength = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--theta") == 0 && i + 1 < argc) {
+            openingAngle = strtof(args[++i], NULL);
+        } else if (strcmp(args[i], "--profile") == 0) {
+            showProfile = true;
+        } else if (strcmp(args[i], "--profile-csv") == 0 && i + 1 < argc) {
+            profilePath = args[++i];
+        } else {
+            printf("Usage: %s [--threads N] [--fps N] [--vsync] [--dt T] [--particles N] [--checkpoint FILE] [--load FILE]"
+                   " [--record FILE | --replay FILE] [--no-sleep] [--continuous] [--reorder N] [--nbody G] [--theta T] [--profile] [--profile-csv FILE] [--selftest]\n", args[0]);
+            return 1;
         }
     }
-    printf("null");
-    return NULL; // Return NULL if no particle was selected
-}
-
+    if (deltaTime <= 0.0f) {
+        printf("--dt must be positive\n");
+        return 1;
+    }
+    if (particlesSpawned < 0) {
+        printf("--particles must not be negative\n");
+        return 1;
+    }
+    if (recordPath != NULL && replayPath != NULL) {
+        printf("--record and --replay can't be used together\n");
+        return 1;
+    }
 
+    // A replay plays back at the timestep it was recorded with
+    Replay replay;
+    Replay* activeReplay = NULL;
+    if (replayPath != NULL) {
+        if (openReplay(&replay, replayPath) != 0) return 1;
+        activeReplay = &replay;
+        deltaTime = replay.deltaTime;
+    }
+    // Rendering and physics get a pool each, so a slow frame's tile job
+    // never holds up a step
+    startThreadPool(numThreads);
+    startThreadPoolFor(POOL_SIMULATION, numThreads);
 
-int main(int argc, char* args[]) {
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
@@ -408,7 +295,7 @@ int main(int argc, char* args[]) {
     }
 
     // Create renderer
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
     if (renderer == NULL) {
         printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -416,10 +303,13 @@ int main(int argc, char* args[]) {
         return 1;
     }
 
-    // Create a surface for the pixel buffer (same size as the screen)
-    SDL_Surface* surface = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0, 0, 0, 0);
-    if (surface == NULL) {
-        printf("Surface could not be created! SDL_Error: %s\n", SDL_GetError());
+    // The frame is drawn into the staging buffer and copied once into a
+    // streaming texture that lives as long as the window size does. Locked
+    // texture memory may be write-only, and the rasterizer reads back what
+    // it drew, so it is never drawn into directly.
+    SDL_Texture* frameTexture = createFrameTexture(renderer);
+    Uint32* staging = malloc((size_t)SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+    if (frameTexture == NULL || staging == NULL) {
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         SDL_Quit();
@@ -438,7 +328,15 @@ int main(int argc, char* args[]) {
         printf("TTF_OpenFont: %s\n", TTF_GetError());
         return 1;
     }
-    Uint32* pixels = (Uint32*)surface->pixels;
+
+    // The font is only needed to fill the glyph atlas; text is drawn from it
+    GlyphAtlas glyphAtlas;
+    int atlasResult = buildGlyphAtlas(&glyphAtlas, font);
+    TTF_CloseFont(font);
+    if (atlasResult != 0) {
+        printf("Glyph atlas could not be built!\n");
+        return 1;
+    }
 
     Vec3D cubeVertices[8] = {
         {-0.5f, -0.5f, -0.5f},
@@ -463,15 +361,25 @@ int main(int argc, char* args[]) {
     Uint32 lastTime = SDL_GetTicks();
     int fps = 0;
 
+    // Frame pacing runs off the performance counter; --fps 0 leaves it
+    // uncapped so the real throughput shows in the FPS counter
+    Uint64 counterFrequency = SDL_GetPerformanceFrequency();
+    Uint64 frameTicks = targetFps > 0 ? counterFrequency / targetFps : 0;
+    Uint64 nextFrame = SDL_GetPerformanceCounter();
+    Uint64 busyTicks = 0;
+    float frameMs = 0.0f;
+    PhaseSummary phaseSummaries[PHASE_COUNT];
+    summarizePhases(phaseSummaries);
+
     SDL_Color textColor = {255, 255, 255, 255};
 
     // Main loop flag
     int quit = 0;
     SDL_Event e;
 
-    // Create particles
-    int particlesSpawned = 2;
+    // Create particles. The store grows past this as particles are spawned.
     int numParticles = 10000;
+    ParticleStore particles;
 
 
     int infoBoxWidth = 350;
@@ -479,33 +387,69 @@ int main(int argc, char* args[]) {
 
     int cubeEdges = 12;
 
-    Uint32 startTicks, endTicks;
-
-    Particle* particles = (Particle*)malloc(numParticles * sizeof(Particle));
-
-
-
-    if (particles == NULL) {
+    if (initParticleStore(&particles, numParticles) != 0) {
     fprintf(stderr, "Memory allocation failed!\n");
     return 1;
     }
 
 
-    for (int i = 0; i <  particlesSpawned; i++) {
-	    createParticle(&particles[i], 2.0f, generateRandomColor());
-        if (i > 0) {
-            particles[i-1].next = &particles[i];
+    if (loadAtStart) {
+        SceneSettings settings;
+        if (loadCheckpoint(checkpointPath, &particles, &settings) != 0) {
+            return 1;
+        }
+        camera = settings.camera;
+        gravity = settings.gravity;
+        lightDir = settings.lightDir;
+        lightIntensity = settings.lightIntensity;
+    } else if (activeReplay != NULL) {
+        if (readReplayStep(activeReplay, &particles) <= 0) {
+            fprintf(stderr, "%s has no steps to replay\n", replayPath);
+            return 1;
         }
+    } else if (spawnParticles(&particles, particlesSpawned, 2.0f, 0.1f) < 0) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
     }
 
-    particles[particlesSpawned-1].next =  &particles[0];
+    // The selection is kept by id, since spawning and despawning move
+    // particles to other indices
+    int selectedParticle = 0;
+    int selectedId = particles.count > 0 ? particles.id[0] : -1;
+
+    // From here on the simulation thread owns 'particles'; this thread only
+    // draws snapshots of it and posts requests
+    float* interpolatedX = NULL;
+    float* interpolatedY = NULL;
+    float* interpolatedZ = NULL;
+    int interpolatedCapacity = 0;
+    Recorder recorder;
+    Recorder* activeRecorder = NULL;
+    if (recordPath != NULL) {
+        if (startRecorder(&recorder, recordPath, deltaTime) != 0) return 1;
+        activeRecorder = &recorder;
+    }
+    SimThread sim;
+    if (startSimThread(&sim, &particles, deltaTime, activeRecorder, activeReplay) != 0) {
+        fprintf(stderr, "Could not start the simulation!\n");
+        return 1;
+    }
+    const SimSnapshot* snapshot = acquireSnapshot(&sim);
 
-    Particle* selectedParticle = &particles[0];
+    ViewTransform view;
+    ProjectedParticles projected;
+    initProjectedParticles(&projected);
+    // Whether 'projected' was built from 'snapshot', so clicks can be picked
+    // against it
+    bool projectionCurrent = false;
+    DepthBuffer depthBuffer;
+    initDepthBuffer(&depthBuffer);
 
-    Particle* head = &particles[0];
     // Main loop
     while (!quit) {
         startTime = SDL_GetTicks();
+        Uint64 frameStart = SDL_GetPerformanceCounter();
+        double phaseStart = secondsNow();
 
       	while (SDL_PollEvent(&e) != 0) {
             if (e.type == SDL_QUIT) {
@@ -542,31 +486,70 @@ int main(int argc, char* args[]) {
 		    case SDLK_z:
 			moveCamera(&camera, 0.0f, 0.0f, 0.1f);  // Move down
 			break;
-		    case SDLK_g:
-			if(gravity == 0.0f){
-			    gravity = 0.1f;
-			}
-			else {
-		            gravity = 0.0f;
-			}
-                        break;			
+		    case SDLK_g:  // Toggle gravity on the simulation thread
+			atomic_fetch_add(&sim.gravityToggles, 1);
+                        break;
 	            case SDLK_p:  // Spawn particle
-		       	createParticle(&particles[particlesSpawned], 2.0f, generateRandomColor());
-			addParticle(&head, &particles[particlesSpawned]);
-			particlesSpawned++;
+			atomic_fetch_add(&sim.spawnRequests, 1);
 		       	break;
+		    case SDLK_m:  // Spawn a batch of particles
+			atomic_fetch_add(&sim.spawnRequests, BULK_SPAWN);
+			break;
+		    case SDLK_x:  // Despawn the selected particle
+			if (selectedId >= 0) {
+			    atomic_store(&sim.despawnRequest, selectedId);
+			    selectedId = -1;
+			}
+			break;
+		    case SDLK_b:
+			atomic_fetch_add(&sim.broadPhaseToggles, 1);
+			break;
+		    case SDLK_i:
+			interpolate = !interpolate;
+			break;
+		    case SDLK_k:  // Save a checkpoint
+		    case SDLK_l:  // Load the checkpoint
+			if (runCheckpoint(&sim, &particles, deltaTime, &camera, checkpointPath, e.key.keysym.sym == SDLK_l,
+			                  activeRecorder, activeReplay) != 0 &&
+			    !atomic_load(&sim.running)) {
+			    fprintf(stderr, "Could not restart the simulation!\n");
+			    quit = 1;
+			    break;
+			}
+			// The last frame's projection indexes the snapshot just replaced
+			snapshot = acquireSnapshot(&sim);
+			projectionCurrent = false;
+			break;
 		    case SDLK_ESCAPE:
 			paused = !paused;
+			atomic_store(&sim.paused, paused);
+			break;
+		    case SDLK_o:
+			showProfile = !showProfile;
+			break;
+		    case SDLK_c:  // Dump the phase timings for offline comparison
+			if (writeProfileCsv(profilePath) == 0) printf("Wrote phase timings to %s\n", profilePath);
 			break;
-		    case SDLK_n:
-			selectedParticle = selectedParticle->next;
+		    case SDLK_n:  // Select the live particle with the next id
+			// Ids, unlike indices, keep their order when the storage is reordered
+			for (int offset = 1; offset <= snapshot->particles.idCount; offset++) {
+			    int id = (selectedId + offset) % snapshot->particles.idCount;
+			    if (findParticle(&snapshot->particles, id) >= 0) {
+				selectedId = id;
+				break;
+			    }
+			}
 	                break;
 		}
             }
 	  else if (e.type == SDL_MOUSEBUTTONDOWN) {
 		    int mouseX, mouseY;
 	    	    SDL_GetMouseState(&mouseX, &mouseY);
-		    selectedParticle = handleMouseClick(mouseX, mouseY, particles, numParticles, camera);
+		    if (projectionCurrent) {
+			selectedParticle = handleMouseClick(mouseX, mouseY, &snapshot->particles, &projected);
+			if (selectedParticle >= snapshot->particles.count) selectedParticle = -1;
+			selectedId = selectedParticle >= 0 ? snapshot->particles.id[selectedParticle] : -1;
+		    }
 	    }
 
 	  else if (e.type == SDL_WINDOWEVENT) {
@@ -574,74 +557,151 @@ int main(int argc, char* args[]) {
                 SCREEN_WIDTH = e.window.data1;
                 SCREEN_HEIGHT = e.window.data2;
 
-		surface = SDL_GetWindowSurface(window);
-
-                pixels = (Uint32*)surface->pixels;
+                // Only a resize pays for a new texture
+                SDL_DestroyTexture(frameTexture);
+                frameTexture = createFrameTexture(renderer);
+                Uint32* resized = realloc(staging, (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+                if (frameTexture == NULL || resized == NULL) {
+                    quit = 1;
+                    break;
+                }
+                staging = resized;
             }
         }
 
 	
         }
 
-        SDL_FillRect(surface, NULL, 0x00000000);
+        if (quit) break;
+        phaseStart = endPhase(PHASE_EVENTS, phaseStart);
 
+        Uint32* pixels = staging;
+        memset(pixels, 0, (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+        double uploadSeconds = secondsNow() - phaseStart;
+        phaseStart += uploadSeconds;
 
-        Uint32 color = (255 << 24) | (255 << 16) | (255 << 8) | 255;  // White
 
+        Uint32 color = (255 << 24) | (255 << 16) | (255 << 8) | 255;  // White
 
-        for (int lineNumber = 0; lineNumber < cubeEdges; lineNumber++) {
-            drawLine3D(pixels, camera, cubeVertices[edges[lineNumber][0]], cubeVertices[edges[lineNumber][1]], color);
+        // Draw the newest simulation state, blended between its last two
+        // steps unless interpolation is off. The blended view shares the
+        // snapshot's radius and color arrays.
+        snapshot = acquireSnapshot(&sim);
+        ParticleStore frameParticles = snapshot->particles;
+        if (interpolate && interpolatedCapacity < frameParticles.capacity) {
+            int capacity = frameParticles.capacity;
+            float* x = realloc(interpolatedX, capacity * sizeof(float));
+            if (x != NULL) interpolatedX = x;
+            float* y = realloc(interpolatedY, capacity * sizeof(float));
+            if (y != NULL) interpolatedY = y;
+            float* z = realloc(interpolatedZ, capacity * sizeof(float));
+            if (z != NULL) interpolatedZ = z;
+            if (x != NULL && y != NULL && z != NULL) interpolatedCapacity = capacity;
         }
+        if (interpolate && interpolatedCapacity >= frameParticles.capacity) {
+            interpolateSnapshot(snapshot, secondsNow(), interpolatedX, interpolatedY, interpolatedZ);
+            frameParticles.px = interpolatedX;
+            frameParticles.py = interpolatedY;
+            frameParticles.pz = interpolatedZ;
+        }
+        selectedParticle = findParticle(&frameParticles, selectedId);
 
+        // The camera is fixed for the rest of the frame, so project everything once
+        buildViewTransform(&view, camera);
+        transformParticles(&projected, &view, &frameParticles);
+        projectionCurrent = true;
 
-//	startTicks = SDL_GetTicks();
-	renderParticles(pixels, camera, particles, particlesSpawned);
-
-//	endTicks = SDL_GetTicks();
-//	printf("Rendering took %d ms\n", endTicks - startTicks);
-
-         if (selectedParticle->next != NULL) {
-                drawBoxOutline(pixels, SCREEN_WIDTH-infoBoxWidth -10, 10, infoBoxWidth, infoBoxHeight, selectedParticle->color, 5);
+        double linesStart = secondsNow();
+        for (int lineNumber = 0; lineNumber < cubeEdges; lineNumber++) {
+            drawLine3D(pixels, &view, cubeVertices[edges[lineNumber][0]], cubeVertices[edges[lineNumber][1]], color);
         }
+        double linesEnd = endPhase(PHASE_LINES, linesStart);
 
-	if(!paused){
-//		startTicks = SDL_GetTicks();
-		updateParticles(particles, particlesSpawned, 0.016f);
-//		endTicks = SDL_GetTicks();
-//		printf("Physics update took %d ms\n", endTicks - startTicks);
-	}
-        SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
+	renderParticles(pixels, &depthBuffer, camera, &frameParticles, &projected);
+        // Interpolation and projection before the lines count as particle work
+        double particlesEnd = secondsNow();
+        recordPhase(PHASE_PARTICLES, (linesStart - phaseStart) + (particlesEnd - linesEnd));
+        phaseStart = particlesEnd;
 
-        SDL_DestroyTexture(texture);
+         if (selectedParticle >= 0) {
+                drawBoxOutline(pixels, SCREEN_WIDTH-infoBoxWidth -10, 10, infoBoxWidth, infoBoxHeight, frameParticles.color[selectedParticle], 5);
+        }
 
 	frameCount++;
         endTime = SDL_GetTicks();
         if (endTime - lastTime >= 1000) {
             fps = frameCount;
+            // Average time spent working per frame, not counting the pacing sleep
+            frameMs = (float)(busyTicks * 1000.0 / counterFrequency / frameCount);
             frameCount = 0;
+            busyTicks = 0;
             lastTime = endTime;
+            summarizePhases(phaseSummaries);
 	}
-	renderCounts(renderer, font, fps, particlesSpawned);
-
 
-// for some reason text must go later
-	if (selectedParticle->next != NULL) {
-                displayParticleInfo(renderer, font, *selectedParticle, SCREEN_WIDTH-infoBoxWidth -10, 10);
+        // Text is blended into the frame itself, so it goes in before upload
+	renderCounts(pixels, &glyphAtlas, fps, frameMs, snapshot->stepsPerSecond, frameParticles.count,
+                     snapshot->sleepingParticles);
+	if (showProfile) {
+            renderProfile(pixels, &glyphAtlas, phaseSummaries);
         }
-
-
+	if (selectedParticle >= 0) {
+                displayParticleInfo(pixels, &glyphAtlas, &frameParticles, selectedParticle, SCREEN_WIDTH-infoBoxWidth -10, 10);
+        }
+        phaseStart = endPhase(PHASE_TEXT, phaseStart);
+
+        // The texture is only locked for the copy, and only written
+        void* locked = NULL;
+        int pitch = 0;
+        if (SDL_LockTexture(frameTexture, NULL, &locked, &pitch) == 0) {
+            for (int row = 0; row < SCREEN_HEIGHT; row++) {
+                memcpy((Uint8*)locked + (size_t)row * pitch, staging + (size_t)row * SCREEN_WIDTH, SCREEN_WIDTH * sizeof(Uint32));
+            }
+            SDL_UnlockTexture(frameTexture);
+        } else {
+            SDL_UpdateTexture(frameTexture, NULL, staging, SCREEN_WIDTH * sizeof(Uint32));
+        }
+        double uploadEnd = secondsNow();
+        recordPhase(PHASE_UPLOAD, uploadSeconds + (uploadEnd - phaseStart));
+        SDL_RenderCopy(renderer, frameTexture, NULL, NULL);
         SDL_RenderPresent(renderer);
-
-        SDL_Delay(16);
+        endPhase(PHASE_PRESENT, uploadEnd);
+        busyTicks += SDL_GetPerformanceCounter() - frameStart;
+
+        // Sleep until this frame's slot is over. A frame that ran more than a
+        // whole slot late restarts the schedule rather than rushing to catch up.
+        if (frameTicks > 0) {
+            nextFrame += frameTicks;
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (now < nextFrame) {
+                SDL_Delay((Uint32)((nextFrame - now) * 1000 / counterFrequency));
+            } else if (now - nextFrame > frameTicks) {
+                nextFrame = now;
+            }
+        }
     }
 
-    TTF_CloseFont(font);
+    freeGlyphAtlas(&glyphAtlas);
+    SDL_DestroyTexture(frameTexture);
+    free(staging);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     TTF_Quit();
     SDL_Quit();
-    free(particles);
+    stopSimThread(&sim);
+    if (activeRecorder != NULL) stopRecorder(activeRecorder);
+    if (activeReplay != NULL) closeReplay(activeReplay);
+    free(interpolatedX);
+    free(interpolatedY);
+    free(interpolatedZ);
+    freeMorton();
+    freePhysics();
+    freeRaster();
+    freeProjectedParticles(&projected);
+    freeDepthBuffer(&depthBuffer);
+    freeSphereSprites();
+    stopThreadPool();
+    freeParticleStore(&particles);
     return 0;
 }
 
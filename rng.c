@@ -0,0 +1,25 @@
+// rng.c
+
+#include "rng.h"
+
+#define GOLDEN_GAMMA 0x9E3779B97F4A7C15ull
+
+static uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Function to return 64 random bits for draw 'counter' of the stream 'seed'.
+// This is SplitMix64 evaluated at position 'counter' directly: the state after
+// n steps is start + n * gamma, and the output is that state run through the
+// SplitMix64 finalizer. The start is the seed mixed first, so nearby seeds
+// don't give shifted copies of the same stream.
+uint64_t randomBits(uint64_t seed, uint64_t counter) {
+    return mix64(mix64(seed) + (counter + 1) * GOLDEN_GAMMA);
+}
+
+// Function to return a float in [0, 1) with 24 random bits
+float randomUnit(uint64_t seed, uint64_t counter) {
+    return (float)(randomBits(seed, counter) >> 40) * (1.0f / 16777216.0f);
+}
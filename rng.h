@@ -0,0 +1,14 @@
+// rng.h
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Counter-based random numbers: each draw is a pure function of a seed and a
+// counter, so draws can be made in any order, on any thread, and always come
+// out the same. There is no generator state to share or lock.
+uint64_t randomBits(uint64_t seed, uint64_t counter);
+float randomUnit(uint64_t seed, uint64_t counter);
+
+#endif // RNG_H
@@ -0,0 +1,325 @@
+// simthread.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simthread.h"
+#include "threadpool.h"
+#include "physics.h"
+#include "nbody.h"
+#include "morton.h"
+#include "profiler.h"
+#include "sleep.h"
+#include "timer.h"
+
+// Marks the shared slot as published but not yet picked up by the reader
+#define SNAPSHOT_FRESH 4
+// A slow step can't make the next update run more than this many steps to
+// catch up; past that the simulation falls behind real time instead
+#define MAX_STEPS_PER_UPDATE 8
+
+// Same settings the render keys have always used
+#define SPAWN_VELOCITY 2.0f
+#define SPAWN_MAX_RADIUS 0.1f
+#define TOGGLED_GRAVITY 0.1f
+
+static void freeSnapshot(SimSnapshot* snapshot) {
+    freeParticleStore(&snapshot->particles);
+    free(snapshot->previousX);
+    free(snapshot->previousY);
+    free(snapshot->previousZ);
+    snapshot->previousX = NULL;
+    snapshot->previousY = NULL;
+    snapshot->previousZ = NULL;
+}
+
+static int reserveSnapshot(SimSnapshot* snapshot, int capacity) {
+    if (snapshot->previousX != NULL && snapshot->particles.capacity >= capacity) return 0;
+
+    freeSnapshot(snapshot);
+    if (initParticleStore(&snapshot->particles, capacity) != 0) return -1;
+    snapshot->previousX = malloc(capacity * sizeof(float));
+    snapshot->previousY = malloc(capacity * sizeof(float));
+    snapshot->previousZ = malloc(capacity * sizeof(float));
+    if (snapshot->previousX == NULL || snapshot->previousY == NULL || snapshot->previousZ == NULL) {
+        freeSnapshot(snapshot);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to copy the current state into the back slot and swap it into the
+// shared one. 'stepped' says whether the saved previous positions belong to
+// this state; if not, the snapshot has no motion to interpolate.
+static int publishSnapshot(SimThread* sim, bool stepped, long long step, float stepsPerSecond) {
+    SnapshotBuffer* buffer = &sim->snapshots;
+    SimSnapshot* snapshot = &buffer->slots[buffer->back];
+    const ParticleStore* particles = sim->particles;
+    if (reserveSnapshot(snapshot, particles->capacity) != 0) return -1;
+
+    size_t bytes = particles->count * sizeof(float);
+    memcpy(snapshot->particles.px, particles->px, bytes);
+    memcpy(snapshot->particles.py, particles->py, bytes);
+    memcpy(snapshot->particles.pz, particles->pz, bytes);
+    memcpy(snapshot->particles.vx, particles->vx, bytes);
+    memcpy(snapshot->particles.vy, particles->vy, bytes);
+    memcpy(snapshot->particles.vz, particles->vz, bytes);
+    memcpy(snapshot->particles.radius, particles->radius, bytes);
+    memcpy(snapshot->particles.color, particles->color, particles->count * sizeof(uint32_t));
+    memcpy(snapshot->particles.id, particles->id, particles->count * sizeof(int));
+    memcpy(snapshot->particles.slotOfId, particles->slotOfId, particles->idCount * sizeof(int));
+    snapshot->particles.count = particles->count;
+    snapshot->particles.idCount = particles->idCount;
+    memcpy(snapshot->previousX, stepped ? sim->previousX : particles->px, bytes);
+    memcpy(snapshot->previousY, stepped ? sim->previousY : particles->py, bytes);
+    memcpy(snapshot->previousZ, stepped ? sim->previousZ : particles->pz, bytes);
+    snapshot->time = secondsNow();
+    snapshot->deltaTime = sim->deltaTime;
+    snapshot->step = step;
+    snapshot->stepsPerSecond = stepsPerSecond;
+    snapshot->sleepingParticles = sim->replay == NULL ? physicsStats.sleepingParticles : 0;
+
+    buffer->back = atomic_exchange(&buffer->shared, buffer->back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+    return 0;
+}
+
+// Function to return the newest published snapshot. Only one thread may read.
+// The snapshot stays valid until the next call.
+const SimSnapshot* acquireSnapshot(SimThread* sim) {
+    SnapshotBuffer* buffer = &sim->snapshots;
+    if (atomic_load(&buffer->shared) & SNAPSHOT_FRESH) {
+        buffer->front = atomic_exchange(&buffer->shared, buffer->front) & ~SNAPSHOT_FRESH;
+    }
+    return &buffer->slots[buffer->front];
+}
+
+// Function to fill x, y and z with the positions 'now' would show, blending
+// from the previous step to the snapshot's as a step's worth of time passes
+// after it was published. Drawing these lags the simulation by up to one step
+// but moves smoothly at any frame rate.
+void interpolateSnapshot(const SimSnapshot* snapshot, double now, float* x, float* y, float* z) {
+    float alpha = snapshot->deltaTime > 0.0f ? (float)((now - snapshot->time) / snapshot->deltaTime) : 1.0f;
+    if (alpha < 0.0f) alpha = 0.0f;
+    if (alpha > 1.0f) alpha = 1.0f;
+
+    const ParticleStore* particles = &snapshot->particles;
+    for (int i = 0; i < particles->count; i++) {
+        x[i] = snapshot->previousX[i] + (particles->px[i] - snapshot->previousX[i]) * alpha;
+        y[i] = snapshot->previousY[i] + (particles->py[i] - snapshot->previousY[i]) * alpha;
+        z[i] = snapshot->previousZ[i] + (particles->pz[i] - snapshot->previousZ[i]) * alpha;
+    }
+}
+
+// Function to carry out what other threads asked for since the last update.
+// Returns true if the particles changed.
+static bool applyRequests(SimThread* sim) {
+    ParticleStore* particles = sim->particles;
+    bool changed = false;
+
+    int spawns = atomic_exchange(&sim->spawnRequests, 0);
+    if (spawns > 0) {
+        if (spawnParticles(particles, spawns, SPAWN_VELOCITY, SPAWN_MAX_RADIUS) < 0) {
+            fprintf(stderr, "Out of memory spawning %d particles\n", spawns);
+        } else {
+            changed = true;
+        }
+    }
+    int index = findParticle(particles, atomic_exchange(&sim->despawnRequest, -1));
+    if (index >= 0) {
+        // Whatever rests on the particle has to be able to fall once it's gone
+        wakeIsland(particles, index);
+        removeParticle(particles, index);
+        changed = true;
+    }
+    if (atomic_exchange(&sim->gravityToggles, 0) % 2 != 0) {
+        gravity = gravity == 0.0f ? TOGGLED_GRAVITY : 0.0f;
+    }
+    if (atomic_exchange(&sim->broadPhaseToggles, 0) % 2 != 0) {
+        if (broadPhaseMode == BROADPHASE_GRID) {
+            broadPhaseMode = BROADPHASE_BRUTE_FORCE;
+            printf("Broad phase: brute force\n");
+        } else {
+            broadPhaseMode = BROADPHASE_GRID;
+            printf("Broad phase: grid (%d pairs missed vs brute force)\n", validateBroadPhase(particles));
+        }
+    }
+    return changed;
+}
+
+// Function to make the saved previous positions as large as the particle
+// store, which may have grown since the last step. Returns -1 if memory ran out.
+static int reservePrevious(SimThread* sim) {
+    int capacity = sim->particles->capacity;
+    if (sim->previousCapacity >= capacity) return 0;
+
+    float* x = realloc(sim->previousX, capacity * sizeof(float));
+    if (x != NULL) sim->previousX = x;
+    float* y = realloc(sim->previousY, capacity * sizeof(float));
+    if (y != NULL) sim->previousY = y;
+    float* z = realloc(sim->previousZ, capacity * sizeof(float));
+    if (z != NULL) sim->previousZ = z;
+    if (x == NULL || y == NULL || z == NULL) return -1;
+    sim->previousCapacity = capacity;
+    return 0;
+}
+
+// Function to advance the particles by one step: simulated and recorded, or
+// read from the replay, which starts over at the end. A damaged replay pauses
+// the simulation and returns false.
+static bool takeStep(SimThread* sim, long long step, bool layoutChanged) {
+    ParticleStore* particles = sim->particles;
+    if (sim->replay == NULL) {
+        updateParticles(particles, sim->deltaTime);
+        if (nbodyStrength > 0.0f) recordPhase(PHASE_FORCES, physicsStats.forceSeconds);
+        recordPhase(PHASE_INTEGRATE, physicsStats.integrateSeconds);
+        recordPhase(PHASE_BROAD_PHASE, physicsStats.broadPhaseSeconds);
+        recordPhase(PHASE_COLLISIONS, physicsStats.collisionSeconds);
+        if (sim->recorder != NULL) recordStep(sim->recorder, particles, step, layoutChanged);
+        return true;
+    }
+
+    int result = readReplayStep(sim->replay, particles);
+    if (result == 0) {
+        rewindReplay(sim->replay);
+        result = readReplayStep(sim->replay, particles);
+    }
+    if (result <= 0) {
+        atomic_store(&sim->paused, true);
+        return false;
+    }
+    return true;
+}
+
+// Fixed timestep loop: real time goes into an accumulator that is spent in
+// whole steps of 'deltaTime', so the simulation runs at the same rate however
+// fast or slow the render loop is
+static void* simMain(void* arg) {
+    SimThread* sim = arg;
+    ParticleStore* particles = sim->particles;
+    float deltaTime = sim->deltaTime;
+    double previousTime = secondsNow();
+    double accumulator = 0.0;
+    double windowStart = previousTime;
+    long long windowSteps = 0;
+    long long step = 0;
+    float stepsPerSecond = 0.0f;
+    // The particles may have been replaced while the thread was stopped, so
+    // a recording restarts with a keyframe
+    bool layoutChanged = true;
+    useThreadPool(POOL_SIMULATION);
+
+    while (atomic_load(&sim->running)) {
+        double now = secondsNow();
+        accumulator += now - previousTime;
+        previousTime = now;
+
+        bool changed = sim->replay == NULL && applyRequests(sim);
+        layoutChanged = layoutChanged || changed;
+        if (atomic_load(&sim->paused)) accumulator = 0.0;
+
+        int steps = 0;
+        while (accumulator >= deltaTime && steps < MAX_STEPS_PER_UPDATE) {
+            // A replay keyframe may have grown the store during the last step
+            if (reservePrevious(sim) != 0) {
+                accumulator = 0.0;
+                break;
+            }
+            // Reorder between steps, before the positions to blend from are
+            // saved, so both sides of the blend use the new order. Snapshots
+            // carry slotOfId, so a selection held by id follows along.
+            long long next = step + steps + 1;
+            if (sim->replay == NULL && reorderInterval > 0 && next % reorderInterval == 0 &&
+                sortParticlesByMorton(particles) == 0) {
+                layoutChanged = true;
+            }
+            int count = particles->count;
+            size_t bytes = count * sizeof(float);
+            memcpy(sim->previousX, particles->px, bytes);
+            memcpy(sim->previousY, particles->py, bytes);
+            memcpy(sim->previousZ, particles->pz, bytes);
+            if (!takeStep(sim, step + steps + 1, layoutChanged)) {
+                accumulator = 0.0;
+                break;
+            }
+            layoutChanged = false;
+            // Replayed particles that changed count have nothing to blend from
+            if (particles->count != count && reservePrevious(sim) == 0) {
+                bytes = particles->count * sizeof(float);
+                memcpy(sim->previousX, particles->px, bytes);
+                memcpy(sim->previousY, particles->py, bytes);
+                memcpy(sim->previousZ, particles->pz, bytes);
+            }
+            accumulator -= deltaTime;
+            steps++;
+        }
+        if (steps == MAX_STEPS_PER_UPDATE) accumulator = 0.0;
+        step += steps;
+        windowSteps += steps;
+
+        if (now - windowStart >= 1.0) {
+            stepsPerSecond = (float)(windowSteps / (now - windowStart));
+            windowStart = now;
+            windowSteps = 0;
+        }
+
+        if (steps > 0 || changed) {
+            publishSnapshot(sim, steps > 0, step, stepsPerSecond);
+        } else {
+            sleepSeconds(deltaTime - accumulator);
+        }
+    }
+    return NULL;
+}
+
+// Function to hand 'particles' to a new simulation thread stepping every
+// 'deltaTime' seconds. Returns -1 if memory ran out or the thread could not
+// be started.
+int startSimThread(SimThread* sim, ParticleStore* particles, float deltaTime, Recorder* recorder, Replay* replay) {
+    memset(sim, 0, sizeof(*sim));
+    sim->particles = particles;
+    sim->deltaTime = deltaTime;
+    sim->recorder = recorder;
+    sim->replay = replay;
+    sim->previousCapacity = 0;
+    atomic_init(&sim->snapshots.shared, 1);
+    sim->snapshots.front = 0;
+    sim->snapshots.back = 2;
+    atomic_init(&sim->running, false);
+    atomic_init(&sim->paused, false);
+    atomic_init(&sim->spawnRequests, 0);
+    atomic_init(&sim->despawnRequest, -1);
+    atomic_init(&sim->gravityToggles, 0);
+    atomic_init(&sim->broadPhaseToggles, 0);
+
+    // Publish the starting state so the reader has something from frame one
+    if (reservePrevious(sim) != 0 || publishSnapshot(sim, false, 0, 0.0f) != 0) {
+        stopSimThread(sim);
+        return -1;
+    }
+    atomic_store(&sim->running, true);
+    if (pthread_create(&sim->thread, NULL, simMain, sim) != 0) {
+        fprintf(stderr, "Could not start the simulation thread\n");
+        atomic_store(&sim->running, false);
+        stopSimThread(sim);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to stop the thread and free the snapshots. The particles are the
+// caller's again afterwards.
+void stopSimThread(SimThread* sim) {
+    if (atomic_load(&sim->running)) {
+        atomic_store(&sim->running, false);
+        pthread_join(sim->thread, NULL);
+    }
+    for (int slot = 0; slot < 3; slot++) {
+        freeSnapshot(&sim->snapshots.slots[slot]);
+    }
+    free(sim->previousX);
+    free(sim->previousY);
+    free(sim->previousZ);
+    sim->previousX = NULL;
+    sim->previousY = NULL;
+    sim->previousZ = NULL;
+}
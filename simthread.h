@@ -0,0 +1,64 @@
+// simthread.h
+
+#ifndef SIMTHREAD_H
+#define SIMTHREAD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "particle.h"
+#include "trajectory.h"
+
+// Copy of the simulation after a step, for the render thread to draw from
+typedef struct {
+    ParticleStore particles;
+    float* previousX;  // Positions one step earlier, for interpolation
+    float* previousY;
+    float* previousZ;
+    double time;           // secondsNow() when it was published
+    float deltaTime;       // Timestep between 'previous' and 'particles'
+    long long step;
+    float stepsPerSecond;  // Measured over the last second
+    int sleepingParticles; // Asleep after the step, 0 in a replay
+} SimSnapshot;
+
+// Three snapshots: the writer fills 'back', the reader draws 'front', and the
+// third is handed between them through 'shared' with a single atomic exchange,
+// so neither side ever waits for the other.
+typedef struct {
+    SimSnapshot slots[3];
+    atomic_int shared;  // Slot index, plus SNAPSHOT_FRESH if not yet read
+    int back;
+    int front;
+} SnapshotBuffer;
+
+// Runs updateParticles on its own thread at a fixed timestep. The thread owns
+// 'particles' while it runs; other threads only read snapshots and post
+// requests through the atomic fields. With a recorder every step is recorded;
+// with a replay the steps are read from it instead of simulated, and requests
+// are ignored.
+typedef struct {
+    ParticleStore* particles;
+    float deltaTime;
+    SnapshotBuffer snapshots;
+    float* previousX;
+    float* previousY;
+    float* previousZ;
+    int previousCapacity;
+    Recorder* recorder;
+    Replay* replay;
+    pthread_t thread;
+    atomic_bool running;
+    atomic_bool paused;
+    atomic_int spawnRequests;
+    atomic_int despawnRequest;  // Id of a particle to remove, or -1
+    atomic_int gravityToggles;
+    atomic_int broadPhaseToggles;
+} SimThread;
+
+int startSimThread(SimThread* sim, ParticleStore* particles, float deltaTime, Recorder* recorder, Replay* replay);
+void stopSimThread(SimThread* sim);
+const SimSnapshot* acquireSnapshot(SimThread* sim);
+void interpolateSnapshot(const SimSnapshot* snapshot, double now, float* x, float* y, float* z);
+
+#endif // SIMTHREAD_H
@@ -0,0 +1,386 @@
+// sleep.c
+//
+// Particles that stay slow for SLEEP_STEPS steps fall asleep in islands:
+// groups of settling particles joined by contacts, which only fall asleep
+// together and only once nothing still moving touches them. A sleeping
+// particle is not integrated, and its pairs with other sleeping particles are
+// not tested. A slow particle that comes to rest on a sleeping one is pushed
+// out of it without moving it; anything faster wakes the whole island.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sleep.h"
+#include "physics.h"
+#include "threadpool.h"
+
+// Speed a particle may keep and still count as slow when there is no gravity
+#define SLEEP_SPEED 0.05f
+// Steps of gravity a particle held up by a contact picks up before the
+// contact pushes it back, which it may keep on top of SLEEP_SPEED
+#define HELD_GRAVITY_STEPS 2.0f
+// Rebounds off the floor no faster than this many steps of gravity are
+// resting contact rather than a bounce
+#define RESTING_GRAVITY_STEPS 4.0f
+
+#define CONTACT_BLOCKED -1
+#define CONTACT_WAKE -2
+
+// Particles each thread pool task checks for rest
+#define SLEEP_GRAIN 4096
+
+static ContactList contacts[MAX_THREADS];
+static float sleepSpeedSquared;
+static float sleepGravity;
+// Particles asleep or settling after the last step; while there are none the
+// collision pass has nothing to record
+static int watchedParticles;
+
+// Union-find over particle ids and island labels, and a flag per node
+static int* parent;
+static bool* flagged;
+static int nodeCapacity;
+
+// Function to start a step under 'gravity': set the speed that counts as
+// slow and empty every worker's contacts
+void beginSleepStep(float gravity) {
+    float sleepSpeed = SLEEP_SPEED + HELD_GRAVITY_STEPS * fabsf(gravity);
+    sleepSpeedSquared = sleepSpeed * sleepSpeed;
+    sleepGravity = gravity;
+    for (int worker = 0; worker < MAX_THREADS; worker++) {
+        contacts[worker].count = 0;
+        contacts[worker].failed = false;
+    }
+}
+
+// Function to return the contact list collideSleeping should fill on 'worker'
+ContactList* workerContacts(int worker) {
+    return &contacts[worker];
+}
+
+// Returns true if the collision pass has to use collideSleeping this step.
+// Otherwise no particle is asleep or close to falling asleep, and plain
+// handleParticleCollision does the same work.
+bool sleepWatchesPairs(void) {
+    return watchedParticles > 0;
+}
+
+static bool isSlow(const ParticleStore* store, int i) {
+    float vx = store->vx[i];
+    float vy = store->vy[i];
+    float vz = store->vz[i];
+    return vx * vx + vy * vy + vz * vz <= sleepSpeedSquared;
+}
+
+// An awake particle that falls asleep at the end of this step if it stays slow
+static bool isSettling(const ParticleStore* store, int i) {
+    return store->restSteps[i] >= SLEEP_STEPS - 1;
+}
+
+static void addContact(ContactList* list, int a, int b) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+        int* nodes = realloc(list->nodes, (size_t)capacity * 2 * sizeof(int));
+        if (nodes == NULL) {
+            list->failed = true;
+            return;
+        }
+        list->nodes = nodes;
+        list->capacity = capacity;
+    }
+    list->nodes[2 * list->count] = a;
+    list->nodes[2 * list->count + 1] = b;
+    list->count++;
+}
+
+// Function to push awake particle 'i' out of sleeping particle 'j' without
+// moving j, and stop i moving any further into it. Returns false if they
+// aren't touching.
+static bool restAgainst(ParticleStore* store, int i, int j) {
+    float dx = store->px[j] - store->px[i];
+    float dy = store->py[j] - store->py[i];
+    float dz = store->pz[j] - store->pz[i];
+    float distanceSquared = dx * dx + dy * dy + dz * dz;
+    float radiusSum = store->radius[i] + store->radius[j];
+    if (distanceSquared > radiusSum * radiusSum) return false;
+
+    float distance = sqrtf(distanceSquared);
+    if (distance > 0.0f) {
+        float nx = dx / distance;
+        float ny = dy / distance;
+        float nz = dz / distance;
+        float overlap = radiusSum - distance;
+        store->px[i] -= nx * overlap;
+        store->py[i] -= ny * overlap;
+        store->pz[i] -= nz * overlap;
+        float inward = store->vx[i] * nx + store->vy[i] * ny + store->vz[i] * nz;
+        if (inward > 0.0f) {
+            store->vx[i] -= inward * nx;
+            store->vy[i] -= inward * ny;
+            store->vz[i] -= inward * nz;
+        }
+    }
+    return true;
+}
+
+// Pair callback for the collision pass when particles may sleep. 'contacts'
+// is the ContactList of the worker running it. Only writes particles i and j,
+// so it is safe wherever handleParticleCollision is.
+bool collideSleeping(ParticleStore* store, int i, int j, void* contacts) {
+    ContactList* list = contacts;
+    bool asleepI = store->island[i] >= 0;
+    bool asleepJ = store->island[j] >= 0;
+    if (asleepI && asleepJ) return false;
+
+    if (!asleepI && !asleepJ) {
+        // Collisions don't change restSteps, so it can be read afterwards
+        if (!handleParticleCollision(store, i, j)) return false;
+        bool settlingI = isSettling(store, i);
+        bool settlingJ = isSettling(store, j);
+        if (settlingI && settlingJ) {
+            addContact(list, store->id[i], store->id[j]);
+        } else if (settlingI) {
+            addContact(list, store->id[i], CONTACT_BLOCKED);
+        } else if (settlingJ) {
+            addContact(list, store->id[j], CONTACT_BLOCKED);
+        }
+        return true;
+    }
+
+    int awake = asleepI ? j : i;
+    int sleeping = asleepI ? i : j;
+    if (!isSlow(store, awake)) {
+        // The swept test in handleParticleCollision catches it passing through
+        if (!handleParticleCollision(store, i, j)) return false;
+        addContact(list, store->island[sleeping], CONTACT_WAKE);
+        return true;
+    }
+    if (!restAgainst(store, awake, sleeping)) return false;
+    if (isSettling(store, awake)) addContact(list, store->id[awake], store->island[sleeping]);
+    return true;
+}
+
+// Function to make the node arrays cover every id. Returns -1 if memory ran out.
+static int reserveNodes(int count) {
+    if (count <= nodeCapacity) return 0;
+    int* grownParent = realloc(parent, (size_t)count * sizeof(int));
+    if (grownParent != NULL) parent = grownParent;
+    bool* grownFlagged = realloc(flagged, (size_t)count * sizeof(bool));
+    if (grownFlagged != NULL) flagged = grownFlagged;
+    if (grownParent == NULL || grownFlagged == NULL) return -1;
+    memset(flagged + nodeCapacity, 0, (size_t)(count - nodeCapacity) * sizeof(bool));
+    nodeCapacity = count;
+    return 0;
+}
+
+static int findRoot(int node) {
+    while (parent[node] != node) {
+        parent[node] = parent[parent[node]];
+        node = parent[node];
+    }
+    return node;
+}
+
+// The smaller node becomes the root, so the islands and their labels come out
+// the same whatever order the workers found the contacts in
+static void joinNodes(int a, int b) {
+    a = findRoot(a);
+    b = findRoot(b);
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+// Function to wake every island a fast particle ran into this step
+static void wakeHitIslands(ParticleStore* store) {
+    int hits = 0;
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        const ContactList* list = &contacts[worker];
+        for (int e = 0; e < list->count; e++) {
+            if (list->nodes[2 * e + 1] == CONTACT_WAKE) {
+                flagged[list->nodes[2 * e]] = true;
+                hits++;
+            }
+        }
+    }
+    if (hits == 0) return;
+
+    for (int i = 0; i < store->count; i++) {
+        if (store->island[i] >= 0 && flagged[store->island[i]]) wakeParticles(store, i, i + 1);
+    }
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        const ContactList* list = &contacts[worker];
+        for (int e = 0; e < list->count; e++) {
+            if (list->nodes[2 * e + 1] == CONTACT_WAKE) flagged[list->nodes[2 * e]] = false;
+        }
+    }
+}
+
+typedef struct {
+    ParticleStore* store;
+    int awake[MAX_THREADS];
+    int sleeping[MAX_THREADS];
+    int settling[MAX_THREADS];
+    int settled[MAX_THREADS];
+} RestContext;
+
+// Function to count the steps each awake particle has stayed slow. A
+// particle on the floor that only rebounds because of the last step of
+// gravity is stopped there; the wall bounce hands it that step back every
+// time, so it would never come to rest otherwise.
+static void restTask(void* context, int begin, int end, int worker) {
+    RestContext* rest = context;
+    ParticleStore* store = rest->store;
+    float restingSpeed = RESTING_GRAVITY_STEPS * fabsf(sleepGravity);
+    int awake = 0;
+    int sleeping = 0;
+    int settling = 0;
+    int settled = 0;
+
+    for (int i = begin; i < end; i++) {
+        if (store->island[i] >= 0) {
+            sleeping++;
+            continue;
+        }
+        awake++;
+        if (sleepGravity > 0.0f && store->py[i] >= 0.5f && store->vy[i] < 0.0f && -store->vy[i] <= restingSpeed) {
+            store->vy[i] = 0.0f;
+        } else if (sleepGravity < 0.0f && store->py[i] <= -0.5f && store->vy[i] > 0.0f && store->vy[i] <= restingSpeed) {
+            store->vy[i] = 0.0f;
+        }
+        if (!isSlow(store, i)) {
+            store->restSteps[i] = 0;
+            continue;
+        }
+        if (store->restSteps[i] < SLEEP_STEPS) store->restSteps[i]++;
+        if (isSettling(store, i)) settling++;
+        if (store->restSteps[i] == SLEEP_STEPS) settled++;
+    }
+    rest->awake[worker] += awake;
+    rest->sleeping[worker] += sleeping;
+    rest->settling[worker] += settling;
+    rest->settled[worker] += settled;
+}
+
+// Function to put to sleep every island whose awake members have all
+// settled and that touches nothing still moving. Returns how many particles
+// fell asleep.
+static int fallAsleep(ParticleStore* store) {
+    for (int node = 0; node < store->idCount; node++) {
+        parent[node] = node;
+        flagged[node] = false;
+    }
+    bool joined = false;
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        const ContactList* list = &contacts[worker];
+        for (int e = 0; e < list->count; e++) {
+            if (list->nodes[2 * e + 1] >= 0) {
+                joinNodes(list->nodes[2 * e], list->nodes[2 * e + 1]);
+                joined = true;
+            }
+        }
+    }
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        const ContactList* list = &contacts[worker];
+        for (int e = 0; e < list->count; e++) {
+            if (list->nodes[2 * e + 1] == CONTACT_BLOCKED) flagged[findRoot(list->nodes[2 * e])] = true;
+        }
+    }
+    for (int i = 0; i < store->count; i++) {
+        if (store->island[i] < 0 && store->restSteps[i] < SLEEP_STEPS) flagged[findRoot(store->id[i])] = true;
+    }
+
+    int fellAsleep = 0;
+    for (int i = 0; i < store->count; i++) {
+        if (store->island[i] >= 0 || store->restSteps[i] < SLEEP_STEPS) continue;
+        int root = findRoot(store->id[i]);
+        if (flagged[root]) continue;
+        store->island[i] = root;
+        store->vx[i] = 0.0f;
+        store->vy[i] = 0.0f;
+        store->vz[i] = 0.0f;
+        fellAsleep++;
+    }
+    // Islands joined through a new contact share a label from now on, so
+    // waking one wakes them all
+    if (joined) {
+        for (int i = 0; i < store->count; i++) {
+            if (store->island[i] >= 0) store->island[i] = findRoot(store->island[i]);
+        }
+    }
+    for (int node = 0; node < store->idCount; node++) {
+        flagged[node] = false;
+    }
+    return fellAsleep;
+}
+
+// Function to finish a step after the collision pass: wake the islands that
+// were hit, count how long each particle has been slow and put the settled
+// islands to sleep. Reports how many particles are awake and asleep.
+void updateSleep(ParticleStore* store, int* awakeCount, int* sleepingCount) {
+    bool lost = reserveNodes(store->idCount) != 0;
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        lost = lost || contacts[worker].failed;
+    }
+    if (lost) {
+        // Without every contact the islands can't be trusted
+        wakeAllParticles(store);
+        *awakeCount = store->count;
+        *sleepingCount = 0;
+        return;
+    }
+
+    wakeHitIslands(store);
+
+    RestContext rest;
+    memset(&rest, 0, sizeof(rest));
+    rest.store = store;
+    parallelFor(store->count, SLEEP_GRAIN, restTask, &rest);
+    int awake = 0;
+    int sleeping = 0;
+    int settling = 0;
+    int settled = 0;
+    for (int worker = 0; worker < threadPoolSize(); worker++) {
+        awake += rest.awake[worker];
+        sleeping += rest.sleeping[worker];
+        settling += rest.settling[worker];
+        settled += rest.settled[worker];
+    }
+    if (settled > 0) {
+        int fellAsleep = fallAsleep(store);
+        awake -= fellAsleep;
+        sleeping += fellAsleep;
+    }
+    // Fallen asleep or not, the settled particles were counted as settling
+    watchedParticles = sleeping + settling;
+    *awakeCount = awake;
+    *sleepingCount = sleeping;
+}
+
+void wakeAllParticles(ParticleStore* store) {
+    wakeParticles(store, 0, store->count);
+}
+
+// Function to wake the island the particle at 'index' sleeps in, for when
+// it is about to be moved or removed
+void wakeIsland(ParticleStore* store, int index) {
+    int island = store->island[index];
+    if (island < 0) return;
+    for (int i = 0; i < store->count; i++) {
+        if (store->island[i] == island) wakeParticles(store, i, i + 1);
+    }
+}
+
+void freeSleep(void) {
+    for (int worker = 0; worker < MAX_THREADS; worker++) {
+        free(contacts[worker].nodes);
+        memset(&contacts[worker], 0, sizeof(contacts[worker]));
+    }
+    free(parent);
+    free(flagged);
+    parent = NULL;
+    flagged = NULL;
+    nodeCapacity = 0;
+}
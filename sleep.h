@@ -0,0 +1,33 @@
+// sleep.h
+
+#ifndef SLEEP_H
+#define SLEEP_H
+
+#include <stdbool.h>
+#include "particle.h"
+
+// Steps in a row a particle has to stay slow before it may fall asleep
+#define SLEEP_STEPS 30
+
+// Touching pairs one worker found in the collision pass, for building islands
+// afterwards. Each entry is two nodes: the id of an awake particle or the
+// island of a sleeping one. A second node of CONTACT_BLOCKED means the first
+// touched an awake particle that isn't settling, so it must stay awake;
+// CONTACT_WAKE means something fast hit the island in the first node.
+typedef struct {
+    int* nodes;
+    int count;     // Entries, two nodes each
+    int capacity;
+    bool failed;   // An entry didn't fit and was lost
+} ContactList;
+
+void beginSleepStep(float gravity);
+ContactList* workerContacts(int worker);
+bool sleepWatchesPairs(void);
+bool collideSleeping(ParticleStore* store, int i, int j, void* contacts);
+void updateSleep(ParticleStore* store, int* awakeCount, int* sleepingCount);
+void wakeAllParticles(ParticleStore* store);
+void wakeIsland(ParticleStore* store, int index);
+void freeSleep(void);
+
+#endif // SLEEP_H
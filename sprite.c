@@ -0,0 +1,326 @@
+// sprite.c
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "sprite.h"
+
+// Sprite the average shading of a sphere is measured on
+#define AVERAGE_SPRITE_RADIUS 16
+
+// Exact radii plus the geometric steps up to MAX_SPRITE_RADIUS
+#define MAX_SPRITE_BUCKETS 64
+
+// Shading only depends on the camera orientation and the light, so one mask
+// per radius bucket serves every particle until one of those changes
+static SphereSprite sprites[MAX_SPRITE_BUCKETS];
+static bool spriteValid[MAX_SPRITE_BUCKETS];
+static unsigned long long spriteLastUse[MAX_SPRITE_BUCKETS];
+static size_t spriteBytes = 0;        // Held by all sprites together
+static unsigned long long spriteClock = 0;  // Ticks at every updateSphereSpriteCache
+static int averageIntensity = -1;  // -1 until measured for the current shading
+
+// Radius each bucket's sprite is shaded at, and the bucket each radius is
+// drawn from: the smallest whose sprite is at least as large
+static int bucketRadius[MAX_SPRITE_BUCKETS];
+static unsigned char radiusBucket[MAX_SPRITE_RADIUS + 1];
+static int bucketCount = 0;
+
+static bool haveShadingState = false;
+static float cachedPitch;
+static float cachedYaw;
+static Vec3D cachedLightDir;
+static float cachedLightIntensity;
+
+static void buildBucketTable(void) {
+    for (int r = 0; r <= EXACT_SPRITE_RADIUS; r++) {
+        bucketRadius[bucketCount++] = r;
+    }
+    for (int k = 1; bucketRadius[bucketCount - 1] < MAX_SPRITE_RADIUS; k++) {
+        int radius = (int)ceilf(EXACT_SPRITE_RADIUS * exp2f((float)k / SPRITE_STEPS_PER_DOUBLING));
+        if (radius > MAX_SPRITE_RADIUS) radius = MAX_SPRITE_RADIUS;
+        if (radius > bucketRadius[bucketCount - 1]) bucketRadius[bucketCount++] = radius;
+    }
+    int bucket = 0;
+    for (int r = 0; r <= MAX_SPRITE_RADIUS; r++) {
+        while (bucketRadius[bucket] < r) bucket++;
+        radiusBucket[r] = (unsigned char)bucket;
+    }
+}
+
+static size_t spriteSize(int radius) {
+    size_t size = 2 * (size_t)radius + 1;
+    return size * size * (sizeof(uint16_t) + sizeof(float)) + size * sizeof(int);
+}
+
+static void freeSprite(int bucket) {
+    SphereSprite* sprite = &sprites[bucket];
+    if (sprite->intensity != NULL) spriteBytes -= spriteSize(bucketRadius[bucket]);
+    free(sprite->intensity);
+    free(sprite->height);
+    free(sprite->span);
+    sprite->intensity = NULL;
+    sprite->height = NULL;
+    sprite->span = NULL;
+    spriteValid[bucket] = false;
+}
+
+// Function to release the sprites shaded for the old camera and light; the
+// next frame shades only the radii it draws
+static void invalidateSphereSprites(void) {
+    for (int b = 0; b < bucketCount; b++) {
+        freeSprite(b);
+    }
+    averageIntensity = -1;
+}
+
+// Function to drop every cached sprite if the camera was rotated or the light
+// changed since they were shaded. Call once per frame before drawing.
+void updateSphereSpriteCache(Camera camera) {
+    spriteClock++;
+    if (haveShadingState &&
+        cachedPitch == camera.pitch && cachedYaw == camera.yaw &&
+        cachedLightDir.x == lightDir.x && cachedLightDir.y == lightDir.y && cachedLightDir.z == lightDir.z &&
+        cachedLightIntensity == lightIntensity) {
+        return;
+    }
+    invalidateSphereSprites();
+    haveShadingState = true;
+    cachedPitch = camera.pitch;
+    cachedYaw = camera.yaw;
+    cachedLightDir = lightDir;
+    cachedLightIntensity = lightIntensity;
+}
+
+// Function to free least recently used sprites until 'bytes' more fit in the
+// budget. Sprites fetched since the last updateSphereSpriteCache may still be
+// drawn from, so they are kept. Returns false if they alone fill it.
+static bool makeRoomForSprite(size_t bytes) {
+    while (spriteBytes + bytes > SPRITE_CACHE_BUDGET) {
+        int oldest = -1;
+        for (int b = 0; b < bucketCount; b++) {
+            if (sprites[b].intensity == NULL || spriteLastUse[b] == spriteClock) continue;
+            if (oldest < 0 || spriteLastUse[b] < spriteLastUse[oldest]) oldest = b;
+        }
+        if (oldest < 0) return false;
+        freeSprite(oldest);
+    }
+    return true;
+}
+
+// Function to shade the mask for one radius with the same lighting model
+// drawFilledCircleWithShading uses per pixel
+static bool buildSphereSprite(SphereSprite* sprite, int radius) {
+    int size = 2 * radius + 1;
+    if (sprite->intensity == NULL) {
+        if (!makeRoomForSprite(spriteSize(radius))) return false;
+        sprite->intensity = malloc((size_t)size * size * sizeof(uint16_t));
+        sprite->height = malloc((size_t)size * size * sizeof(float));
+        sprite->span = malloc(size * sizeof(int));
+        if (sprite->intensity == NULL || sprite->height == NULL || sprite->span == NULL) {
+            free(sprite->intensity);
+            free(sprite->height);
+            free(sprite->span);
+            sprite->intensity = NULL;
+            sprite->height = NULL;
+            sprite->span = NULL;
+            return false;
+        }
+        spriteBytes += spriteSize(radius);
+    }
+    sprite->radius = radius;
+
+    // The silhouette and surface height only depend on the radius
+    for (int y = -radius; y <= radius; y++) {
+        for (int x = -radius; x <= radius; x++) {
+            float height = 0.0f;
+            if (radius == 0) {
+                height = 1.0f;
+            } else if (x * x + y * y <= radius * radius) {
+                height = sqrtf(1.0f - (x * x + y * y) / (float)(radius * radius));
+            }
+            sprite->height[(y + radius) * size + (x + radius)] = height;
+        }
+    }
+
+    for (int y = -radius; y <= radius; y++) {
+        int halfWidth = (int)sqrtf((float)(radius * radius - y * y));
+        while ((halfWidth + 1) * (halfWidth + 1) + y * y <= radius * radius) halfWidth++;
+        while (halfWidth * halfWidth + y * y > radius * radius) halfWidth--;
+        sprite->span[y + radius] = halfWidth;
+
+        for (int x = -radius; x <= radius; x++) {
+            float dot = 0.0f;
+            if (x * x + y * y <= radius * radius) {
+                // Calculate the normal at this point on the sphere's surface;
+                // a zero radius sphere is a single pixel facing the camera
+                Vec3D normal = {0.0f, 0.0f, sprite->height[(y + radius) * size + (x + radius)]};
+                if (radius > 0) {
+                    normal.x = x / (float)radius;
+                    normal.y = y / (float)radius;
+                }
+                Vec3D transformedNormal = rotate(normal, cachedPitch, cachedYaw);
+                dot = transformedNormal.x * lightDir.x + transformedNormal.y * lightDir.y + transformedNormal.z * lightDir.z;
+                if (dot < 0) dot = 0;
+            }
+            float intensity = fminf(65535.0f, dot * lightIntensity * 256.0f + 0.5f);
+            sprite->intensity[(y + radius) * size + (x + radius)] = (uint16_t)intensity;
+        }
+    }
+    return true;
+}
+
+// Function to fetch the shaded mask 'radius' is drawn from, shading it on
+// first use; above EXACT_SPRITE_RADIUS it may be larger than 'radius'.
+// Returns NULL for radii too large to cache, or if the sprites this frame
+// already uses fill the budget. Not thread safe while sprites are being
+// built; once a radius has been fetched since the last
+// updateSphereSpriteCache, fetching it again only reads and may happen on
+// any thread.
+const SphereSprite* getSphereSprite(int radius) {
+    if (radius < 0 || radius > MAX_SPRITE_RADIUS) return NULL;
+    if (bucketCount == 0) buildBucketTable();
+    int bucket = radiusBucket[radius];
+    if (!spriteValid[bucket]) {
+        if (!buildSphereSprite(&sprites[bucket], bucketRadius[bucket])) return NULL;
+        spriteValid[bucket] = true;
+    }
+    if (spriteLastUse[bucket] != spriteClock) spriteLastUse[bucket] = spriteClock;
+    return &sprites[bucket];
+}
+
+static inline uint32_t tintPixel(uint32_t red, uint32_t green, uint32_t blue, uint32_t k) {
+    uint32_t r = (red * k) >> 8;
+    uint32_t g = (green * k) >> 8;
+    uint32_t b = (blue * k) >> 8;
+    if (r > 255) r = 255;
+    if (g > 255) g = 255;
+    if (b > 255) b = 255;
+    return (0xFFu << 24) | (r << 16) | (g << 8) | b;
+}
+
+// Function to draw a sphere of 'radius' from the larger sprite of its bucket,
+// taking the nearest sprite pixel for each screen pixel
+static void blitScaledSphereSprite(uint32_t* pixels, float* depthBuffer, const ClipRect* clip,
+                                   const SphereSprite* sprite, int radius, int centerX, int centerY, uint32_t color,
+                                   float depth, float depthRadius) {
+    int spriteRadius = sprite->radius;
+    int size = 2 * spriteRadius + 1;
+    uint32_t red = (color >> 16) & 0xFF;
+    uint32_t green = (color >> 8) & 0xFF;
+    uint32_t blue = color & 0xFF;
+    // Sprite pixels per screen pixel as 16.16 fixed point; the sprite's
+    // center is added before shifting so nothing negative is shifted
+    int step = (spriteRadius << 16) / radius;
+    int center = (spriteRadius << 16) + 0x8000;
+
+    int yBegin = centerY - radius < clip->top ? clip->top : centerY - radius;
+    int yEnd = centerY + radius >= clip->bottom ? clip->bottom - 1 : centerY + radius;
+    for (int y = yBegin; y <= yEnd; y++) {
+        int dy = y - centerY;
+        int halfWidth = (int)sqrtf((float)(radius * radius - dy * dy));
+        while ((halfWidth + 1) * (halfWidth + 1) + dy * dy <= radius * radius) halfWidth++;
+        while (halfWidth * halfWidth + dy * dy > radius * radius) halfWidth--;
+        int xBegin = centerX - halfWidth < clip->left ? clip->left : centerX - halfWidth;
+        int xEnd = centerX + halfWidth >= clip->right ? clip->right - 1 : centerX + halfWidth;
+
+        int row = (dy * step + center) >> 16;
+        if (row < 0) row = 0;
+        if (row > size - 1) row = size - 1;
+        // Keep rounding from landing just outside the sprite's circle
+        int columnBegin = spriteRadius - sprite->span[row];
+        int columnEnd = spriteRadius + sprite->span[row];
+        const uint16_t* mask = sprite->intensity + row * size;
+        const float* height = sprite->height + row * size;
+        uint32_t* line = pixels + y * SCREEN_WIDTH;
+        float* depthLine = depthBuffer != NULL ? depthBuffer + y * SCREEN_WIDTH : NULL;
+
+        int position = (xBegin - centerX) * step + center;
+        for (int x = xBegin; x <= xEnd; x++, position += step) {
+            int column = position >> 16;
+            if (column < columnBegin) column = columnBegin;
+            if (column > columnEnd) column = columnEnd;
+            if (depthLine != NULL) {
+                float z = depth - depthRadius * height[column];
+                if (z >= depthLine[x]) continue;
+                depthLine[x] = z;
+            }
+            line[x] = tintPixel(red, green, blue, mask[column]);
+        }
+    }
+}
+
+// Function to draw a cached sphere of 'radius' tinted with 'color', clipped
+// to 'clip'. With a depth buffer, a pixel is only written if the sphere
+// surface there, 'depth' minus 'depthRadius' times the surface height, is
+// nearer than what the buffer already holds; covered pixels are skipped
+// before shading.
+void blitSphereSprite(uint32_t* pixels, float* depthBuffer, const ClipRect* clip, const SphereSprite* sprite,
+                      int radius, int centerX, int centerY, uint32_t color, float depth, float depthRadius) {
+    if (radius != sprite->radius) {
+        blitScaledSphereSprite(pixels, depthBuffer, clip, sprite, radius, centerX, centerY, color, depth, depthRadius);
+        return;
+    }
+    int size = 2 * radius + 1;
+    uint32_t red = (color >> 16) & 0xFF;
+    uint32_t green = (color >> 8) & 0xFF;
+    uint32_t blue = color & 0xFF;
+
+    int rowBegin = centerY - radius < clip->top ? clip->top - centerY + radius : 0;
+    int rowEnd = centerY + radius >= clip->bottom ? clip->bottom - 1 - centerY + radius : size - 1;
+    for (int row = rowBegin; row <= rowEnd; row++) {
+        int halfWidth = sprite->span[row];
+        int xBegin = centerX - halfWidth < clip->left ? clip->left : centerX - halfWidth;
+        int xEnd = centerX + halfWidth >= clip->right ? clip->right - 1 : centerX + halfWidth;
+        int offset = row * size + (radius - centerX);
+        const uint16_t* mask = sprite->intensity + offset;
+        int lineStart = (centerY - radius + row) * SCREEN_WIDTH;
+        uint32_t* line = pixels + lineStart;
+
+        if (depthBuffer != NULL) {
+            const float* height = sprite->height + offset;
+            float* depthLine = depthBuffer + lineStart;
+            for (int x = xBegin; x <= xEnd; x++) {
+                float z = depth - depthRadius * height[x];
+                if (z >= depthLine[x]) continue;
+                depthLine[x] = z;
+                line[x] = tintPixel(red, green, blue, mask[x]);
+            }
+            continue;
+        }
+
+        for (int x = xBegin; x <= xEnd; x++) {
+            line[x] = tintPixel(red, green, blue, mask[x]);
+        }
+    }
+}
+
+// Function to return the light factor of a whole sphere, averaged over its
+// silhouette, as 8.8 fixed point. Particles too small to show their shading
+// are drawn in this one color. Not thread safe while it is being measured;
+// like getSphereSprite, call it once before handing drawing to workers.
+int averageSphereIntensity(void) {
+    if (averageIntensity >= 0) return averageIntensity;
+    const SphereSprite* sprite = getSphereSprite(AVERAGE_SPRITE_RADIUS);
+    if (sprite == NULL) return 256;
+
+    int size = 2 * sprite->radius + 1;
+    long long sum = 0;
+    int pixels = 0;
+    for (int row = 0; row < size; row++) {
+        for (int x = sprite->radius - sprite->span[row]; x <= sprite->radius + sprite->span[row]; x++) {
+            sum += sprite->intensity[row * size + x];
+            pixels++;
+        }
+    }
+    averageIntensity = (int)(sum / pixels);
+    return averageIntensity;
+}
+
+void freeSphereSprites(void) {
+    for (int b = 0; b < bucketCount; b++) {
+        freeSprite(b);
+    }
+    averageIntensity = -1;
+    haveShadingState = false;
+}
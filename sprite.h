@@ -0,0 +1,37 @@
+// sprite.h
+
+#ifndef SPRITE_H
+#define SPRITE_H
+
+#include <stdint.h>
+#include "raster.h"
+
+// Largest radius, in pixels, that gets a cached sprite; bigger spheres are
+// shaded pixel by pixel
+#define MAX_SPRITE_RADIUS 512
+// Radii up to this get a sprite of their own. Above it radii share sprites in
+// geometric steps, each scaled down to the radius it is drawn at.
+#define EXACT_SPRITE_RADIUS 16
+#define SPRITE_STEPS_PER_DOUBLING 8
+// Bytes of sprites kept at once; the least recently used go first
+#define SPRITE_CACHE_BUDGET (24 << 20)
+
+// Pre-shaded sphere of one pixel radius. 'intensity' holds the light factor
+// of every pixel in the (2r+1)^2 bounding square as 8.8 fixed point,
+// 'height' how far the surface bulges towards the camera there as a fraction
+// of the radius, and 'span[row]' is the half width of the circle on that row.
+typedef struct {
+    int radius;
+    uint16_t* intensity;
+    float* height;
+    int* span;
+} SphereSprite;
+
+void updateSphereSpriteCache(Camera camera);
+const SphereSprite* getSphereSprite(int radius);
+void blitSphereSprite(uint32_t* pixels, float* depthBuffer, const ClipRect* clip, const SphereSprite* sprite,
+                      int radius, int centerX, int centerY, uint32_t color, float depth, float depthRadius);
+int averageSphereIntensity(void);
+void freeSphereSprites(void);
+
+#endif // SPRITE_H
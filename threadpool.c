@@ -0,0 +1,185 @@
+// threadpool.c
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+// Persistent workers sleep on 'wake' between jobs. Each parallelFor bumps the
+// generation, and workers pull chunks from a shared atomic cursor until the
+// range is exhausted, then report back on 'done'.
+typedef struct {
+    pthread_t workers[MAX_THREADS];
+    int size;
+    pthread_mutex_t lock;
+    // Held for a whole job, so parallelFor calls on this pool take turns
+    pthread_mutex_t jobLock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned int generation;
+    bool stopping;
+    int busyWorkers;
+
+    ParallelTask task;
+    void* context;
+    int count;
+    int grain;
+    atomic_int nextIndex;
+} ThreadPool;
+
+typedef struct {
+    ThreadPool* pool;
+    int worker;
+} WorkerStart;
+
+#define POOL_INITIALIZER {.size = 1, .lock = PTHREAD_MUTEX_INITIALIZER, .jobLock = PTHREAD_MUTEX_INITIALIZER, \
+                          .wake = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER}
+
+static ThreadPool pools[POOL_COUNT] = {POOL_INITIALIZER, POOL_INITIALIZER};
+static WorkerStart workerStarts[POOL_COUNT][MAX_THREADS];
+// The pool parallelFor and threadPoolSize use on this thread
+static _Thread_local ThreadPool* callerPool = &pools[POOL_MAIN];
+
+static void runChunks(ThreadPool* pool, int worker) {
+    for (;;) {
+        int begin = atomic_fetch_add(&pool->nextIndex, pool->grain);
+        if (begin >= pool->count) break;
+        int end = begin + pool->grain;
+        if (end > pool->count) end = pool->count;
+        pool->task(pool->context, begin, end, worker);
+    }
+}
+
+static void* workerMain(void* arg) {
+    const WorkerStart* start = arg;
+    ThreadPool* pool = start->pool;
+    int worker = start->worker;
+    unsigned int seen = 0;
+    callerPool = pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        runChunks(pool, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busyWorkers == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Function to start 'numThreads - 1' workers for 'pool'; whichever thread
+// calls parallelFor on it is the last thread. Any previous workers of the
+// pool are stopped first. Returns the number of threads running.
+int startThreadPoolFor(ThreadPoolId id, int numThreads) {
+    ThreadPool* pool = &pools[id];
+    stopThreadPoolFor(id);
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > MAX_THREADS) numThreads = MAX_THREADS;
+
+    pool->stopping = false;
+    pool->generation = 0;
+    pool->size = 1;
+    for (int i = 1; i < numThreads; i++) {
+        workerStarts[id][i].pool = pool;
+        workerStarts[id][i].worker = i;
+        if (pthread_create(&pool->workers[i], NULL, workerMain, &workerStarts[id][i]) != 0) {
+            fprintf(stderr, "Could not start worker thread %d, using %d threads\n", i, pool->size);
+            break;
+        }
+        pool->size++;
+    }
+    return pool->size;
+}
+
+void stopThreadPoolFor(ThreadPoolId id) {
+    ThreadPool* pool = &pools[id];
+    if (pool->size <= 1) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->size; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pool->size = 1;
+}
+
+// Function to start the main pool, which every thread uses unless it picked
+// another with useThreadPool
+int startThreadPool(int numThreads) {
+    return startThreadPoolFor(POOL_MAIN, numThreads);
+}
+
+// Function to stop the workers of every pool
+void stopThreadPool(void) {
+    for (int id = 0; id < POOL_COUNT; id++) {
+        stopThreadPoolFor((ThreadPoolId)id);
+    }
+}
+
+// Function to send the calling thread's parallelFor jobs to 'pool'
+void useThreadPool(ThreadPoolId pool) {
+    callerPool = &pools[pool];
+}
+
+int threadPoolSize(void) {
+    return callerPool->size;
+}
+
+int defaultThreadCount(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    if (cpus > MAX_THREADS) return MAX_THREADS;
+    return (int)cpus;
+}
+
+// Function to run 'task' over [0, count) in chunks of 'grain' on every thread
+// in the calling thread's pool, returning once all chunks are done. Small
+// jobs, and every job on a single-thread pool, run directly on the caller.
+// Several threads may call this at once; jobs on the same pool run one after
+// another, jobs on different pools side by side.
+void parallelFor(int count, int grain, ParallelTask task, void* context) {
+    ThreadPool* pool = callerPool;
+    if (count <= 0) return;
+    if (grain < 1) grain = 1;
+    if (pool->size == 1 || count <= grain) {
+        task(context, 0, count, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->jobLock);
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->context = context;
+    pool->count = count;
+    pool->grain = grain;
+    atomic_store(&pool->nextIndex, 0);
+    pool->busyWorkers = pool->size - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    runChunks(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busyWorkers > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->jobLock);
+}
@@ -0,0 +1,33 @@
+// threadpool.h
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#define MAX_THREADS 64
+
+// Separate pools, so one thread's jobs never queue behind another's. Every
+// thread starts out using POOL_MAIN; the simulation thread switches to
+// POOL_SIMULATION so physics steps don't wait for a frame's render job.
+typedef enum {
+    POOL_MAIN,
+    POOL_SIMULATION,
+    POOL_COUNT
+} ThreadPoolId;
+
+// Work is handed out in chunks of [begin, end). 'worker' is a stable index in
+// [0, threadPoolSize()) that tasks can use for per-thread scratch data; the
+// calling thread always runs as worker 0, so with more than one thread calling
+// parallelFor on the same pool, scratch data indexed by worker must belong to
+// the job.
+typedef void (*ParallelTask)(void* context, int begin, int end, int worker);
+
+int startThreadPool(int numThreads);
+void stopThreadPool(void);
+int startThreadPoolFor(ThreadPoolId pool, int numThreads);
+void stopThreadPoolFor(ThreadPoolId pool);
+void useThreadPool(ThreadPoolId pool);
+int threadPoolSize(void);
+int defaultThreadCount(void);
+void parallelFor(int count, int grain, ParallelTask task, void* context);
+
+#endif // THREADPOOL_H
@@ -0,0 +1,100 @@
+// tiles.c
+
+#include <math.h>
+#include <stdlib.h>
+#include "tiles.h"
+
+void initTileBins(TileBins* bins) {
+    bins->width = 0;
+    bins->height = 0;
+    bins->tilesX = 0;
+    bins->tilesY = 0;
+    bins->tileCount = 0;
+    bins->tileStart = NULL;
+    bins->tileEntries = NULL;
+    bins->tileCursor = NULL;
+    bins->tileCapacity = 0;
+    bins->entryCapacity = 0;
+}
+
+void freeTileBins(TileBins* bins) {
+    free(bins->tileStart);
+    free(bins->tileEntries);
+    free(bins->tileCursor);
+    initTileBins(bins);
+}
+
+// Function to find the tiles covered by entry k's bounding square
+static void tileRange(const TileBins* bins, const ProjectedParticles* projected, int k,
+                      int* tx0, int* ty0, int* tx1, int* ty1) {
+    float radius = projected->radius[k];
+    float left = fmaxf(0.0f, projected->x[k] - radius);
+    float right = fminf((float)(bins->width - 1), projected->x[k] + radius);
+    float top = fmaxf(0.0f, projected->y[k] - radius);
+    float bottom = fminf((float)(bins->height - 1), projected->y[k] + radius);
+    *tx0 = (int)left / TILE_SIZE;
+    *tx1 = (int)right / TILE_SIZE;
+    *ty0 = (int)top / TILE_SIZE;
+    *ty1 = (int)bottom / TILE_SIZE;
+}
+
+// Function to bucket the visible particles into tiles of a width x height
+// screen. Returns the number of tile entries, or -1 if memory ran out.
+int binProjectedParticles(TileBins* bins, const ProjectedParticles* projected, int width, int height) {
+    bins->width = width;
+    bins->height = height;
+    bins->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    bins->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    bins->tileCount = bins->tilesX * bins->tilesY;
+
+    if (bins->tileCount + 1 > bins->tileCapacity) {
+        int* tileStart = realloc(bins->tileStart, (bins->tileCount + 1) * sizeof(int));
+        if (tileStart == NULL) return -1;
+        bins->tileStart = tileStart;
+        int* tileCursor = realloc(bins->tileCursor, (bins->tileCount + 1) * sizeof(int));
+        if (tileCursor == NULL) return -1;
+        bins->tileCursor = tileCursor;
+        bins->tileCapacity = bins->tileCount + 1;
+    }
+    for (int t = 0; t <= bins->tileCount; t++) {
+        bins->tileStart[t] = 0;
+    }
+
+    // Count how many entries land in each tile
+    for (int n = 0; n < projected->count; n++) {
+        int tx0, ty0, tx1, ty1;
+        tileRange(bins, projected, projected->order[n], &tx0, &ty0, &tx1, &ty1);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                bins->tileStart[ty * bins->tilesX + tx + 1]++;
+            }
+        }
+    }
+    for (int t = 0; t < bins->tileCount; t++) {
+        bins->tileStart[t + 1] += bins->tileStart[t];
+    }
+
+    int entries = bins->tileStart[bins->tileCount];
+    if (entries > bins->entryCapacity) {
+        int* tileEntries = realloc(bins->tileEntries, entries * sizeof(int));
+        if (tileEntries == NULL) return -1;
+        bins->tileEntries = tileEntries;
+        bins->entryCapacity = entries;
+    }
+
+    // Walking 'order' keeps every tile's list nearest first
+    for (int t = 0; t < bins->tileCount; t++) {
+        bins->tileCursor[t] = bins->tileStart[t];
+    }
+    for (int n = 0; n < projected->count; n++) {
+        int k = projected->order[n];
+        int tx0, ty0, tx1, ty1;
+        tileRange(bins, projected, k, &tx0, &ty0, &tx1, &ty1);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                bins->tileEntries[bins->tileCursor[ty * bins->tilesX + tx]++] = k;
+            }
+        }
+    }
+    return entries;
+}
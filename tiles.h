@@ -0,0 +1,31 @@
+// tiles.h
+
+#ifndef TILES_H
+#define TILES_H
+
+#include "view.h"
+
+// Side of a square screen tile in pixels
+#define TILE_SIZE 64
+
+// Projected particles bucketed by the screen tiles their bounding square
+// touches, so each tile can be shaded on its own. Every tile's list keeps the
+// front to back order of ProjectedParticles.order.
+typedef struct {
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    int tileCount;
+    int* tileStart;    // tileCount + 1 offsets into tileEntries
+    int* tileEntries;  // entries k of the projected particles, per tile
+    int* tileCursor;   // scratch write position per tile
+    int tileCapacity;
+    int entryCapacity;
+} TileBins;
+
+void initTileBins(TileBins* bins);
+void freeTileBins(TileBins* bins);
+int binProjectedParticles(TileBins* bins, const ProjectedParticles* projected, int width, int height);
+
+#endif // TILES_H
@@ -0,0 +1,20 @@
+// timer.c
+
+#include <time.h>
+#include "timer.h"
+
+// Monotonic wall-clock time in seconds, independent of SDL
+double secondsNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Function to block the calling thread for about 'seconds'
+void sleepSeconds(double seconds) {
+    if (seconds <= 0.0) return;
+    struct timespec duration;
+    duration.tv_sec = (time_t)seconds;
+    duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1e9);
+    nanosleep(&duration, NULL);
+}
@@ -0,0 +1,9 @@
+// timer.h
+
+#ifndef TIMER_H
+#define TIMER_H
+
+double secondsNow(void);
+void sleepSeconds(double seconds);
+
+#endif // TIMER_H
@@ -0,0 +1,458 @@
+// trajectory.c
+//
+// Recording format: a file header, then one frame per recorded step. Positions
+// and velocities are quantized to fixed point. A keyframe stores them as is,
+// plus the radius and color of every particle. Other frames store each
+// velocity as the change since the previous frame and each position as the
+// error of predicting it from the previous position and velocity. Both are
+// zero for most particles on most steps, so each field is written as pairs of
+// varints: how many zeros come next, then the nonzero value after them,
+// zigzag coded so small values of either sign take a single byte.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trajectory.h"
+#include "timer.h"
+
+#define TRAJECTORY_MAGIC "PSIMTRAJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_BYTE_ORDER 0x01020304u
+#define FRAME_MAGIC 0x454D5246u  // "FRME"
+#define FRAME_KEYFRAME 1u
+
+// Units per world unit; the cube spans 32768 position units
+#define POSITION_SCALE 32768.0f
+#define VELOCITY_SCALE 4096.0f
+// Fractional bits of the fixed point factor that turns a quantized velocity
+// into a quantized position change per step
+#define PREDICTION_SHIFT 16
+#define QUANTIZED_LIMIT 1.0e9f
+
+// Quantized fields in frame order: px, py, pz, vx, vy, vz. Positions come
+// first so they are predicted from the previous frame's velocities, the ones
+// the integrator moved them with.
+#define TRAJECTORY_FIELDS 6
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    float deltaTime;
+    float positionScale;
+    float velocityScale;
+    int32_t predictionFactor;
+} TrajectoryHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    int64_t step;
+    int32_t count;
+    uint32_t payloadBytes;
+} FrameHeader;
+
+static int32_t quantize(float value, float scale) {
+    float scaled = value * scale;
+    if (!(scaled > -QUANTIZED_LIMIT)) scaled = -QUANTIZED_LIMIT;  // Also catches NaN
+    if (scaled > QUANTIZED_LIMIT) scaled = QUANTIZED_LIMIT;
+    return (int32_t)lrintf(scaled);
+}
+
+// Function to predict where a particle is 'steps' steps after it was at
+// 'position' moving at 'velocity', all in quantized units
+static int32_t predictPosition(int32_t position, int32_t velocity, int32_t factor, long long steps) {
+    int64_t moved = (int64_t)velocity * factor * steps;
+    return position + (int32_t)((moved + (1 << (PREDICTION_SHIFT - 1))) >> PREDICTION_SHIFT);
+}
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static uint8_t* writeVarint(uint8_t* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Function to read one varint, or return NULL if it runs past 'end'
+static const uint8_t* readVarint(const uint8_t* in, const uint8_t* end, uint32_t* value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (in == end) return NULL;
+        uint8_t byte = *in++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            *value = result;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static void freeRecordedStep(RecordedStep* slot) {
+    free(slot->values);
+    free(slot->radius);
+    free(slot->color);
+    memset(slot, 0, sizeof(*slot));
+}
+
+static int reserveRecordedStep(RecordedStep* slot, int capacity) {
+    if (slot->capacity >= capacity) return 0;
+    freeRecordedStep(slot);
+    slot->values = malloc((size_t)capacity * TRAJECTORY_FIELDS * sizeof(float));
+    slot->radius = malloc((size_t)capacity * sizeof(float));
+    slot->color = malloc((size_t)capacity * sizeof(uint32_t));
+    if (slot->values == NULL || slot->radius == NULL || slot->color == NULL) {
+        freeRecordedStep(slot);
+        return -1;
+    }
+    slot->capacity = capacity;
+    return 0;
+}
+
+// Function to encode one step into recorder->encoded. Returns the payload
+// size, or -1 if memory ran out.
+static long encodeStep(Recorder* recorder, const RecordedStep* slot) {
+    int count = slot->count;
+    // Worst case: a one byte zero run and a five byte value for every value,
+    // plus a trailing run per field
+    size_t needed = (size_t)count * (2 * sizeof(float) + TRAJECTORY_FIELDS * 6) + TRAJECTORY_FIELDS * 5;
+    if (needed > recorder->encodedCapacity) {
+        uint8_t* encoded = realloc(recorder->encoded, needed);
+        if (encoded == NULL) return -1;
+        recorder->encoded = encoded;
+        recorder->encodedCapacity = needed;
+    }
+    if (slot->keyframe && count > recorder->quantizedCapacity) {
+        int32_t* quantized = realloc(recorder->quantized, (size_t)count * TRAJECTORY_FIELDS * sizeof(int32_t));
+        if (quantized == NULL) return -1;
+        recorder->quantized = quantized;
+        recorder->quantizedCapacity = count;
+    }
+
+    uint8_t* out = recorder->encoded;
+    long long steps = slot->step - recorder->quantizedStep;
+    if (slot->keyframe) {
+        memcpy(out, slot->radius, count * sizeof(float));
+        out += count * sizeof(float);
+        memcpy(out, slot->color, count * sizeof(uint32_t));
+        out += count * sizeof(uint32_t);
+    }
+    for (int f = 0; f < TRAJECTORY_FIELDS; f++) {
+        float scale = f < 3 ? POSITION_SCALE : VELOCITY_SCALE;
+        const float* values = slot->values + (size_t)f * slot->capacity;
+        int32_t* quantized = recorder->quantized + (size_t)f * count;
+        const int32_t* velocity = f < 3 ? quantized + (size_t)3 * count : NULL;
+
+        uint32_t zeros = 0;
+        for (int i = 0; i < count; i++) {
+            int32_t q = quantize(values[i], scale);
+            int32_t predicted = 0;
+            if (!slot->keyframe) {
+                predicted = f < 3 ? predictPosition(quantized[i], velocity[i], recorder->predictionFactor, steps)
+                                  : quantized[i];
+            }
+            quantized[i] = q;
+            if (q == predicted) {
+                zeros++;
+                continue;
+            }
+            out = writeVarint(out, zeros);
+            out = writeVarint(out, zigzag(q - predicted));
+            zeros = 0;
+        }
+        if (zeros > 0) out = writeVarint(out, zeros);
+    }
+    recorder->quantizedCount = count;
+    recorder->quantizedStep = slot->step;
+    return (long)(out - recorder->encoded);
+}
+
+static void writeStep(Recorder* recorder, const RecordedStep* slot) {
+    if (recorder->failed) return;
+    long payloadBytes = encodeStep(recorder, slot);
+    FrameHeader header = {FRAME_MAGIC, slot->keyframe ? FRAME_KEYFRAME : 0u, slot->step, slot->count, (uint32_t)payloadBytes};
+    if (payloadBytes < 0 ||
+        fwrite(&header, sizeof(header), 1, recorder->file) != 1 ||
+        fwrite(recorder->encoded, 1, payloadBytes, recorder->file) != (size_t)payloadBytes) {
+        fprintf(stderr, "Trajectory recording failed; later steps are not saved\n");
+        recorder->failed = true;
+        return;
+    }
+    recorder->bytesWritten += sizeof(header) + payloadBytes;
+}
+
+static void* writerMain(void* arg) {
+    Recorder* recorder = arg;
+    pthread_mutex_lock(&recorder->lock);
+    for (;;) {
+        while (recorder->queued == 0 && !recorder->stopping) {
+            pthread_cond_wait(&recorder->ready, &recorder->lock);
+        }
+        if (recorder->queued == 0) break;
+        RecordedStep* slot = &recorder->slots[recorder->head];
+        pthread_mutex_unlock(&recorder->lock);
+
+        writeStep(recorder, slot);
+
+        pthread_mutex_lock(&recorder->lock);
+        recorder->head = (recorder->head + 1) % RECORDER_SLOTS;
+        recorder->queued--;
+    }
+    pthread_mutex_unlock(&recorder->lock);
+    return NULL;
+}
+
+// Function to create 'path' and start the writer thread for steps of
+// 'deltaTime' seconds. Returns 0 on success, -1 on failure.
+int startRecorder(Recorder* recorder, const char* path, float deltaTime) {
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->file = fopen(path, "wb");
+    if (recorder->file == NULL) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return -1;
+    }
+    recorder->predictionFactor = (int32_t)lrintf(deltaTime * POSITION_SCALE / VELOCITY_SCALE * (1 << PREDICTION_SHIFT));
+    recorder->lastCount = -1;
+    recorder->needKeyframe = true;
+
+    TrajectoryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.byteOrder = TRAJECTORY_BYTE_ORDER;
+    header.deltaTime = deltaTime;
+    header.positionScale = POSITION_SCALE;
+    header.velocityScale = VELOCITY_SCALE;
+    header.predictionFactor = recorder->predictionFactor;
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1) {
+        fprintf(stderr, "Could not write %s\n", path);
+        fclose(recorder->file);
+        return -1;
+    }
+    recorder->bytesWritten = sizeof(header);
+
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_cond_init(&recorder->ready, NULL);
+    if (pthread_create(&recorder->thread, NULL, writerMain, recorder) != 0) {
+        fprintf(stderr, "Could not start the recorder thread\n");
+        pthread_mutex_destroy(&recorder->lock);
+        pthread_cond_destroy(&recorder->ready);
+        fclose(recorder->file);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to queue the state after 'step' for writing. 'layoutChanged' says
+// particles were added, removed or moved to other indices since the last call,
+// which forces a keyframe. Costs one copy of the positions and velocities;
+// if every slot is still waiting for the writer, the step is dropped.
+void recordStep(Recorder* recorder, const ParticleStore* store, long long step, bool layoutChanged) {
+    double start = secondsNow();
+    if (layoutChanged || store->count != recorder->lastCount) recorder->needKeyframe = true;
+
+    pthread_mutex_lock(&recorder->lock);
+    bool full = recorder->queued == RECORDER_SLOTS;
+    RecordedStep* slot = &recorder->slots[(recorder->head + recorder->queued) % RECORDER_SLOTS];
+    pthread_mutex_unlock(&recorder->lock);
+
+    // The slot is outside the queue, so the writer won't touch it until it is
+    // handed over below
+    if (full || reserveRecordedStep(slot, store->count) != 0) {
+        recorder->stepsDropped++;
+        recorder->recordSeconds += secondsNow() - start;
+        return;
+    }
+    bool keyframe = recorder->needKeyframe || recorder->sinceKeyframe >= KEYFRAME_INTERVAL;
+    const float* fields[TRAJECTORY_FIELDS] = {store->px, store->py, store->pz, store->vx, store->vy, store->vz};
+    for (int f = 0; f < TRAJECTORY_FIELDS; f++) {
+        memcpy(slot->values + (size_t)f * slot->capacity, fields[f], store->count * sizeof(float));
+    }
+    if (keyframe) {
+        memcpy(slot->radius, store->radius, store->count * sizeof(float));
+        memcpy(slot->color, store->color, store->count * sizeof(uint32_t));
+    }
+    slot->count = store->count;
+    slot->step = step;
+    slot->keyframe = keyframe;
+
+    pthread_mutex_lock(&recorder->lock);
+    recorder->queued++;
+    pthread_cond_signal(&recorder->ready);
+    pthread_mutex_unlock(&recorder->lock);
+
+    recorder->lastCount = store->count;
+    recorder->sinceKeyframe = keyframe ? 1 : recorder->sinceKeyframe + 1;
+    recorder->needKeyframe = false;
+    recorder->stepsRecorded++;
+    recorder->recordSeconds += secondsNow() - start;
+}
+
+// Function to write out every queued step, close the file and print what the
+// recording cost
+void stopRecorder(Recorder* recorder) {
+    if (recorder->file == NULL) return;
+
+    pthread_mutex_lock(&recorder->lock);
+    recorder->stopping = true;
+    pthread_cond_signal(&recorder->ready);
+    pthread_mutex_unlock(&recorder->lock);
+    pthread_join(recorder->thread, NULL);
+
+    if (fclose(recorder->file) != 0 && !recorder->failed) {
+        fprintf(stderr, "Trajectory recording failed while closing the file\n");
+    }
+    long long calls = recorder->stepsRecorded + recorder->stepsDropped;
+    printf("Recorded %lld steps (%lld dropped), %.1f MB, %.1f us per step on the simulation thread\n",
+           recorder->stepsRecorded, recorder->stepsDropped, recorder->bytesWritten / 1e6,
+           calls > 0 ? recorder->recordSeconds * 1e6 / calls : 0.0);
+
+    for (int s = 0; s < RECORDER_SLOTS; s++) {
+        freeRecordedStep(&recorder->slots[s]);
+    }
+    free(recorder->quantized);
+    free(recorder->encoded);
+    pthread_mutex_destroy(&recorder->lock);
+    pthread_cond_destroy(&recorder->ready);
+    recorder->file = NULL;
+}
+
+// Function to open a recording for replay. Returns 0 on success, -1 if the
+// file can't be read or isn't a recording of this version.
+int openReplay(Replay* replay, const char* path) {
+    memset(replay, 0, sizeof(*replay));
+    replay->file = fopen(path, "rb");
+    if (replay->file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+    TrajectoryHeader header;
+    if (fread(&header, sizeof(header), 1, replay->file) != 1 ||
+        memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRAJECTORY_VERSION || header.byteOrder != TRAJECTORY_BYTE_ORDER ||
+        header.positionScale != POSITION_SCALE || header.velocityScale != VELOCITY_SCALE ||
+        !(header.deltaTime > 0.0f)) {
+        fprintf(stderr, "%s is not a version %d recording\n", path, TRAJECTORY_VERSION);
+        fclose(replay->file);
+        replay->file = NULL;
+        return -1;
+    }
+    replay->deltaTime = header.deltaTime;
+    replay->predictionFactor = header.predictionFactor;
+    replay->dataStart = ftell(replay->file);
+    return 0;
+}
+
+// Function to decode one payload into the store. Returns -1 if it is
+// malformed.
+static int decodeStep(Replay* replay, ParticleStore* store, const FrameHeader* frame) {
+    const uint8_t* in = replay->payload;
+    const uint8_t* end = replay->payload + frame->payloadBytes;
+    int count = frame->count;
+    bool keyframe = (frame->flags & FRAME_KEYFRAME) != 0;
+    long long steps = frame->step - replay->step;
+
+    if (keyframe) {
+        if ((size_t)(end - in) < (size_t)count * 8) return -1;
+        if (count > replay->quantizedCapacity) {
+            int32_t* quantized = realloc(replay->quantized, (size_t)count * TRAJECTORY_FIELDS * sizeof(int32_t));
+            if (quantized == NULL) return -1;
+            replay->quantized = quantized;
+            replay->quantizedCapacity = count;
+        }
+        clearParticles(store);
+        if (addParticles(store, count) < 0) return -1;
+        memcpy(store->radius, in, count * sizeof(float));
+        in += count * sizeof(float);
+        memcpy(store->color, in, count * sizeof(uint32_t));
+        in += count * sizeof(uint32_t);
+    } else if (!replay->haveKeyframe || count != replay->quantizedCount || count != store->count) {
+        return -1;
+    }
+
+    float* fields[TRAJECTORY_FIELDS] = {store->px, store->py, store->pz, store->vx, store->vy, store->vz};
+    for (int f = 0; f < TRAJECTORY_FIELDS; f++) {
+        float scale = f < 3 ? POSITION_SCALE : VELOCITY_SCALE;
+        int32_t* quantized = replay->quantized + (size_t)f * count;
+        const int32_t* velocity = f < 3 ? quantized + (size_t)3 * count : NULL;
+        float* values = fields[f];
+
+        int i = 0;
+        while (i < count) {
+            // A run of zero residuals, then one nonzero one unless the field ends
+            uint32_t zeros;
+            in = readVarint(in, end, &zeros);
+            if (in == NULL || zeros > (uint32_t)(count - i)) return -1;
+            int runEnd = i + (int)zeros;
+            int32_t residual = 0;
+            if (runEnd < count) {
+                uint32_t coded;
+                in = readVarint(in, end, &coded);
+                if (in == NULL) return -1;
+                residual = unzigzag(coded);
+            }
+            for (; i <= runEnd && i < count; i++) {
+                int32_t predicted = 0;
+                if (!keyframe) {
+                    predicted = f < 3 ? predictPosition(quantized[i], velocity[i], replay->predictionFactor, steps)
+                                      : quantized[i];
+                }
+                quantized[i] = predicted + (i == runEnd ? residual : 0);
+                values[i] = quantized[i] / scale;
+            }
+        }
+    }
+    replay->quantizedCount = count;
+    replay->step = frame->step;
+    replay->haveKeyframe = true;
+    return 0;
+}
+
+// Function to load the next recorded step into the store. Particles keep
+// their indices between keyframes; a keyframe replaces them all. Returns 1
+// if a step was read, 0 at the end of the recording, -1 on a damaged file.
+int readReplayStep(Replay* replay, ParticleStore* store) {
+    FrameHeader frame;
+    size_t read = fread(&frame, 1, sizeof(frame), replay->file);
+    if (read == 0 && feof(replay->file)) return 0;
+    if (read != sizeof(frame) || frame.magic != FRAME_MAGIC || frame.count < 0) {
+        fprintf(stderr, "Damaged recording frame after step %lld\n", replay->step);
+        return -1;
+    }
+    if (frame.payloadBytes > replay->payloadCapacity) {
+        uint8_t* payload = realloc(replay->payload, frame.payloadBytes);
+        if (payload == NULL) return -1;
+        replay->payload = payload;
+        replay->payloadCapacity = frame.payloadBytes;
+    }
+    if (fread(replay->payload, 1, frame.payloadBytes, replay->file) != frame.payloadBytes ||
+        decodeStep(replay, store, &frame) != 0) {
+        fprintf(stderr, "Damaged recording frame at step %lld\n", (long long)frame.step);
+        return -1;
+    }
+    return 1;
+}
+
+// Function to go back to the first recorded step
+void rewindReplay(Replay* replay) {
+    fseek(replay->file, replay->dataStart, SEEK_SET);
+    replay->haveKeyframe = false;
+    replay->step = 0;
+}
+
+void closeReplay(Replay* replay) {
+    if (replay->file != NULL) fclose(replay->file);
+    free(replay->quantized);
+    free(replay->payload);
+    memset(replay, 0, sizeof(*replay));
+}
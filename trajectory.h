@@ -0,0 +1,87 @@
+// trajectory.h
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "particle.h"
+
+// Steps that can wait for the writer before new ones are dropped
+#define RECORDER_SLOTS 8
+// A full frame is written at least this often so replays can resync
+#define KEYFRAME_INTERVAL 64
+
+// One captured step waiting to be encoded. 'values' holds px, py, pz, vx, vy
+// and vz, 'capacity' floats each; radius and color are only copied for
+// keyframes.
+typedef struct {
+    float* values;
+    float* radius;
+    uint32_t* color;
+    int count;
+    int capacity;
+    long long step;
+    bool keyframe;
+} RecordedStep;
+
+// Streams steps to a file from a background thread. The simulation thread
+// only copies the step into a free slot and never waits; if the writer falls
+// behind, steps are dropped and counted instead.
+typedef struct {
+    FILE* file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    RecordedStep slots[RECORDER_SLOTS];
+    int head;    // Oldest queued slot
+    int queued;
+    bool stopping;
+
+    // Caller side
+    int lastCount;
+    int sinceKeyframe;
+    bool needKeyframe;
+    long long stepsRecorded;
+    long long stepsDropped;
+    double recordSeconds;  // Time spent in recordStep
+
+    // Writer side
+    int32_t* quantized;  // Last written frame, six fields of 'quantizedCount'
+    int quantizedCount;
+    int quantizedCapacity;
+    long long quantizedStep;
+    uint8_t* encoded;
+    size_t encodedCapacity;
+    int32_t predictionFactor;
+    long long bytesWritten;
+    bool failed;
+} Recorder;
+
+// Reads a recording back one step at a time
+typedef struct {
+    FILE* file;
+    long dataStart;
+    float deltaTime;
+    int32_t predictionFactor;
+    int32_t* quantized;
+    int quantizedCount;
+    int quantizedCapacity;
+    long long step;
+    bool haveKeyframe;
+    uint8_t* payload;
+    size_t payloadCapacity;
+} Replay;
+
+int startRecorder(Recorder* recorder, const char* path, float deltaTime);
+void recordStep(Recorder* recorder, const ParticleStore* store, long long step, bool layoutChanged);
+void stopRecorder(Recorder* recorder);
+
+int openReplay(Replay* replay, const char* path);
+int readReplayStep(Replay* replay, ParticleStore* store);
+void rewindReplay(Replay* replay);
+void closeReplay(Replay* replay);
+
+#endif // TRAJECTORY_H
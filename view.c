@@ -0,0 +1,267 @@
+// view.c
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "view.h"
+#include "threadpool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Points closer to the eye than this along the view axis are culled
+#define NEAR_PLANE 0.001f
+// Keeps far off-screen coordinates inside int range before truncating
+#define COORDINATE_LIMIT 1.0e6f
+// Depth slices used to order the visible particles nearest first
+#define DEPTH_BINS 1024
+
+// Function to bake the camera into a matrix equal to rotate(v, pitch, yaw):
+// yaw around the y-axis followed by pitch around the x-axis
+void buildViewTransform(ViewTransform* view, Camera camera) {
+    float sp = sinf(camera.pitch), cp = cosf(camera.pitch);
+    float sy = sinf(camera.yaw), cy = cosf(camera.yaw);
+
+    view->m[0][0] = cy;       view->m[0][1] = 0.0f; view->m[0][2] = -sy;
+    view->m[1][0] = -sp * sy; view->m[1][1] = cp;   view->m[1][2] = -sp * cy;
+    view->m[2][0] = cp * sy;  view->m[2][1] = sp;   view->m[2][2] = cp * cy;
+    view->position = camera.position;
+    view->screenWidth = SCREEN_WIDTH;
+    view->screenHeight = SCREEN_HEIGHT;
+}
+
+Vec3D viewRotate(const ViewTransform* view, Vec3D v) {
+    Vec3D rotated = {
+        view->m[0][0] * v.x + view->m[0][1] * v.y + view->m[0][2] * v.z,
+        view->m[1][0] * v.x + view->m[1][1] * v.y + view->m[1][2] * v.z,
+        view->m[2][0] * v.x + view->m[2][1] * v.y + view->m[2][2] * v.z
+    };
+    return rotated;
+}
+
+// Function to project a single point the same way project() does. Returns
+// false, and the screen center, for points behind the camera.
+bool projectPoint(const ViewTransform* view, Vec3D point, int* x2D, int* y2D) {
+    int halfWidth = view->screenWidth / 2;
+    int halfHeight = view->screenHeight / 2;
+    Vec3D rotated = viewRotate(view, subVector(point, view->position));
+    float zFactor = rotated.z + viewportDistance;
+
+    if (zFactor > NEAR_PLANE) {
+        *x2D = (int)fmaxf(-COORDINATE_LIMIT, fminf(COORDINATE_LIMIT, rotated.x / zFactor * halfWidth)) + halfWidth;
+        *y2D = (int)fmaxf(-COORDINATE_LIMIT, fminf(COORDINATE_LIMIT, rotated.y / zFactor * halfHeight)) + halfHeight;
+        return true;
+    }
+    *x2D = halfWidth;
+    *y2D = halfHeight;
+    return false;
+}
+
+void initProjectedParticles(ProjectedParticles* projected) {
+    projected->x = NULL;
+    projected->y = NULL;
+    projected->depth = NULL;
+    projected->radius = NULL;
+    projected->index = NULL;
+    projected->order = NULL;
+    projected->count = 0;
+    projected->capacity = 0;
+}
+
+void freeProjectedParticles(ProjectedParticles* projected) {
+    free(projected->x);
+    free(projected->y);
+    free(projected->depth);
+    free(projected->radius);
+    free(projected->index);
+    free(projected->order);
+    initProjectedParticles(projected);
+}
+
+static int reserveProjectedParticles(ProjectedParticles* projected, int capacity) {
+    if (capacity <= projected->capacity) return 0;
+
+    float* x = realloc(projected->x, capacity * sizeof(float));
+    if (x == NULL) return -1;
+    projected->x = x;
+    float* y = realloc(projected->y, capacity * sizeof(float));
+    if (y == NULL) return -1;
+    projected->y = y;
+    float* depth = realloc(projected->depth, capacity * sizeof(float));
+    if (depth == NULL) return -1;
+    projected->depth = depth;
+    float* radius = realloc(projected->radius, capacity * sizeof(float));
+    if (radius == NULL) return -1;
+    projected->radius = radius;
+    int* index = realloc(projected->index, capacity * sizeof(int));
+    if (index == NULL) return -1;
+    projected->index = index;
+    int* order = realloc(projected->order, capacity * sizeof(int));
+    if (order == NULL) return -1;
+    projected->order = order;
+    projected->capacity = capacity;
+    return 0;
+}
+
+typedef struct {
+    ProjectedParticles* projected;
+    const ViewTransform* view;
+    const ParticleStore* store;
+} TransformContext;
+
+// Function to project particles [begin, end) into slots [begin, end) of the
+// buffer. Culled particles get a depth of -1 and are dropped when compacting.
+static void transformRange(const TransformContext* context, int begin, int end) {
+    const ViewTransform* view = context->view;
+    const ParticleStore* store = context->store;
+    ProjectedParticles* out = context->projected;
+    float width = (float)view->screenWidth;
+    float height = (float)view->screenHeight;
+    float halfWidth = (float)(view->screenWidth / 2);
+    float halfHeight = (float)(view->screenHeight / 2);
+    // Same distance scaling renderParticles has always used
+    float radiusScale = viewportDistance * view->screenHeight / 2;
+    float radiusBias = 0.1f * viewportDistance;
+    int i = begin;
+
+#ifdef __SSE2__
+    const __m128 m00 = _mm_set1_ps(view->m[0][0]), m02 = _mm_set1_ps(view->m[0][2]);
+    const __m128 m10 = _mm_set1_ps(view->m[1][0]), m11 = _mm_set1_ps(view->m[1][1]), m12 = _mm_set1_ps(view->m[1][2]);
+    const __m128 m20 = _mm_set1_ps(view->m[2][0]), m21 = _mm_set1_ps(view->m[2][1]), m22 = _mm_set1_ps(view->m[2][2]);
+    const __m128 cx = _mm_set1_ps(view->position.x);
+    const __m128 cy = _mm_set1_ps(view->position.y);
+    const __m128 cz = _mm_set1_ps(view->position.z);
+    const __m128 eyeDistance = _mm_set1_ps(viewportDistance);
+    const __m128 nearPlane = _mm_set1_ps(NEAR_PLANE);
+    const __m128 limit = _mm_set1_ps(COORDINATE_LIMIT);
+    const __m128 negativeLimit = _mm_set1_ps(-COORDINATE_LIMIT);
+    const __m128 vHalfWidth = _mm_set1_ps(halfWidth), vHalfHeight = _mm_set1_ps(halfHeight);
+    const __m128 vWidth = _mm_set1_ps(width), vHeight = _mm_set1_ps(height);
+    const __m128 vRadiusScale = _mm_set1_ps(radiusScale), vRadiusBias = _mm_set1_ps(radiusBias);
+    const __m128 zero = _mm_setzero_ps(), culled = _mm_set1_ps(-1.0f);
+
+    for (; i + 4 <= end; i += 4) {
+        __m128 tx = _mm_sub_ps(_mm_loadu_ps(store->px + i), cx);
+        __m128 ty = _mm_sub_ps(_mm_loadu_ps(store->py + i), cy);
+        __m128 tz = _mm_sub_ps(_mm_loadu_ps(store->pz + i), cz);
+        __m128 rx = _mm_add_ps(_mm_mul_ps(m00, tx), _mm_mul_ps(m02, tz));
+        __m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, tx), _mm_mul_ps(m11, ty)), _mm_mul_ps(m12, tz));
+        __m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, tx), _mm_mul_ps(m21, ty)), _mm_mul_ps(m22, tz));
+        __m128 zFactor = _mm_add_ps(rz, eyeDistance);
+        __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz)));
+
+        __m128 sx = _mm_mul_ps(_mm_div_ps(rx, zFactor), vHalfWidth);
+        __m128 sy = _mm_mul_ps(_mm_div_ps(ry, zFactor), vHalfHeight);
+        sx = _mm_max_ps(negativeLimit, _mm_min_ps(limit, sx));
+        sy = _mm_max_ps(negativeLimit, _mm_min_ps(limit, sy));
+        sx = _mm_add_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(sx)), vHalfWidth);
+        sy = _mm_add_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(sy)), vHalfHeight);
+        __m128 scale = _mm_div_ps(vRadiusScale, _mm_add_ps(distance, vRadiusBias));
+        __m128 radius = _mm_mul_ps(_mm_loadu_ps(store->radius + i), scale);
+
+        // Keep spheres in front of the eye whose bounding square touches the screen
+        __m128 visible = _mm_cmpgt_ps(zFactor, nearPlane);
+        visible = _mm_and_ps(visible, _mm_cmpge_ps(_mm_add_ps(sx, radius), zero));
+        visible = _mm_and_ps(visible, _mm_cmplt_ps(_mm_sub_ps(sx, radius), vWidth));
+        visible = _mm_and_ps(visible, _mm_cmpge_ps(_mm_add_ps(sy, radius), zero));
+        visible = _mm_and_ps(visible, _mm_cmplt_ps(_mm_sub_ps(sy, radius), vHeight));
+        __m128 depth = _mm_or_ps(_mm_and_ps(visible, zFactor), _mm_andnot_ps(visible, culled));
+
+        _mm_storeu_ps(out->x + i, sx);
+        _mm_storeu_ps(out->y + i, sy);
+        _mm_storeu_ps(out->depth + i, depth);
+        _mm_storeu_ps(out->radius + i, radius);
+    }
+#endif
+
+    for (; i < end; i++) {
+        float tx = store->px[i] - view->position.x;
+        float ty = store->py[i] - view->position.y;
+        float tz = store->pz[i] - view->position.z;
+        float rx = view->m[0][0] * tx + view->m[0][2] * tz;
+        float ry = view->m[1][0] * tx + view->m[1][1] * ty + view->m[1][2] * tz;
+        float rz = view->m[2][0] * tx + view->m[2][1] * ty + view->m[2][2] * tz;
+        float zFactor = rz + viewportDistance;
+        float distance = sqrtf(tx * tx + ty * ty + tz * tz);
+
+        float sx = fmaxf(-COORDINATE_LIMIT, fminf(COORDINATE_LIMIT, rx / zFactor * halfWidth));
+        float sy = fmaxf(-COORDINATE_LIMIT, fminf(COORDINATE_LIMIT, ry / zFactor * halfHeight));
+        sx = (float)(int)sx + halfWidth;
+        sy = (float)(int)sy + halfHeight;
+        float radius = store->radius[i] * (radiusScale / (distance + radiusBias));
+
+        bool visible = zFactor > NEAR_PLANE &&
+                       sx + radius >= 0.0f && sx - radius < width &&
+                       sy + radius >= 0.0f && sy - radius < height;
+        out->x[i] = sx;
+        out->y[i] = sy;
+        out->depth[i] = visible ? zFactor : -1.0f;
+        out->radius[i] = radius;
+    }
+}
+
+static void transformTask(void* context, int begin, int end, int worker) {
+    transformRange(context, begin, end);
+}
+
+static int depthBin(float depth, float nearest, float scale) {
+    int bin = (int)((depth - nearest) * scale);
+    return bin < DEPTH_BINS ? bin : DEPTH_BINS - 1;
+}
+
+// Function to fill 'order' with the visible entries nearest first. A counting
+// sort over depth slices is enough: the order only has to be roughly front to
+// back for the depth test to reject most hidden pixels, and it stays linear
+// in the particle count.
+static void sortFrontToBack(ProjectedParticles* projected) {
+    int count = projected->count;
+    if (count == 0) return;
+
+    float nearest = projected->depth[0], furthest = projected->depth[0];
+    for (int k = 1; k < count; k++) {
+        nearest = fminf(nearest, projected->depth[k]);
+        furthest = fmaxf(furthest, projected->depth[k]);
+    }
+    float scale = furthest > nearest ? DEPTH_BINS / (furthest - nearest) : 0.0f;
+
+    int binStart[DEPTH_BINS + 1] = {0};
+    for (int k = 0; k < count; k++) {
+        binStart[depthBin(projected->depth[k], nearest, scale) + 1]++;
+    }
+    for (int bin = 0; bin < DEPTH_BINS; bin++) {
+        binStart[bin + 1] += binStart[bin];
+    }
+    for (int k = 0; k < count; k++) {
+        projected->order[binStart[depthBin(projected->depth[k], nearest, scale)]++] = k;
+    }
+}
+
+// Function to run the per-frame view transform: project every particle with
+// the precomputed matrix, then keep only the ones inside the view frustum and
+// order them front to back. Returns the number of visible particles, or -1 if
+// memory ran out.
+int transformParticles(ProjectedParticles* projected, const ViewTransform* view, const ParticleStore* store) {
+    if (reserveProjectedParticles(projected, store->count) != 0) {
+        projected->count = 0;
+        return -1;
+    }
+
+    TransformContext context = {projected, view, store};
+    parallelFor(store->count, 4096, transformTask, &context);
+
+    // Compact in place; entry k never overtakes particle i
+    int visible = 0;
+    for (int i = 0; i < store->count; i++) {
+        if (projected->depth[i] < 0.0f) continue;
+        projected->x[visible] = projected->x[i];
+        projected->y[visible] = projected->y[i];
+        projected->depth[visible] = projected->depth[i];
+        projected->radius[visible] = projected->radius[i];
+        projected->index[visible] = i;
+        visible++;
+    }
+    projected->count = visible;
+    sortFrontToBack(projected);
+    return visible;
+}
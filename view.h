@@ -0,0 +1,42 @@
+// view.h
+
+#ifndef VIEW_H
+#define VIEW_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "particle.h"
+#include "raster.h"
+
+// Camera rotation baked into a matrix once per frame, so projecting a point
+// costs a few multiply-adds instead of four sinf/cosf calls
+struct ViewTransform {
+    float m[3][3];
+    Vec3D position;
+    int screenWidth;
+    int screenHeight;
+};
+
+// Screen-space positions of the particles that survived culling this frame.
+// Entry k describes particle index[k]; x and y are whole pixels, and radius
+// keeps its fraction so sub-pixel particles can be told apart. 'order' lists
+// the entries nearest first.
+struct ProjectedParticles {
+    float* x;
+    float* y;
+    float* depth;   // Distance along the view axis, larger is further away
+    float* radius;  // Projected radius in pixels, not rounded
+    int* index;
+    int* order;
+    int count;
+    int capacity;
+};
+
+void buildViewTransform(ViewTransform* view, Camera camera);
+Vec3D viewRotate(const ViewTransform* view, Vec3D v);
+bool projectPoint(const ViewTransform* view, Vec3D point, int* x2D, int* y2D);
+void initProjectedParticles(ProjectedParticles* projected);
+void freeProjectedParticles(ProjectedParticles* projected);
+int transformParticles(ProjectedParticles* projected, const ViewTransform* view, const ParticleStore* store);
+
+#endif // VIEW_H